@@ -72,27 +72,22 @@ void SetGradientFlag(bool gradflag) { _drawgrad = gradflag; }
 
 void SetBorderFlag(bool borderflag) { _drawborder = borderflag; }
 
-static bool ValidateVertex(CsiTSurfVertex *vtx1, CsiTSurfVertex *vtx2)
+// Border map of the surface being drawn, the one of distObj when it has been mounted
+static const BorderMap& GetBorders(CsiTSurf *surf)
 {
-	// Get vertex triangles
-	CsiTriangleItrList &triList1 = vtx1->triangleitrList();
-	CsiTriangleItrList &triList2 = vtx2->triangleitrList();
+	static CsiTSurf *s_surf = NULL;
+	static BorderMap s_borders;
 
-	int cont = 0;
-
-	for (CsiTriangleItrItr titritr1=triList1.begin(); titritr1!=triList1.end(); ++titritr1)
+	if( distObj != NULL && distObj->d_surf == surf && !distObj->GetBorderMap().Empty() )
+		return distObj->GetBorderMap();
+	if( s_surf != surf )
 	{
-		CsiTriangle *t1 = titritr1->self();
-		for (CsiTriangleItrItr titritr2=triList2.begin(); titritr2!=triList2.end(); ++titritr2)
-		{
-			CsiTriangle *t2 = titritr2->self();
-			if(t1 == t2)
-			 cont++;
-			if(cont > 1) return false;
-		}
+		DistAdjacency adjacency;
+		adjacency.Build(surf);
+		s_borders.Build(adjacency);
+		s_surf = surf;
 	}
-
-	return true;
+	return s_borders;
 }
 
 void CsiDraw(CsiTSurf *surf)
@@ -118,11 +113,12 @@ void CsiDraw(CsiTSurf *surf)
 		glEnd();
 	}
 
-	// DRAW BORDER TRIANGLES
+	// DRAW BORDER EDGES
 	if(_drawborder == true)
 	{
 		CsiTriangleList& tlist = surf->trianglesList();
 		CsiTSurfVertexArray& varray = surf->vertexArray();
+		const BorderMap &borders = GetBorders(surf);
 
 		glDisable(GL_LIGHTING);
 		glEnable(GL_POLYGON_OFFSET_LINE);
@@ -131,38 +127,15 @@ void CsiDraw(CsiTSurf *surf)
 		glBegin(GL_LINES);
 		glColor3d(1,0,0);
 		glLineWidth(4);
-		for (CsiTriangleItr t=tlist.begin(); t!=tlist.end(); ++t) {
-			bool vtx1 = DistCalc::isInBorder(surf, varray[t->v1]);
-			bool vtx2 = DistCalc::isInBorder(surf, varray[t->v2]);
-			bool vtx3 = DistCalc::isInBorder(surf, varray[t->v3]);
-			int sum = vtx1 + vtx2 + vtx3; 
-			if( sum <= 1 ) continue;
-			if( sum < 3 )
-			{
-				if( vtx1 && vtx2 )
-				{
-					if( !ValidateVertex(varray[t->v1], varray[t->v2]) )
-						continue;
-				}
-				if( vtx2 && vtx3 )
-				{
-					if( !ValidateVertex(varray[t->v2], varray[t->v3]) )
-						continue;
-				}
-				if( vtx1 && vtx3 )
-				{
-					if( !ValidateVertex(varray[t->v1], varray[t->v3]) )
-						continue;
-				}
+		size_t tri = 0;
+		for (CsiTriangleItr t=tlist.begin(); t!=tlist.end(); ++t, ++tri) {
+			for (int e = 0; e < 3; e++) {
+				if( !borders.Edge(tri, e) ) continue;
+				int va = e == 2 ? t->v2 : t->v1;
+				int vb = e == 0 ? t->v2 : t->v3;
+				glVertex3d(varray[va]->x, varray[va]->y, varray[va]->z*ZSCALE);
+				glVertex3d(varray[vb]->x, varray[vb]->y, varray[vb]->z*ZSCALE);
 			}
-			glVertex3d(varray[t->v1]->x, varray[t->v1]->y, varray[t->v1]->z*ZSCALE);
-			glVertex3d(varray[t->v2]->x, varray[t->v2]->y, varray[t->v2]->z*ZSCALE);
-
-			glVertex3d(varray[t->v3]->x, varray[t->v3]->y, varray[t->v3]->z*ZSCALE);
-			glVertex3d(varray[t->v1]->x, varray[t->v1]->y, varray[t->v1]->z*ZSCALE);
-
-			glVertex3d(varray[t->v2]->x, varray[t->v2]->y, varray[t->v2]->z*ZSCALE);
-			glVertex3d(varray[t->v3]->x, varray[t->v3]->y, varray[t->v3]->z*ZSCALE);
 		}
 
 		glEnd();
@@ -189,8 +162,8 @@ void CsiDraw(CsiTSurf *surf)
 	std::vector<double> &voxels = distObj->GetVoxels();
 	if( voxels.size() == 0 ) return;
 
-	std::vector<GeoPoint3D> &gradients = distObj->GetGradients();
-	std::vector< std::pair< GeoPoint3D, CsiTSurfVertex* > >& surfcells = distObj->GetSurfCells();
+	DistGradients &gradients = distObj->GetGradients();
+	const std::vector<size_t> &activecells = distObj->GetActiveCells();
 	double maxelm = *std::max_element(voxels.begin(), voxels.end());
 	glDisable(GL_LIGHTING);
 	//glPointSize(2.0);
@@ -202,7 +175,6 @@ void CsiDraw(CsiTSurf *surf)
 			for(k = 0; k <= distObj->d_nz; k++)
 			{
 				int idx = (distObj->d_nx+1)*(distObj->d_ny+1)*k + (distObj->d_nx+1)*j +i;
-				int idxC = (distObj->d_nx)*(distObj->d_ny)*k + (distObj->d_nx)*j +i;
 				// draw distance field
 				if( _drawfield == true )
 				{
@@ -219,17 +191,20 @@ void CsiDraw(CsiTSurf *surf)
 					distObj->d_min.z + k*distObj->d_size);
 					glVertex3d(point.x, point.y, point.z);
 				}
-
-				// draw selected cells for mesh rebuild
-				if (i == distObj->d_nx || j == distObj->d_ny || k == distObj->d_nz) continue;
-				if( _drawcell == true && surfcells.size() > 0 )
-				{
-					glColor3d(0,1,1);
-					glVertex3d(surfcells[idxC].first.x, surfcells[idxC].first.y, surfcells[idxC].first.z);
-				}
 			}
 		}
 	}
+
+	// draw selected cells for mesh rebuild
+	if( _drawcell == true )
+	{
+		glColor3d(0,1,1);
+		for(size_t c = 0; c < activecells.size(); c++)
+		{
+			GeoPoint3D center = distObj->CellCenter(activecells[c]);
+			glVertex3d(center.x, center.y, center.z);
+		}
+	}
 	glEnd();
 	// END DRAW DISTANCE FIELD
 
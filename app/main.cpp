@@ -1,4 +1,6 @@
 #include <cstdlib>
+#include <sstream>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -11,11 +13,17 @@
 #include "visualize.h"
 #include "testunit.h"
 #include "distio.h"
+#include "distcache.h"
+#include "distexport.h"
+#include "distobjects.h"
+#include "distexpr.h"
+#include "distsample.h"
+#include "distvolume.h"
+#include "disttrace.h"
+#include "distomp.h"
 
 using namespace std;
 
-#define NUM_THREADS 8
-
 CsiTSurf *tsurf = NULL;
 CsiTSurf *newsurf = NULL;
 DistCalc *distObj = NULL;
@@ -35,6 +43,28 @@ int main(int argc, char* argv[])
 	std::string surfname = argv[1];
 	
 	// NO_DF option: program does not calculate distance field, only displays original surface
+	// STREAM option: distance field is computed slab by slab straight into a .dfb file, without visualization
+	// VTI, NRRD and RAW options: same as STREAM, into VTK ImageData, NRRD or raw+JSON volumes
+	// CHECKPOINT option: distance field calculation can be resumed from a .ckpt file after being interrupted
+	// DC option: surface is regenerated by dual contouring instead of SurfaceNets
+	// FUSED option: distance field and SurfaceNets are computed brick by brick, the full field is not kept
+	// FEATURES option: closest triangle and (s,t) of every voxel are kept with the distance field, and saved
+	// WINDING option: distance is negative inside closed shells (salt bodies), by generalized winding number
+	// PREVIEW option: gradients are kept as 16 bit codes, half the memory, for quick looks (see DistGradients)
+	// OFFSETS option: surfaces one and two grid steps above and below the original one are saved to _OFF<d>.ts files
+	// OBJECTS option: every object of a multi-object file gets its own field, computed concurrently, and
+	// the surface is regenerated from their minimum
+	// LABELS option: the file lists .ts surfaces, one per line; the distance to the nearest one and its
+	// position in the list are computed in a single pass and saved to .dfb and _labels.raw files
+	// EXPR option: the file lists .dfb fields of the same grid, one per line, and ends with a postfix
+	// expression over them (f0 neg f1 max ...); the result is saved to an _expr.raw file described by _expr.json
+	// THICKNESS option: the file lists two .ts horizons; the distance to the first one is sampled from its
+	// field at every vertex of the second one and saved to a _thickness.txt file
+	// VOLUME option: the file lists .ts horizons, one per line followed by the side kept (neg or pos), and
+	// optionally a "contact <z>" line and a "polygon <x> <y> <x> <y> ..." outline; the gross rock volume
+	// of the region is printed
+	// TRACE option: the file lists a .ts surface and then one well path per line (x y z x y z ...); the
+	// crossings of every path with the surface are saved to a _hits.txt file
 	std::string optional;
 	if(argc == 3) optional = argv[2];
 
@@ -48,6 +78,283 @@ int main(int argc, char* argv[])
 		tsurf = CsiTSurf::Gocadload(surfname);
 		tsurf->normalsCoerence();
 	}
+	else if( optional == "STREAM" || optional == "VTI" || optional == "NRRD" || optional == "RAW" )
+	{
+		// Load Surface
+		tsurf = CsiTSurf::Gocadload(surfname);
+		tsurf->normalsCoerence();
+
+		distObj = new DistCalc(tsurf, surfname);
+		distObj->MountBorderMap();
+
+		std::string ext;
+		std::string basename;
+		DistIO::CutExt(surfname, basename, ext);
+		DistSlabSink *writer;
+		if( optional == "VTI" ) writer = new DistVtiWriter(basename);
+		else if( optional == "NRRD" ) writer = new DistNrrdWriter(basename);
+		else if( optional == "RAW" ) writer = new DistRawWriter(basename);
+		else writer = new DistBinaryWriter(basename + ".dfb");
+
+		bool ok = distObj->Grid2MeshStreamed(writer);
+		delete writer;
+		return ok ? 0 : 1;
+	}
+	else if( optional == "LABELS" )
+	{
+		// Load Surfaces
+		std::vector<CsiTSurf*> surfs;
+		std::ifstream list(surfname.c_str());
+		std::string line;
+		while( std::getline(list, line) )
+		{
+			if( line.empty() ) continue;
+			CsiTSurf *surf = CsiTSurf::Gocadload(line);
+			if( surf == NULL )
+			{
+				cerr << "Could not load surface " << line << endl;
+				return 1;
+			}
+			surf->normalsCoerence();
+			surfs.push_back(surf);
+		}
+
+		// Labels are unsigned short
+		if( surfs.empty() || surfs.size() > 65536 )
+		{
+			cerr << "The list must have from 1 to 65536 surfaces, it has " << surfs.size() << endl;
+			return 1;
+		}
+
+		std::vector<unsigned short> labels;
+		tsurf = DistCalc::MergeSurfaces(surfs, labels);
+		distObj = new DistCalc(tsurf, surfname);
+		distObj->MountBorderMap();
+		distObj->SetTriangleLabels(labels);
+		distObj->Grid2Mesh();
+
+		std::string ext;
+		std::string basename;
+		DistIO::CutExt(surfname, basename, ext);
+		bool ok = DistIO::SaveBinaryField(distObj, basename + ".dfb") && DistIO::SaveLabels(distObj, basename + "_labels.raw");
+		return ok ? 0 : 1;
+	}
+	else if( optional == "EXPR" )
+	{
+		// Map the input fields, the last line is the expression
+		std::vector<std::string> lines;
+		std::ifstream list(surfname.c_str());
+		std::string line;
+		while( std::getline(list, line) )
+			if( !line.empty() ) lines.push_back(line);
+		if( lines.empty() ) return 1;
+
+		std::vector<DistFieldView*> views;
+		DistExpression expr;
+		bool ok = true;
+		for( size_t f = 0; ok && f + 1 < lines.size(); f++ )
+		{
+			views.push_back(new DistFieldView());
+			if( views.back()->Open(lines[f]) == false )
+			{
+				cerr << "Could not open distance field " << lines[f] << endl;
+				ok = false;
+			}
+			else if( expr.Input(*views.back()) < 0 )
+			{
+				cerr << "Distance field " << lines[f] << " is not on the grid of the other inputs" << endl;
+				ok = false;
+			}
+		}
+		if( ok && expr.Parse(lines.back()) == false )
+		{
+			cerr << "Could not parse expression " << lines.back() << endl;
+			ok = false;
+		}
+
+		std::string ext;
+		std::string basename;
+		DistIO::CutExt(surfname, basename, ext);
+		ok = ok && expr.Evaluate(basename + "_expr");
+		for( size_t f = 0; f < views.size(); f++ ) delete views[f];
+		return ok ? 0 : 1;
+	}
+	else if( optional == "THICKNESS" )
+	{
+		// Load Surfaces
+		std::vector<CsiTSurf*> surfs;
+		std::ifstream list(surfname.c_str());
+		std::string line;
+		while( surfs.size() < 2 && std::getline(list, line) )
+		{
+			if( line.empty() ) continue;
+			CsiTSurf *surf = CsiTSurf::Gocadload(line);
+			if( surf == NULL )
+			{
+				cerr << "Could not load surface " << line << endl;
+				return 1;
+			}
+			surf->normalsCoerence();
+			surfs.push_back(surf);
+		}
+		if( surfs.size() < 2 ) return 1;
+
+		tsurf = surfs[0];
+		distObj = new DistCalc(tsurf, surfname);
+		distObj->MountBorderMap();
+		distObj->Grid2Mesh();
+
+		// Interpolated where within a thirty-second of a voxel of the exact distance
+		DistSampler sampler(distObj, SAMPLE_TRICUBIC, distObj->d_size/32);
+		std::vector<double> thickness;
+		sampler.SampleVertices(surfs[1], thickness);
+		cerr << "Thickness: " << sampler.NumExact() << " of " << thickness.size() << " vertices queried exactly" << endl;
+
+		std::string ext;
+		std::string basename;
+		DistIO::CutExt(surfname, basename, ext);
+		std::ofstream out((basename + "_thickness.txt").c_str());
+		CsiTSurfVertexArray &vtxArray = surfs[1]->vertexArray();
+		for( size_t v = 0; v < thickness.size(); v++ )
+			out << vtxArray[v]->x << " " << vtxArray[v]->y << " " << vtxArray[v]->z << " " << thickness[v] << '\n';
+		return out.good() ? 0 : 1;
+	}
+	else if( optional == "VOLUME" )
+	{
+		// Load Surfaces, with the side of each one that is kept, and the contact
+		std::vector<CsiTSurf*> surfs;
+		std::vector<int> sides;
+		DistVolume volume;
+		std::ifstream list(surfname.c_str());
+		std::string line;
+		while( std::getline(list, line) )
+		{
+			std::istringstream words(line);
+			std::string name;
+			if( !(words >> name) ) continue;
+			if( name == "contact" )
+			{
+				double z;
+				if( !(words >> z) )
+				{
+					cerr << "Invalid contact line: " << line << endl;
+					return 1;
+				}
+				volume.SetContact(z);
+				continue;
+			}
+			if( name == "polygon" )
+			{
+				std::vector<GeoPoint3D> polygon;
+				GeoPoint3D p;
+				while( words >> p.x >> p.y ) polygon.push_back(p);
+				if( polygon.size() < 3 || !words.eof() )
+				{
+					cerr << "Invalid polygon line, it needs three or more x y pairs: " << line << endl;
+					return 1;
+				}
+				volume.SetPolygon(polygon);
+				continue;
+			}
+
+			std::string side;
+			if( !(words >> side) || (side != "neg" && side != "pos") )
+			{
+				cerr << "Surface " << name << " needs the side kept, neg or pos" << endl;
+				return 1;
+			}
+			CsiTSurf *surf = CsiTSurf::Gocadload(name);
+			if( surf == NULL )
+			{
+				cerr << "Could not load surface " << name << endl;
+				return 1;
+			}
+			surf->normalsCoerence();
+			surfs.push_back(surf);
+			sides.push_back(side == "neg" ? VOLUME_NEGATIVE : VOLUME_POSITIVE);
+		}
+		if( surfs.empty() ) return 1;
+
+		// Fields of the horizons on the union of their grids
+		std::vector<DistCalc*> fields;
+		for( size_t s = 0; s < surfs.size(); s++ )
+			fields.push_back(new DistCalc(surfs[s], surfname));
+		GeoPoint3D gmin = fields[0]->d_min, gmax = fields[0]->d_max;
+		for( size_t s = 1; s < fields.size(); s++ )
+		{
+			const GeoPoint3D &fmin = fields[s]->d_min, &fmax = fields[s]->d_max;
+			gmin = GeoPoint3D(std::min(gmin.x, fmin.x), std::min(gmin.y, fmin.y), std::min(gmin.z, fmin.z));
+			gmax = GeoPoint3D(std::max(gmax.x, fmax.x), std::max(gmax.y, fmax.y), std::max(gmax.z, fmax.z));
+		}
+		for( size_t s = 0; s < surfs.size(); s++ )
+		{
+			fields[s]->SetGrid(gmin, gmax, fields[0]->d_size);
+			fields[s]->MountBorderMap();
+			fields[s]->Grid2Mesh();
+			if( volume.AddField(fields[s], sides[s]) == false )
+			{
+				cerr << "Distance field of surface " << s << " is not on the common grid" << endl;
+				return 1;
+			}
+		}
+
+		cout << "Gross rock volume: " << volume.Integrate() << endl;
+		return 0;
+	}
+	else if( optional == "TRACE" )
+	{
+		// Load Surface and well paths
+		std::ifstream list(surfname.c_str());
+		std::string line;
+		while( std::getline(list, line) && line.empty() );
+		tsurf = line.empty() ? NULL : CsiTSurf::Gocadload(line);
+		if( tsurf == NULL ) return 1;
+		tsurf->normalsCoerence();
+
+		std::vector<std::vector<GeoPoint3D> > paths;
+		while( std::getline(list, line) )
+		{
+			std::istringstream words(line);
+			std::vector<GeoPoint3D> path;
+			GeoPoint3D p;
+			while( words >> p.x >> p.y >> p.z ) path.push_back(p);
+			if( path.size() > 1 ) paths.push_back(path);
+		}
+
+		distObj = new DistCalc(tsurf, surfname);
+		distObj->MountBorderMap();
+		distObj->Grid2Mesh();
+
+		DistTracer tracer(distObj);
+		std::vector<std::vector<DistTracer::Well_Hit> > hits;
+		tracer.Trace(paths, hits);
+
+		std::string ext;
+		std::string basename;
+		DistIO::CutExt(surfname, basename, ext);
+		std::ofstream out((basename + "_hits.txt").c_str());
+		out.precision(17);
+		for( size_t w = 0; w < hits.size(); w++ )
+			for( size_t h = 0; h < hits[w].size(); h++ )
+			{
+				const DistTracer::Well_Hit &hit = hits[w][h];
+				out << w << " " << hit.md << " " << hit.point.x << " " << hit.point.y << " " << hit.point.z << " " <<
+					hit.triId << " " << hit.orientation << '\n';
+			}
+		return out.good() ? 0 : 1;
+	}
+	else if( optional == "OBJECTS" )
+	{
+		// Load Surface
+		tsurf = CsiTSurf::Gocadload(surfname);
+		tsurf->normalsCoerence();
+
+		// Fields of the objects of the file, on tight boxes of a common lattice, and their minimum
+		DistObjects *objects = new DistObjects(tsurf, surfname);
+		objects->Grid2Mesh();
+		distObj = objects->Combine();
+		newsurf = distObj->SurfaceNets();
+	}
 	else if( surfname.find(".ts") != std::string::npos ) // Loading a surface file
 	{
 		// Load Surface
@@ -56,12 +363,50 @@ int main(int argc, char* argv[])
 
 		distObj = new DistCalc(tsurf, argv[1]);
 		distObj->MountBorderMap();
+		if( optional == "CHECKPOINT" ) distObj->SetCheckpoint(surfname + ".ckpt");
+		if( optional == "FEATURES" ) distObj->SetClosestFeatures(true);
+		if( optional == "WINDING" ) distObj->SetSignMode(SIGN_WINDING);
+		if( optional == "PREVIEW" ) distObj->SetGradientBits(16);
 
-		if( surfname.find("NET") == std::string::npos ) // Loading an original surface, calculate distance field 
+		if( optional == "FUSED" && surfname.find("NET") == std::string::npos )
 		{
-			distObj->Grid2Mesh(); // Load Grid
-			// Regenerate surface using SurfaceNets Algorithm
-			newsurf = distObj->SurfaceNets();
+			// Regenerate surface straight from the original one, without materializing the distance field
+			newsurf = distObj->Grid2MeshNets();
+		}
+		else if( surfname.find("NET") == std::string::npos ) // Loading an original surface, calculate distance field 
+		{
+			// Load Grid, reusing a previously computed field of the same mesh and grid when cached
+			DistCache *cache = DistCache::GetInstance();
+			if( cache->Load(distObj) == false )
+			{
+				distObj->Grid2Mesh();
+				cache->Store(distObj);
+			}
+			cerr << "Distance field cache: " << cache->Hits() << " hits, " << cache->Misses() << " misses, "
+			     << cache->Evictions() << " evictions" << endl;
+
+			// Offset surfaces one and two grid steps to each side, saved next to the original one
+			if( optional == "OFFSETS" )
+			{
+				std::string ext;
+				std::string basename;
+				DistIO::CutExt(surfname, basename, ext);
+				std::vector<double> isovalues;
+				for(int n = -2; n <= 2; n++)
+					if( n != 0 ) isovalues.push_back(n*distObj->d_size);
+				std::vector<CsiTSurf*> offsets = distObj->OffsetSurfaces(isovalues);
+				for(size_t s = 0; s < offsets.size(); s++)
+				{
+					std::ostringstream name;
+					name << basename << "_OFF" << isovalues[s] << ".ts";
+					offsets[s]->save(name.str());
+					delete offsets[s];
+				}
+			}
+
+			// Regenerate surface using SurfaceNets Algorithm, or Dual Contouring
+			if( optional == "DC" ) newsurf = distObj->DualContouring();
+			else newsurf = distObj->SurfaceNets();
 		}
 	}
 	else if( surfname.find(".df") != std::string::npos ) // Loading a distance field file
@@ -82,6 +427,11 @@ int main(int argc, char* argv[])
 #ifdef DBGTEST
 	// Run test unit
 	testTriangle(surfname);
+	testCheckpoint(surfname);
+	testVolume();
+	testTrace();
+	testPseudonormals();
+	testGradientCodes();
 #endif
 
 	// Start Visualization
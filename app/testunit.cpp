@@ -1,6 +1,11 @@
 #include <cstdio>
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include "distcalc.h"
+#include "distvolume.h"
+#include "disttrace.h"
 #include "testunit.h"
 
 using namespace std;
@@ -338,6 +343,7 @@ extern bool reg3;
 extern bool reg4;
 extern bool reg5;
 extern bool reg6;
+extern unsigned int ckptStopAfter;
 #endif
 
 void testTriangle(std::string surfname)
@@ -370,3 +376,336 @@ void testTriangle(std::string surfname)
 #endif
 }
 
+
+// Interrupts a checkpointed Grid2Mesh run twice and checks that the resumed result is bit
+// for bit the one of an uninterrupted run. The first run flushes every tile and its file is
+// then cut in the middle of its last tile, as by a kill during a flush; the second one flushes
+// rarely, so its completed tiles are still pending when it stops. The interruptions are
+// simulated inside the process: libgomp cannot run parallel regions in a forked child.
+void testCheckpoint(std::string surfname)
+{
+	CsiTSurf *tsurf = CsiTSurf::Gocadload(surfname);
+	std::string ckptfile = surfname + ".ckpt";
+	remove(ckptfile.c_str());
+
+	cout << "Checking Grid2Mesh checkpoint and resume..." << endl;
+
+	DistCalc reference(tsurf, surfname);
+	reference.MountBorderMap();
+	reference.SetClosestFeatures(true);
+	reference.Grid2Mesh();
+
+	// Tiles of one plane, flushed as soon as they are completed
+	unsigned int ntiles = reference.d_nz + 1;
+	DistCalc flushed(tsurf, surfname);
+	flushed.MountBorderMap();
+	flushed.SetCheckpoint(ckptfile, 1, 0);
+	flushed.SetClosestFeatures(true);
+	ckptStopAfter = ntiles/2;
+	flushed.Grid2Mesh();
+
+	// Drop half of the (s,t) of the last flushed tile, the end of the file
+	std::vector<char> bytes;
+	FILE *fp = fopen(ckptfile.c_str(), "rb");
+	if( fp != NULL )
+	{
+		char buffer[65536];
+		size_t n;
+		while( (n = fread(buffer, 1, sizeof(buffer), fp)) > 0 )
+			bytes.insert(bytes.end(), buffer, buffer + n);
+		fclose(fp);
+	}
+	size_t cut = (size_t)(reference.d_nx+1)*(reference.d_ny+1)*sizeof(unsigned int)/2;
+	fp = fopen(ckptfile.c_str(), "wb");
+	if( fp == NULL || bytes.size() <= cut || fwrite(&bytes[0], 1, bytes.size() - cut, fp) != bytes.size() - cut )
+	{
+		cout << "Error: could not truncate the checkpoint file" << endl;
+		errorCount++;
+	}
+	if( fp != NULL ) fclose(fp);
+
+	// Flushed only after an hour, the tiles of this run are lost
+	DistCalc pending(tsurf, surfname);
+	pending.MountBorderMap();
+	pending.SetCheckpoint(ckptfile, 1, 3600);
+	pending.SetClosestFeatures(true);
+	ckptStopAfter = (ntiles + 3)/4;
+	pending.Grid2Mesh();
+	ckptStopAfter = 0;
+
+	DistCalc resumed(tsurf, surfname);
+	resumed.MountBorderMap();
+	resumed.SetCheckpoint(ckptfile, 1, 0);
+	resumed.SetClosestFeatures(true);
+	resumed.Grid2Mesh();
+
+	std::vector<double> &v0 = reference.GetVoxels();
+	std::vector<double> &v1 = resumed.GetVoxels();
+	DistGradients &g0 = reference.GetGradients();
+	DistGradients &g1 = resumed.GetGradients();
+	bool same = v0.size() == v1.size() && memcmp(&v0[0], &v1[0], v0.size()*sizeof(double)) == 0 &&
+	            reference.GetBorders() == resumed.GetBorders() && g0.size() == g1.size() &&
+	            memcmp(g0.Codes(), g1.Codes(), g0.size()*g0.CodeSize()) == 0 &&
+	            reference.GetClosestTriangles() == resumed.GetClosestTriangles() &&
+	            reference.GetClosestST() == resumed.GetClosestST();
+
+	if( !same )
+	{
+		cout << "Error: resumed distance field differs from the uninterrupted one" << endl;
+		errorCount++;
+	}
+	else cout << "Resumed distance field matches." << endl;
+
+	FILE *leftover = fopen(ckptfile.c_str(), "rb");
+	if( leftover != NULL )
+	{
+		cout << "Error: checkpoint file was not removed" << endl;
+		errorCount++;
+		fclose(leftover);
+	}
+}
+
+// Horizontal surface at height z of quads by quads squares of the given side from the origin, each
+// split along its diagonal from (i,j) to (i+1,j+1), and its field computed on the given grid
+static DistCalc *planeField(CsiTSurf *&plane, int quads, double side, double z, const GeoPoint3D &min, const GeoPoint3D &max, double size)
+{
+	plane = new CsiTSurf("plane");
+	for( int j = 0; j <= quads; j++ )
+		for( int i = 0; i <= quads; i++ )
+			plane->addVertex(side*i, side*j, z, 1);
+	for( int j = 0; j < quads; j++ )
+		for( int i = 0; i < quads; i++ )
+		{
+			int a = (quads + 1)*j + i;
+			plane->addTriangle(a, a + 1, a + quads + 2);
+			plane->addTriangle(a, a + quads + 2, a + quads + 1);
+		}
+	plane->normalsCoerence();
+
+	DistCalc *field = new DistCalc(plane, "plane");
+	field->SetGrid(min, max, size);
+	field->MountBorderMap();
+	field->Grid2Mesh();
+	return field;
+}
+
+// Checks the volume of the part of tetrahedra below zero against analytic cases, and the gross
+// rock volume of a slab above a plane, below a contact and inside a rectangle, which the linear
+// pieces of every cell describe exactly
+void testVolume()
+{
+	cout << "Checking gross rock volume integration..." << endl;
+
+	// Corner values of linear functions over the tetrahedron (0,0,0), (1,0,0), (0,1,0), (0,0,1)
+	const double cases[][5] = {
+		{ -1, -2, -3, -4, 1 },
+		{ 1, 2, 3, 4, 0 },
+		{ -1, 1, 1, 1, 1.0/8 }, // x+y+z < 1/2
+		{ 1, -1, -1, -1, 7.0/8 },
+		{ -0.25, 0.75, -0.25, -0.25, 37.0/64 }, // x < 1/4
+		{ -0.25, 0.75, 0.75, -0.25, 5.0/32 }, // x+y < 1/4, two equal negative corners
+		{ -0.5, 0.5, 0.5, -0.25, 7.0/18 }, // x+y+z/4 < 1/2
+		{ -1, -1, 1, 1, 0.5 }
+	};
+	for( size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); c++ )
+	{
+		double frac = DistVolume::TetraFraction(cases[c]);
+		if( fabs(frac - cases[c][4]) > 1e-12 )
+		{
+			cout << "Error: tetrahedron " << c << " fraction " << frac << ", expected " << cases[c][4] << endl;
+			errorCount++;
+		}
+	}
+
+	// Horizon z = 0.5, wider than the grid so that every voxel is closest to its inside, halfway
+	// between grid planes so that the crossings are exact even with squared test distances
+	CsiTSurf *plane;
+	DistCalc *field = planeField(plane, 1, 10, 0.5, GeoPoint3D(2, 2, -3), GeoPoint3D(8, 8, 4), 1);
+
+	// Above the horizon, below the contact and inside the rectangle
+	std::vector<GeoPoint3D> rectangle;
+	rectangle.push_back(GeoPoint3D(3.25, 2.5, 0));
+	rectangle.push_back(GeoPoint3D(6.5, 2.5, 0));
+	rectangle.push_back(GeoPoint3D(6.5, 7.75, 0));
+	rectangle.push_back(GeoPoint3D(3.25, 7.75, 0));
+	bool positiveAbove = field->GetVoxels().back() > 0;
+
+	DistVolume volume;
+	volume.AddField(field, positiveAbove ? VOLUME_POSITIVE : VOLUME_NEGATIVE);
+	volume.SetContact(2.5);
+	volume.SetPolygon(rectangle);
+	double total = volume.Integrate();
+	double exact = 3.25*5.25*2;
+	if( fabs(total - exact) > 1e-9*exact )
+	{
+		cout << "Error: slab volume " << total << ", expected " << exact << endl;
+		errorCount++;
+	}
+
+	// Same totals and columns with a single thread
+	std::vector<double> columns = volume.GetColumns();
+	volume.SetThreads(1);
+	if( volume.Integrate() != total || volume.GetColumns() != columns )
+	{
+		cout << "Error: volume differs with a single thread" << endl;
+		errorCount++;
+	}
+	else cout << "Volume matches: " << total << endl;
+
+	delete field;
+	delete plane;
+}
+
+// Checks the crossings of well paths with a horizontal surface of eight triangles: a vertical
+// path, one through the vertex shared by six triangles, and one whose joint is on the surface.
+// The surface is smaller than one unit, so that the squared distances of test builds are still
+// lower bounds of the distance.
+void testTrace()
+{
+	cout << "Checking well path crossings..." << endl;
+
+	// Two by two quads at z = 0.25, each split along its diagonal from (i,j) to (i+1,j+1)
+	CsiTSurf *plane;
+	DistCalc *field = planeField(plane, 2, 0.5, 0.25, GeoPoint3D(-0.2, -0.2, -0.2), GeoPoint3D(1.2, 1.2, 0.7), 0.1);
+	DistTracer tracer(field);
+	std::vector<DistTracer::Well_Hit> hits;
+
+	// Down through the upper triangle of the first quad, against its normal
+	std::vector<GeoPoint3D> path;
+	path.push_back(GeoPoint3D(0.2, 0.35, 0.6));
+	path.push_back(GeoPoint3D(0.2, 0.35, -0.1));
+	tracer.Trace(path, hits);
+	if( hits.size() != 1 || hits[0].point.z != 0.25 || fabs(hits[0].md - 0.35) > 1e-12 ||
+	    hits[0].triId != 1 || hits[0].orientation != -1 )
+	{
+		cout << "Error: vertical path gives " << hits.size() << " crossings" << endl;
+		errorCount++;
+	}
+
+	// Through the vertex in the middle
+	path[0] = GeoPoint3D(0.5, 0.5, 0.6);
+	path[1] = GeoPoint3D(0.5, 0.5, -0.1);
+	tracer.Trace(path, hits);
+	if( hits.size() != 1 || hits[0].triId != 0 )
+	{
+		cout << "Error: path through a shared vertex gives " << hits.size() << " crossings" << endl;
+		errorCount++;
+	}
+
+	// Bent on the surface, the crossing belongs to the second segment
+	path[0] = GeoPoint3D(0.7, 0.8, 0.6);
+	path[1] = GeoPoint3D(0.7, 0.8, 0.25);
+	path.push_back(GeoPoint3D(0.9, 0.1, -0.1));
+	tracer.Trace(path, hits);
+	if( hits.size() != 1 || hits[0].segment != 1 || hits[0].triId != 7 || fabs(hits[0].md - 0.35) > 1e-12 )
+	{
+		cout << "Error: path with a joint on the surface gives " << hits.size() << " crossings" << endl;
+		errorCount++;
+	}
+	else cout << "Well path crossings match." << endl;
+
+	delete field;
+	delete plane;
+}
+
+// Checks that the pseudonormals of a flat surface with a zero area triangle and a sliver on its
+// border are all the unit normal of the plane, and that points on either side get its sign
+void testPseudonormals()
+{
+	cout << "Checking pseudonormals of degenerate triangles..." << endl;
+
+	// Unit square at z = 0, the zero area triangle (0, 4, 1) on its edge y = 0 and the sliver
+	// (1, 5, 2) on its edge x = 1
+	CsiTSurf *plane = new CsiTSurf("plane");
+	plane->addVertex(0, 0, 0, 1);
+	plane->addVertex(1, 0, 0, 1);
+	plane->addVertex(1, 1, 0, 1);
+	plane->addVertex(0, 1, 0, 1);
+	plane->addVertex(0.5, 0, 0, 1);
+	plane->addVertex(1 + 1e-7, 0.5, 0, 1);
+	plane->addTriangle(0, 1, 2);
+	plane->addTriangle(0, 2, 3);
+	plane->addTriangle(0, 4, 1);
+	plane->addTriangle(1, 5, 2);
+
+	DistCalc field(plane, "plane");
+	unsigned int bad = 0;
+	for( unsigned int tri = 0; tri < 4; tri++ )
+		for( int feat = FEAT_FACE; feat <= FEAT_E23; feat++ )
+		{
+			GeoPoint3D n = field.Pseudonormal(tri, feat);
+			if( !(fabs(n.x) < 1e-12 && fabs(n.y) < 1e-12 && fabs(n.z - 1) < 1e-12) ) bad++;
+		}
+	if( bad > 0 )
+	{
+		cout << "Error: " << bad << " pseudonormals are not the normal of the plane" << endl;
+		errorCount++;
+	}
+
+	// Beside the zero area triangle and the sliver, above and below
+	const double points[][3] = { { 0.5, -0.1, 0.2 }, { 0.5, -0.1, -0.2 }, { 1.2, 0.5, 0.2 }, { 1.2, 0.5, -0.2 } };
+	for( int p = 0; p < 4; p++ )
+	{
+		double s = 0, t = 0;
+		double d = field.Point2MeshDistance(GeoPoint3D(points[p][0], points[p][1], points[p][2]), s, t);
+		if( !((d > 0) == (points[p][2] > 0) && d != 0) )
+		{
+			cout << "Error: point " << p << " beside a degenerate triangle has distance " << d << endl;
+			errorCount++;
+			bad++;
+		}
+	}
+	if( bad == 0 ) cout << "Pseudonormals match." << endl;
+
+	delete plane;
+}
+
+// Checks the angular error of the octahedral gradient codes of both sizes against the bound of
+// DistGradients::MaxAngularError, over random directions, the axes and the diagonals, and that
+// the zero vector is kept
+void testGradientCodes()
+{
+	cout << "Checking octahedral gradient codes..." << endl;
+
+	std::vector<GeoPoint3D> dirs;
+	for( int a = -1; a <= 1; a++ )
+		for( int b = -1; b <= 1; b++ )
+			for( int c = -1; c <= 1; c++ )
+				if( a != 0 || b != 0 || c != 0 ) dirs.push_back(normalize(GeoPoint3D(a, b, c)));
+	srand(7);
+	while( dirs.size() < 1000000 )
+	{
+		GeoPoint3D g(2.0*rand()/RAND_MAX - 1, 2.0*rand()/RAND_MAX - 1, 2.0*rand()/RAND_MAX - 1);
+		double len = sqrt(inner(g, g));
+		if( len > 1e-3 && len <= 1 ) dirs.push_back((1/len)*g);
+	}
+
+	const int bits[2] = { 32, 16 };
+	for( int b = 0; b < 2; b++ )
+	{
+		DistGradients codes(bits[b]);
+		codes.resize(dirs.size() + 1);
+		codes.Encode(0, &dirs[0], dirs.size());
+		codes.set(dirs.size(), GeoPoint3D(0, 0, 0));
+
+		double worst = 0;
+		for( size_t d = 0; d < dirs.size(); d++ )
+		{
+			double cosine = std::min(1.0, std::max(-1.0, inner(codes[d], dirs[d])));
+			worst = std::max(worst, acos(cosine)*45/atan(1.0));
+		}
+		if( worst > DistGradients::MaxAngularError(bits[b]) )
+		{
+			cout << "Error: " << bits[b] << " bit codes err by " << worst << " degrees" << endl;
+			errorCount++;
+		}
+		else cout << bits[b] << " bit codes err by at most " << worst << " degrees." << endl;
+
+		GeoPoint3D zero = codes[dirs.size()];
+		if( zero.x != 0 || zero.y != 0 || zero.z != 0 )
+		{
+			cout << "Error: " << bits[b] << " bit code of the zero vector is not zero" << endl;
+			errorCount++;
+		}
+	}
+}
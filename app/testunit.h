@@ -5,4 +5,24 @@
 // between a point and a triangle.
 void testTriangle(std::string surfname);
 
+// Checks that an interrupted and resumed Grid2Mesh run gives the same distance field as
+// an uninterrupted one.
+void testCheckpoint(std::string surfname);
+
+// Checks gross rock volumes against analytic tetrahedra and an exact slab, and that a single
+// thread gives the same totals.
+void testVolume();
+
+// Checks the crossings of well paths with a surface, through a triangle, a shared vertex and at
+// a joint of the path.
+void testTrace();
+
+// Checks the pseudonormals of a surface with a zero area triangle and a sliver, and the signs
+// beside them.
+void testPseudonormals();
+
+// Checks the angular error bound of the 32 and 16 bit gradient codes and the code of the zero
+// vector.
+void testGradientCodes();
+
 #endif
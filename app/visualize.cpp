@@ -22,6 +22,12 @@ VManipulator* manip;
 
 static std::string _fileName;
 
+// Reports the end of a background distance field save
+static void _SaveDone(bool ok)
+{
+	if( ok ) std::cerr << "Distance field saved." << std::endl;
+}
+
 void Visualize::initialize()
 {
 	GeoPoint3D min, max;
@@ -160,13 +166,13 @@ static void keyboard( unsigned char key, int , int )
 				newsurf->name(_fileName + "_NET");
 				newsurf->save(_fileName + "_NET" + ext);
 
-				// Save Distance field into a file
-				DistIO::GetInstance()->SaveDistField (distObj);
+				// Save Distance field into a file, in background
+				DistIO::GetInstance()->SaveDistFieldAsync (distObj, _SaveDone);
 			}
 			break;
 		case 'f':
-			// Save Distance field into a file
-			DistIO::GetInstance()->SaveDistField (distObj);
+			// Save Distance field into a file, in background
+			DistIO::GetInstance()->SaveDistFieldAsync (distObj, _SaveDone);
 			break;
 		default:      
 			break;
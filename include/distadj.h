@@ -0,0 +1,63 @@
+#ifndef _distadj_h_
+#define _distadj_h_
+
+#include <vector>
+#include "CsiTSurf.h"
+
+#define NO_EDGE 0xFFFFFFFFu
+
+/**
+* Vertex-triangle adjacency of a triangle mesh in compressed sparse row form: the triangles around
+* each vertex, the vertices sharing an edge with it and the triangles sharing each edge, each one a
+* flat array plus the offset of every row. Built in parallel with counting sorts from the triangle
+* index array, so traversals read contiguous memory instead of the per-vertex triangle lists.
+* Triangles are identified by their position in the triangle list and their edges by slot 0, 1, 2
+* for v1v2, v1v3, v2v3. Rows of triangles are in increasing id order, rows of vertices sorted.
+*/
+class DistAdjacency
+{
+	std::vector<int> d_trivertices; // v1, v2, v3 of each triangle
+	std::vector<unsigned int> d_vtxfirst, d_vtxtris; // triangles around each vertex
+	std::vector<unsigned int> d_nbrfirst, d_nbrs; // vertices sharing an edge with each vertex
+	std::vector<unsigned int> d_edgefirst; // id of the first edge of each vertex, an edge belongs to its lower vertex
+	std::vector<int> d_edgevertices; // lower and higher vertex of each edge
+	std::vector<unsigned int> d_triedges; // edge id of each triangle edge slot, three per triangle
+	std::vector<unsigned int> d_edgetrifirst, d_edgetris; // triangles sharing each edge
+
+public:
+	DistAdjacency() : d_trivertices(), d_vtxfirst(), d_vtxtris(), d_nbrfirst(), d_nbrs(), d_edgefirst(),
+	  d_edgevertices(), d_triedges(), d_edgetrifirst(), d_edgetris() {}
+
+	void Build(CsiTSurf *surf);
+
+	bool Empty() const { return d_vtxfirst.empty(); }
+
+	size_t NumVertices() const { return d_vtxfirst.empty() ? 0 : d_vtxfirst.size() - 1; }
+
+	size_t NumTriangles() const { return d_trivertices.size()/3; }
+
+	size_t NumEdges() const { return d_edgevertices.size()/2; }
+
+	int TriangleVertex(size_t tri, int c) const { return d_trivertices[3*tri + c]; }
+
+	unsigned int NumVertexTriangles(int v) const { return d_vtxfirst[v+1] - d_vtxfirst[v]; }
+
+	const unsigned int* VertexTriangles(int v) const { return d_vtxtris.data() + d_vtxfirst[v]; }
+
+	unsigned int NumVertexNeighbors(int v) const { return d_nbrfirst[v+1] - d_nbrfirst[v]; }
+
+	const unsigned int* VertexNeighbors(int v) const { return d_nbrs.data() + d_nbrfirst[v]; }
+
+	unsigned int Edge(size_t tri, int slot) const { return d_triedges[3*tri + slot]; }
+
+	unsigned int FindEdge(int a, int b) const;
+
+	void EdgeVertices(unsigned int edge, int &lo, int &hi) const { lo = d_edgevertices[2*edge]; hi = d_edgevertices[2*edge+1]; }
+
+	unsigned int NumEdgeTriangles(unsigned int edge) const { return d_edgetrifirst[edge+1] - d_edgetrifirst[edge]; }
+
+	const unsigned int* EdgeTriangles(unsigned int edge) const { return d_edgetris.data() + d_edgetrifirst[edge]; }
+
+	static void SlotVertices(int slot, int &a, int &b) { a = slot == 2 ? 1 : 0; b = slot == 0 ? 1 : 2; }
+};
+#endif
@@ -0,0 +1,38 @@
+#ifndef _distborder_h_
+#define _distborder_h_
+
+#include <vector>
+#include <string>
+#include "distadj.h"
+
+/**
+* Border vertices and edges of a triangle mesh, as bitsets. An edge is on the border when a
+* single triangle uses it; a vertex when it has a border edge. The BSTONE and BORDER records of
+* the GOCAD file, when present, are added to what the edge count finds. Edges are addressed by
+* triangle id (position in the triangle list) and edge slot 0, 1, 2 for v1v2, v1v3, v2v3.
+*/
+class BorderMap
+{
+	std::vector<bool> d_vertices; // border flag of each vertex
+	std::vector<bool> d_edges; // border flag of each triangle edge, three per triangle
+	unsigned int d_nvertices, d_nedges; // number of border vertices and edges
+
+	void ReadRecords(std::string filename, const DistAdjacency &adjacency,
+		std::vector<unsigned char> &vflags, std::vector<unsigned char> &eflags);
+
+public:
+	BorderMap() : d_vertices(), d_edges(), d_nvertices(0), d_nedges(0) {}
+
+	void Build(const DistAdjacency &adjacency, std::string filename = "");
+
+	bool Empty() const { return d_vertices.empty(); }
+
+	bool Vertex(int v) const { return !d_vertices.empty() && d_vertices[v]; }
+
+	bool Edge(size_t tri, int slot) const { return !d_edges.empty() && d_edges[3*tri + slot]; }
+
+	unsigned int NumVertices() const { return d_nvertices; }
+
+	unsigned int NumEdges() const { return d_nedges; }
+};
+#endif
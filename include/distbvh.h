@@ -0,0 +1,104 @@
+#ifndef _distbvh_h_
+#define _distbvh_h_
+
+#include <vector>
+#include "CsiTSurf.h"
+
+#define BVH_STACK 64 // traversal stack kept on the call stack, for trees less deep than this
+
+/**
+* Bounding volume hierarchy over the triangles of a mesh, shared by the closest point queries,
+* the winding number, the samplers and the well tracer: a closest point query visits the nearer
+* child first and skips every node whose box is farther than the closest triangle found so far,
+* so a point costs about O(log T) triangle tests instead of T.
+*/
+class DistBVH
+{
+public:
+	typedef struct bvh_node {
+		GeoPoint3D bmin, bmax;
+		unsigned int first, count; // triangles of a leaf, in Order
+		unsigned int left, right; // children of an inner node
+	} BVH_Node;
+
+private:
+	std::vector<BVH_Node> d_nodes; // root first
+	std::vector<unsigned int> d_order; // triangle ids, each leaf owning a contiguous range
+	unsigned int d_depth; // levels below the root
+
+	unsigned int BuildNode(const std::vector<GeoPoint3D> &centroids, const std::vector<GeoPoint3D> &tmin,
+		const std::vector<GeoPoint3D> &tmax, unsigned int first, unsigned int count, unsigned int leafsize, unsigned int level);
+
+public:
+	DistBVH() : d_nodes(), d_order(), d_depth(0) {}
+
+	void Build(CsiTSurf *surf, const std::vector<CsiTriangle*> &triangles, unsigned int leafsize = 4);
+
+	bool Empty() const { return d_nodes.empty(); }
+
+	size_t NumNodes() const { return d_nodes.size(); }
+
+	const BVH_Node& Node(unsigned int n) const { return d_nodes[n]; }
+
+	unsigned int Order(unsigned int i) const { return d_order[i]; }
+
+	unsigned int Depth() const { return d_depth; }
+
+	/**
+	* Traverse
+	* ------------------------------------------------------------------------
+	* Depth first descent of the hierarchy. enter(id, node) returns false to skip a node and its
+	* subtree, leaf(id, node) is called on the leaves entered. With a point, the child whose box
+	* is nearer to it is entered first. The stack holds at most one node per level plus one.
+	* @param[in] enter - bool(unsigned int, const BVH_Node&)
+	* @param[in] leaf - void(unsigned int, const BVH_Node&)
+	* @param[in] nearfirst - point to descend towards, NULL for the left child first
+	*/
+	template<class Enter, class Leaf>
+	void Traverse(Enter enter, Leaf leaf, const GeoPoint3D *nearfirst = NULL) const
+	{
+		if( d_nodes.empty() ) return;
+
+		unsigned int local[BVH_STACK];
+		std::vector<unsigned int> deep;
+		unsigned int *stack = local;
+		if( d_depth + 1 > BVH_STACK )
+		{
+			deep.resize(d_depth + 1);
+			stack = &deep[0];
+		}
+
+		int top = 0;
+		stack[top++] = 0;
+		while( top > 0 )
+		{
+			unsigned int id = stack[--top];
+			const BVH_Node &node = d_nodes[id];
+			if( !enter(id, node) ) continue;
+
+			if( node.count > 0 )
+			{
+				leaf(id, node);
+				continue;
+			}
+
+			bool leftfirst = true;
+			if( nearfirst != NULL )
+			{
+				const BVH_Node &left = d_nodes[node.left], &right = d_nodes[node.right];
+				leftfirst = BoxDistance2(*nearfirst, left.bmin, left.bmax) <= BoxDistance2(*nearfirst, right.bmin, right.bmax);
+			}
+			stack[top++] = leftfirst ? node.right : node.left;
+			stack[top++] = leftfirst ? node.left : node.right;
+		}
+	}
+
+	static double BoxDistance2(const GeoPoint3D &p, const GeoPoint3D &bmin, const GeoPoint3D &bmax)
+	{
+		double dx = p.x < bmin.x ? bmin.x - p.x : (p.x > bmax.x ? p.x - bmax.x : 0);
+		double dy = p.y < bmin.y ? bmin.y - p.y : (p.y > bmax.y ? p.y - bmax.y : 0);
+		double dz = p.z < bmin.z ? bmin.z - p.z : (p.z > bmax.z ? p.z - bmax.z : 0);
+		return dx*dx + dy*dy + dz*dz;
+	}
+};
+#endif
@@ -0,0 +1,53 @@
+#ifndef _distcache_h_
+#define _distcache_h_
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include "distcalc.h"
+
+class DistCache
+{
+	static DistCache *s_instance;
+
+	std::string d_dir; // cache directory
+	unsigned long long d_maxbytes; // cache size bound, least recently used entries are evicted above it
+	std::mutex d_mutex; // serializes directory scans and evictions
+
+	std::atomic<unsigned long> d_hits;
+	std::atomic<unsigned long> d_misses;
+	std::atomic<unsigned long> d_evictions;
+
+	DistCache()
+	: d_dir(".dfcache"), d_maxbytes(4ULL << 30), d_hits(0), d_misses(0), d_evictions(0)
+	{
+	}
+
+	std::string EntryPath(const std::string &key);
+
+	void Evict();
+
+public:
+	static DistCache* GetInstance()
+	{
+		if( s_instance == NULL ) s_instance = new DistCache();
+		return s_instance;
+	}
+
+	void SetDirectory(std::string dir, unsigned long long maxbytes);
+
+	static std::string Key(DistCalc *obj);
+
+	bool Load(DistCalc *obj);
+
+	bool Store(DistCalc *obj);
+
+	unsigned long Hits() const { return d_hits; }
+
+	unsigned long Misses() const { return d_misses; }
+
+	unsigned long Evictions() const { return d_evictions; }
+
+	unsigned long long Bytes();
+};
+#endif
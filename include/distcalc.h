@@ -3,20 +3,95 @@
 
 #include <vector>
 #include <map>
+#include <string>
+#include <mutex>
 #include "CsiTSurf.h"
+#include "distgrad.h"
+#include "distwind.h"
+#include "distadj.h"
+#include "distbvh.h"
+#include "distborder.h"
+
+// Closest feature of a triangle, see DistCalc::Point2TriangleDistance
+#define FEAT_FACE 0
+#define FEAT_V1 1
+#define FEAT_V2 2
+#define FEAT_V3 3
+#define FEAT_E12 4
+#define FEAT_E13 5
+#define FEAT_E23 6
+
+// Sign of the distance field
+#define SIGN_PSEUDONORMAL 0 // pseudonormal of the closest feature
+#define SIGN_FACE 1 // normal of the closest face, wrong near shared edges and vertices
+#define SIGN_WINDING 2 // generalized winding number: negative inside closed shells, for geobodies
+
+#define GRAD_BRICK 8 // grid planes per on-demand gradient brick
+
+class DistCalc;
+
+/**
+* Receives the distance field one z-slab at a time, when it is computed by
+* DistCalc::Grid2MeshStreamed. Slab buffers are only valid during ConsumeSlab.
+*/
+class DistSlabSink
+{
+public:
+	virtual ~DistSlabSink() {}
+
+	virtual bool Begin(DistCalc *) { return true; }
+
+	// Planes [k0, k0+nk) of the grid, (d_nx+1)*(d_ny+1) voxels per plane, in grid order
+	virtual bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients) = 0;
+
+	virtual bool End(DistCalc *) { return true; }
+};
 
 class DistCalc
 {
 	std::vector<double> d_voxels; // grid points
 	std::vector<bool> d_borders; // auxiliary vector to d_voxels, informs if the given voxel's closest point on the surface is on its border or not
-	std::vector< std::pair< GeoPoint3D, CsiTSurfVertex* > > d_surfcells; // grid cells which are used to rebuild the original mesh
-	std::vector<GeoPoint3D> d_gradients; // distance field gradient of each grid point 
+	DistGradients d_gradients; // distance field gradient of each grid point, octahedral encoded
+	std::vector<DistGradients> d_gradbricks; // on-demand gradients: GRAD_BRICK planes per brick, unallocated until needed; empty when d_gradients holds the grid
+	std::mutex d_gradmutex; // guards the on-demand gradient bricks
+	std::vector<size_t> d_activecells; // cells holding a vertex of the regenerated surface, in grid order
+	std::vector<CsiTSurfVertex*> d_cellvertices; // vertex of each active cell, parallel to d_activecells
+	std::vector<CsiTriangle*> d_triangles; // triangles of d_surf in list order, indexed by their ids
+	DistAdjacency d_adjacency; // vertex, edge and triangle adjacency of d_surf
+	DistBVH d_bvh; // closest point hierarchy over d_triangles
+	std::vector<GeoPoint3D> d_facenormals; // unit normal of each triangle
+	std::vector<GeoPoint3D> d_vertexnormals; // angle weighted pseudonormal of each vertex
+	std::vector<GeoPoint3D> d_edgenormals; // pseudonormal of each edge, by d_adjacency edge id
+	int d_signmode; // SIGN_PSEUDONORMAL, SIGN_FACE or SIGN_WINDING
+	DistWinding d_winding; // winding number expansion of d_bvh, built when SIGN_WINDING is selected
+	BorderMap d_bordermap; // border vertices and edges of d_surf, set by MountBorderMap
+	bool d_features; // whether Grid2Mesh keeps the closest feature channel
+	std::vector<unsigned int> d_clostris; // closest triangle id of each grid point
+	std::vector<unsigned int> d_closest; // s (low 16 bits) and t (high 16 bits) of each closest point
+	std::vector<unsigned short> d_trilabels; // label of each triangle, empty if the mesh is not labelled
+	std::vector<unsigned short> d_labels; // label of the closest triangle of each grid point
+
+	std::string d_ckptfile; // Grid2Mesh checkpoint file, empty if checkpointing is disabled
+	unsigned int d_ckpttile; // number of grid planes per checkpoint tile
+	double d_ckptinterval; // minimum time between checkpoint writes, in seconds
+
+	GeoPoint3D InterpolatePoint(int i, unsigned int j, unsigned int k, CsiTSurfVertex *vtx);
+
+	void NetTopology(std::vector<size_t> &cells, std::vector<unsigned int> &tris);
 
-	GeoPoint3D InterpolatePoint(int i, unsigned int j, unsigned int k);
+	void ComputeGradientPlanes(unsigned int k0, unsigned int k1, DistGradients &gradients, size_t first);
 
-	void CheckVertexPositions(CsiTSurf *surf);
+	void ComputePseudonormals();
+
+	void ComputeVoxel(int i, unsigned int j, unsigned int k, double &d, bool &isBorder, GeoPoint3D &gradient,
+		unsigned int *triId = NULL, unsigned int *st = NULL);
+
+	bool CheckVertexPositions(CsiTSurf *surf, unsigned int *misplaced = NULL, unsigned int *duplicates = NULL);
 	
-	void RelaxSurfVertices();
+	GeoPoint3D ProjectInCell(GeoPoint3D p, int i, unsigned int j, unsigned int k);
+
+	void RelaxSurfVertices(unsigned int maxIter = 1, double tol = 0);
 
 public:
 	std::string d_filename; // file containing surface
@@ -32,12 +107,23 @@ public:
 	* Construtor.
 	*/
 	DistCalc( CsiTSurf *surf, std::string filename )
-	: d_voxels(), d_borders(), d_surfcells(), d_gradients(), d_surf(NULL)
+	: d_voxels(), d_borders(), d_gradients(), d_gradbricks(), d_gradmutex(), d_activecells(), d_cellvertices(), d_triangles(),
+	  d_adjacency(), d_bvh(), d_facenormals(), d_vertexnormals(), d_edgenormals(), d_signmode(SIGN_PSEUDONORMAL), d_winding(),
+	  d_bordermap(), d_features(false), d_clostris(), d_closest(), d_trilabels(), d_labels(), d_ckptfile(), d_ckpttile(8), d_ckptinterval(300),
+	  d_surf(NULL)
 	{
 		d_surf = surf;
 		d_filename = filename;
 		d_size = d_surf->getResolutionEstimative();
 
+		CsiTriangleList &triangles = d_surf->trianglesList();
+		d_triangles.reserve(triangles.size());
+		for(CsiTriangleItr itr = triangles.begin(); itr != triangles.end(); ++itr)
+			d_triangles.push_back(itr.self());
+		d_adjacency.Build(d_surf);
+		d_bvh.Build(d_surf, d_triangles);
+		ComputePseudonormals();
+
 		d_surf->boundingbox( &d_min, &d_max );
 		//d_size = 80;
 		d_size = 800;
@@ -61,27 +147,140 @@ public:
 	}
 
 	void Grid2Mesh( );
+
+	void AllocateField();
+
+	void AlignGrid(const GeoPoint3D &origin);
+
+	void SetGrid(const GeoPoint3D &min, const GeoPoint3D &max, double size);
+
+	void ComputePoint(GeoPoint3D point, double &d, bool &isBorder, GeoPoint3D &gradient,
+		unsigned int *triId = NULL, unsigned int *st = NULL);
+
+	void SetCheckpoint( std::string filename, unsigned int tiledepth = 8, double interval = 300 );
+
+	bool Grid2MeshStreamed( DistSlabSink *sink, unsigned int slabdepth = 4 );
+
+	void ComputeSlab(unsigned int k0, unsigned int nk, double *voxels, unsigned char *borders, GeoPoint3D *gradients,
+		unsigned int *tris = NULL, unsigned int *st = NULL, unsigned short *labels = NULL);
+
+	bool EmitSlabs( DistSlabSink *sink, unsigned int slabdepth = 16 );
+
+	CsiTSurf* Grid2MeshNets( unsigned int brick = 16 );
 	
-	double Point2MeshDistance(GeoPoint3D pt, double &s, double &t, bool *isBorder=NULL, CsiTriangle **clostri=NULL);
+	double Point2MeshDistance(GeoPoint3D pt, double &s, double &t, bool *isBorder=NULL, CsiTriangle **clostri=NULL, unsigned int *triId=NULL);
 	
-	double Point2TriangleDistance(GeoPoint3D p, CsiTriangle *tri, double &s, double &t, bool *isBorder=NULL );
+	double Point2TriangleDistance(GeoPoint3D p, CsiTriangle *tri, double &s, double &t, int *feature=NULL );
+
+	GeoPoint3D Pseudonormal(unsigned int triId, int feat) const;
+
+	void SetSignMode(int mode);
+
+	int SignMode() const { return d_signmode; }
 	
-	CsiTSurf* SurfaceNets();
+	CsiTSurf* SurfaceNets(unsigned int relaxIter = 1, double relaxTol = 0);
+
+	CsiTSurf* DualContouring(double lambda = 0.05);
+
+	std::vector<CsiTSurf*> OffsetSurfaces(const std::vector<double> &isovalues, const GeoPoint3D *clipMin = NULL, const GeoPoint3D *clipMax = NULL);
 	
 	std::vector<double>& GetVoxels() { return d_voxels; }
 	
 	std::vector<bool>& GetBorders() { return d_borders; }
 
-	std::vector<GeoPoint3D>& GetGradients() { return d_gradients; }
+	// Whole grid of gradients, gathering the on-demand bricks
+	DistGradients& GetGradients() { EnsureGradients(); return d_gradients; }
+
+	// Gradient of a grid point, resident or in a brick made present by EnsureGradients
+	GeoPoint3D Gradient(size_t idx) const
+	{
+		if( d_gradbricks.empty() ) return d_gradients[idx];
+		size_t bricksize = (size_t)(d_nx+1)*(d_ny+1)*GRAD_BRICK;
+		return d_gradbricks[idx/bricksize][idx%bricksize];
+	}
+
+	void SetGradientBits(int bits);
+
+	int GradientBits() const { return d_gradients.Bits(); }
+
+	// Closest feature channel: closest triangle and (s,t) of every grid point, kept by Grid2Mesh when enabled
+	void SetClosestFeatures(bool enable) { d_features = enable; }
+
+	bool ClosestFeatures() const { return d_features; }
+
+	bool HasClosestFeatures() const { return d_features && d_clostris.size() == d_voxels.size() && d_voxels.size() > 0; }
+
+	std::vector<unsigned int>& GetClosestTriangles() { return d_clostris; }
+
+	std::vector<unsigned int>& GetClosestST() { return d_closest; }
+
+	// Label channel: label of the closest triangle of every grid point, kept by Grid2Mesh when the triangles are labelled
+	void SetTriangleLabels(const std::vector<unsigned short> &labels) { d_trilabels = labels; }
+
+	bool HasTriangleLabels() const { return !d_trilabels.empty(); }
+
+	const std::vector<unsigned short>& GetTriangleLabels() const { return d_trilabels; }
+
+	std::vector<unsigned short>& GetLabels() { return d_labels; }
+
+	static CsiTSurf* MergeSurfaces(const std::vector<CsiTSurf*> &surfs, std::vector<unsigned short> &labels);
+
+	CsiTriangle* Triangle(unsigned int triId) { return d_triangles[triId]; }
+
+	void ClosestFeature(size_t idx, unsigned int &triId, double &s, double &t) const;
+
+	// (s,t) in [0,1] quantized to 16 bits each, error at most 1/131070 of the triangle edges
+	static unsigned int PackST(double s, double t)
+	{
+		s = s < 0 ? 0 : (s > 1 ? 1 : s);
+		t = t < 0 ? 0 : (t > 1 ? 1 : t);
+		return (unsigned int)(s*65535 + 0.5) | ((unsigned int)(t*65535 + 0.5) << 16);
+	}
+
+	static void UnpackST(unsigned int st, double &s, double &t)
+	{
+		s = (st & 0xffff) / 65535.0;
+		t = (st >> 16) / 65535.0;
+	}
+
+	bool ClosestPoint(size_t idx, GeoPoint3D &point);
 	
-	std::vector< std::pair< GeoPoint3D, CsiTSurfVertex* > >& GetSurfCells() { return d_surfcells; }
+	// Center of a grid cell, computed from its indices
+	GeoPoint3D CellCenter(int i, unsigned int j, unsigned int k) const
+	{
+		return GeoPoint3D(d_min.x + i*d_size + d_size/2, d_min.y + j*d_size + d_size/2, d_min.z + k*d_size + d_size/2);
+	}
+
+	GeoPoint3D CellCenter(size_t idxC) const
+	{
+		size_t planecells = (size_t)d_nx*d_ny;
+		return CellCenter((int)(idxC % d_nx), (unsigned int)((idxC % planecells) / d_nx), (unsigned int)(idxC / planecells));
+	}
+
+	const std::vector<size_t>& GetActiveCells() const { return d_activecells; }
+
+	const std::vector<CsiTSurfVertex*>& GetCellVertices() const { return d_cellvertices; }
+
+	CsiTSurfVertex* CellVertex(size_t idxC) const;
 
 	void AssignVtx2Cell();
 
 	void CalculateGradients();
 
-	static bool isInBorder(CsiTSurf *surf, CsiTSurfVertex *oriVtx);
+	void DropGradients();
+
+	void EnsureGradients(unsigned int k0 = 0, unsigned int k1 = ~0u);
+
+	void ReleaseGradients(unsigned int k0, unsigned int k1);
 
 	void MountBorderMap();
+
+	const BorderMap& GetBorderMap() const { return d_bordermap; }
+
+	const DistAdjacency& GetAdjacency() const { return d_adjacency; }
+
+	const DistBVH& GetBVH() const { return d_bvh; }
+
+	const std::vector<CsiTriangle*>& GetTriangles() const { return d_triangles; }
 };
 #endif // _distcalc_h_
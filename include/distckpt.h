@@ -0,0 +1,56 @@
+#ifndef _distckpt_h_
+#define _distckpt_h_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "distcalc.h"
+
+/**
+* Checkpoint file of a Grid2Mesh run. The grid is split into tiles of whole z-planes;
+* completed tiles are periodically written together with a completion bitmap, so that
+* a restarted run only computes the missing tiles.
+*/
+class DistCheckpoint
+{
+	std::string d_filename;
+	FILE *d_fp;
+	unsigned int d_tiledepth; // number of grid planes per tile
+	unsigned int d_ntiles;
+	double d_interval; // minimum time between flushes, in seconds
+	double d_lastflush;
+	std::vector<unsigned char> d_bitmap; // completion bitmap, one bit per tile, as stored in the file
+	std::vector<unsigned int> d_pending; // tiles completed since the last flush
+	unsigned long long d_nvoxels;
+	unsigned long long d_datasec; // file offset of the voxel section
+
+	bool WriteTile(DistCalc *obj, unsigned int tile);
+
+	bool ReadTile(DistCalc *obj, unsigned int tile);
+
+public:
+	DistCheckpoint(std::string filename, unsigned int tiledepth, double interval)
+	: d_filename(filename), d_fp(NULL), d_tiledepth(tiledepth < 1 ? 1 : tiledepth), d_ntiles(0),
+	  d_interval(interval), d_lastflush(0), d_bitmap(), d_pending(), d_nvoxels(0), d_datasec(0)
+	{
+	}
+
+	~DistCheckpoint() { if( d_fp != NULL ) fclose(d_fp); }
+
+	bool Open(DistCalc *obj);
+
+	unsigned int TileDepth() const { return d_tiledepth; }
+
+	unsigned int NumTiles() const { return d_ntiles; }
+
+	unsigned int NumDone() const;
+
+	bool IsDone(unsigned int tile) const { return (d_bitmap[tile/8] >> (tile%8)) & 1; }
+
+	bool MarkDone(DistCalc *obj, unsigned int tile);
+
+	bool Flush(DistCalc *obj);
+
+	void Remove();
+};
+#endif
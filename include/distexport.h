@@ -0,0 +1,94 @@
+#ifndef _distexport_h_
+#define _distexport_h_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "distcalc.h"
+
+/**
+* Common part of the volume exporters: slab bookkeeping and gradient channel conversion.
+* Exporters are slab sinks, so they can be fed by DistCalc::Grid2MeshStreamed or, for a
+* field already in memory, by DistCalc::EmitSlabs.
+*/
+class DistExporter : public DistSlabSink
+{
+protected:
+	std::string d_basename; // output file name without extension
+	std::vector<double> d_gradbuffer; // gradient slab as x,y,z triplets
+	size_t d_nvoxels;
+	size_t d_planesize;
+
+	DistExporter(std::string basename) : d_basename(basename), d_gradbuffer(), d_nvoxels(0), d_planesize(0) {}
+
+	void Setup(DistCalc *obj);
+
+	const double* GradientTriplets(const GeoPoint3D *gradients, size_t n);
+
+	static FILE* OpenOutput(std::string filename);
+};
+
+/**
+* VTK ImageData (.vti) with the distance, gradient and border arrays appended as raw binary
+*/
+class DistVtiWriter : public DistExporter
+{
+	FILE *d_fp;
+	unsigned long long d_datapos; // file position of the appended data
+	unsigned long long d_offsets[3]; // offset of each array inside the appended data
+
+public:
+	DistVtiWriter(std::string basename) : DistExporter(basename), d_fp(NULL), d_datapos(0) {}
+
+	~DistVtiWriter() { if( d_fp != NULL ) fclose(d_fp); }
+
+	bool Begin(DistCalc *obj);
+
+	bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients);
+
+	bool End(DistCalc *obj);
+};
+
+/**
+* NRRD volumes with attached headers: <base>.nrrd (distance), <base>_grad.nrrd (gradient)
+* and <base>_border.nrrd (border flags)
+*/
+class DistNrrdWriter : public DistExporter
+{
+	FILE *d_fp[3];
+
+public:
+	DistNrrdWriter(std::string basename) : DistExporter(basename) { d_fp[0] = d_fp[1] = d_fp[2] = NULL; }
+
+	~DistNrrdWriter() { for( int c = 0; c < 3; c++ ) if( d_fp[c] != NULL ) fclose(d_fp[c]); }
+
+	bool Begin(DistCalc *obj);
+
+	bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients);
+
+	bool End(DistCalc *obj);
+};
+
+/**
+* Raw channels in the byte order of the host (<base>_distance.raw, <base>_gradient.raw,
+* <base>_border.raw) described by a <base>.json header, which records the order in byte_order
+*/
+class DistRawWriter : public DistExporter
+{
+	FILE *d_fp[3];
+
+public:
+	DistRawWriter(std::string basename) : DistExporter(basename) { d_fp[0] = d_fp[1] = d_fp[2] = NULL; }
+
+	~DistRawWriter() { for( int c = 0; c < 3; c++ ) if( d_fp[c] != NULL ) fclose(d_fp[c]); }
+
+	bool Begin(DistCalc *obj);
+
+	bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients);
+
+	bool End(DistCalc *obj);
+};
+#endif
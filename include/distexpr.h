@@ -0,0 +1,76 @@
+#ifndef _distexpr_h_
+#define _distexpr_h_
+
+#include <vector>
+#include <string>
+#include "distcalc.h"
+#include "distio.h"
+
+#define EXPR_FIELD 0 // push an input field
+#define EXPR_MIN 1 // union
+#define EXPR_MAX 2 // intersection
+#define EXPR_NEG 3 // complement
+#define EXPR_ADD 4
+#define EXPR_SUB 5
+#define EXPR_CLAMP 6 // clamp to [a, b]
+#define EXPR_SMIN 7 // smooth union of radius a
+#define EXPR_OFFSET 8 // offset surface: the field minus a
+
+#define EXPR_MAXDEPTH 8 // deepest operand stack of a program
+#define EXPR_BLOCK 256 // voxels evaluated together
+
+/**
+* Expression over distance fields of the same grid, as a postfix program: "below A and above B"
+* is FIELD a, NEG, FIELD b, MAX. The whole program is applied to a block of voxels before moving
+* to the next, each operation being a plain loop over the block, so every input is read once,
+* straight from the field or the mapped file, and the only array of the size of the grid is the
+* output.
+*/
+class DistExpression
+{
+	typedef struct expr_op {
+		int code; // EXPR_*
+		unsigned int field; // input of EXPR_FIELD
+		double a, b; // arguments of EXPR_CLAMP, EXPR_SMIN and EXPR_OFFSET
+	} Expr_Op;
+
+	std::vector<const double*> d_inputs;
+	int d_nx; // grid of every input, set by the first one
+	unsigned int d_ny, d_nz;
+	double d_size;
+	GeoPoint3D d_min;
+	size_t d_nvoxels;
+	std::vector<Expr_Op> d_program;
+
+	void EvaluateBlock(size_t first, size_t count, double *out) const;
+
+public:
+	DistExpression() : d_inputs(), d_nx(0), d_ny(0), d_nz(0), d_size(0), d_min(), d_nvoxels(0), d_program() {}
+
+	int Input(const double *voxels, int nx, unsigned int ny, unsigned int nz, double size, const GeoPoint3D &min);
+
+	int Input(DistCalc *obj);
+
+	int Input(const DistFieldView &view)
+	{
+		if( view.NumVoxels() != (size_t)(view.d_nx+1)*(view.d_ny+1)*(view.d_nz+1) ) return -1;
+		return Input(view.Voxels(), view.d_nx, view.d_ny, view.d_nz, view.d_size, view.d_min);
+	}
+
+	void Push(unsigned int field);
+
+	void Apply(int code, double a = 0, double b = 0);
+
+	bool Parse(const std::string &program);
+
+	void Clear() { d_program.clear(); }
+
+	bool Valid() const;
+
+	size_t NumVoxels() const { return d_nvoxels; }
+
+	bool Evaluate(double *out) const;
+
+	bool Evaluate(std::string basename) const;
+};
+#endif
@@ -0,0 +1,60 @@
+#ifndef _distfile_h_
+#define _distfile_h_
+
+#include <cstdio>
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <sys/types.h>
+#else
+	#include <io.h>
+#endif
+
+/**
+* File offsets beyond 2 GB and durable writes, for the .dfb, checkpoint and export files. Offsets
+* are always 64 bit: off_t is only 32 bit on Windows.
+*/
+
+/**
+* DistSeek
+* ------------------------------------------------------------------------
+* Moves to an offset from the start of a file
+* @return - 0 on success
+*/
+inline int DistSeek(FILE *fp, long long offset)
+{
+#ifndef _WIN32
+	return fseeko(fp, (off_t)offset, SEEK_SET);
+#else
+	return _fseeki64(fp, offset, SEEK_SET);
+#endif
+}
+
+/**
+* DistTell
+* ------------------------------------------------------------------------
+* Returns the current offset in a file, -1 on error
+*/
+inline long long DistTell(FILE *fp)
+{
+#ifndef _WIN32
+	return (long long)ftello(fp);
+#else
+	return _ftelli64(fp);
+#endif
+}
+
+/**
+* DistSync
+* ------------------------------------------------------------------------
+* Forces everything written so far to reach the disk
+*/
+inline bool DistSync(FILE *fp)
+{
+	if( fflush(fp) != 0 ) return false;
+#ifndef _WIN32
+	return fsync(fileno(fp)) == 0;
+#else
+	return _commit(_fileno(fp)) == 0;
+#endif
+}
+#endif
@@ -0,0 +1,137 @@
+#ifndef _distgrad_h_
+#define _distgrad_h_
+
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include "CsiTSurf.h"
+
+/**
+* Octahedral encoding of unit vectors: the direction is projected on the octahedron |x|+|y|+|z| = 1,
+* the lower half is folded over the upper one and the resulting (u, v) square is quantized to two
+* signed integers. 32 bit codes use two 16 bit components, 16 bit codes two 8 bit components, for
+* previews. The most negative component value is reserved for the zero vector (voxels lying on the
+* surface have no direction).
+*
+* Angular error, measured over 10^7 random directions plus the axes and diagonals:
+*   32 bit: at most 0.0038 degrees
+*   16 bit: at most 0.96 degrees
+* See DistGradients::MaxAngularError.
+*/
+
+#define OCT_SCALE32 32767
+#define OCT_SCALE16 127
+#define OCT_ZERO32 0x80008000u
+#define OCT_ZERO16 0x8080u
+
+/**
+* _OctProject
+* ------------------------------------------------------------------------
+* Projects a direction on the folded octahedron and quantizes it
+* @return - false for the zero (or undefined) vector
+*/
+static inline bool _OctProject(double x, double y, double z, int scale, int &u, int &v)
+{
+	double l1 = std::abs(x) + std::abs(y) + std::abs(z);
+	if( !(l1 > 0) ) return false;
+
+	double px = x / l1, py = y / l1;
+	if( z < 0 )
+	{
+		double fx = (1 - std::abs(py)) * (px >= 0 ? 1 : -1);
+		double fy = (1 - std::abs(px)) * (py >= 0 ? 1 : -1);
+		px = fx;
+		py = fy;
+	}
+	u = (int)floor(px*scale + 0.5);
+	v = (int)floor(py*scale + 0.5);
+	u = u < -scale ? -scale : (u > scale ? scale : u);
+	v = v < -scale ? -scale : (v > scale ? scale : v);
+	return true;
+}
+
+/**
+* _OctUnproject
+* ------------------------------------------------------------------------
+* Unit direction of a quantized octahedral point, without branches on the folding
+*/
+static inline GeoPoint3D _OctUnproject(int u, int v, double scale)
+{
+	double px = u / scale, py = v / scale;
+	double pz = 1 - std::abs(px) - std::abs(py);
+	double t = pz < 0 ? -pz : 0;
+	px += px >= 0 ? -t : t;
+	py += py >= 0 ? -t : t;
+	double inv = 1 / sqrt(px*px + py*py + pz*pz);
+	return GeoPoint3D(px*inv, py*inv, pz*inv);
+}
+
+static inline unsigned int OctEncode32(const GeoPoint3D &g)
+{
+	int u, v;
+	if( !_OctProject(g.x, g.y, g.z, OCT_SCALE32, u, v) ) return OCT_ZERO32;
+	return (unsigned int)(unsigned short)(short)u | ((unsigned int)(unsigned short)(short)v << 16);
+}
+
+static inline GeoPoint3D OctDecode32(unsigned int code)
+{
+	int u = (short)(code & 0xffff), v = (short)(code >> 16);
+	if( u == -OCT_SCALE32-1 ) return GeoPoint3D(0, 0, 0);
+	return _OctUnproject(u, v, OCT_SCALE32);
+}
+
+static inline unsigned short OctEncode16(const GeoPoint3D &g)
+{
+	int u, v;
+	if( !_OctProject(g.x, g.y, g.z, OCT_SCALE16, u, v) ) return OCT_ZERO16;
+	return (unsigned short)((unsigned char)(signed char)u | ((unsigned char)(signed char)v << 8));
+}
+
+static inline GeoPoint3D OctDecode16(unsigned short code)
+{
+	int u = (signed char)(code & 0xff), v = (signed char)(code >> 8);
+	if( u == -OCT_SCALE16-1 ) return GeoPoint3D(0, 0, 0);
+	return _OctUnproject(u, v, OCT_SCALE16);
+}
+
+/**
+* Per voxel distance field gradients, stored as 32 or 16 bit octahedral codes instead of three
+* doubles. Elements are read decoded, by value, and written through set or Encode.
+*/
+class DistGradients
+{
+	int d_bits; // 32 or 16
+	std::vector<unsigned int> d_codes32;
+	std::vector<unsigned short> d_codes16;
+
+public:
+	DistGradients(int bits = 32) : d_bits(bits == 16 ? 16 : 32), d_codes32(), d_codes16() {}
+
+	int Bits() const { return d_bits; }
+
+	void SetBits(int bits);
+
+	size_t size() const { return d_bits == 32 ? d_codes32.size() : d_codes16.size(); }
+
+	void resize(size_t n) { if( d_bits == 32 ) d_codes32.resize(n, OCT_ZERO32); else d_codes16.resize(n, OCT_ZERO16); }
+
+	void clear();
+
+	GeoPoint3D operator[](size_t i) const { return d_bits == 32 ? OctDecode32(d_codes32[i]) : OctDecode16(d_codes16[i]); }
+
+	void set(size_t i, const GeoPoint3D &g) { if( d_bits == 32 ) d_codes32[i] = OctEncode32(g); else d_codes16[i] = OctEncode16(g); }
+
+	void Encode(size_t first, const GeoPoint3D *src, size_t n);
+
+	void Decode(size_t first, size_t n, GeoPoint3D *dst) const;
+
+	// Raw codes, for file I/O: CodeSize() bytes per voxel
+	void* Codes() { return d_bits == 32 ? (void*)&d_codes32[0] : (void*)&d_codes16[0]; }
+
+	const void* Codes() const { return d_bits == 32 ? (const void*)&d_codes32[0] : (const void*)&d_codes16[0]; }
+
+	size_t CodeSize() const { return d_bits/8; }
+
+	static double MaxAngularError(int bits);
+};
+#endif
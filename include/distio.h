@@ -5,33 +5,144 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
 #include "distcalc.h"
 
 using namespace std;
 
 class DistIO
 {
+	// A pending asynchronous save: one job per field
+	typedef struct write_job {
+		DistCalc *obj;
+		std::string filename;
+		std::promise<bool> done;
+		std::function<void(bool)> callback;
+	} Write_Job;
+
 	static DistIO *s_instance;
+	static std::mutex s_instmutex;
+
+	std::thread d_writer; // background writer, started on the first asynchronous save
+	std::deque<Write_Job*> d_queue; // jobs waiting for the writer, bounded by d_maxqueue
+	size_t d_maxqueue;
+	unsigned int d_active; // jobs queued or being written
+	std::mutex d_mutex;
+	std::condition_variable d_notempty;
+	std::condition_variable d_notfull;
+	std::condition_variable d_idle;
 
 	DistIO()
+	: d_writer(), d_queue(), d_maxqueue(4), d_active(0)
 	{
 	}
 
 	void PosLoad(DistCalc *distObj);
 
-public:
-	fstream d_file;
+	void WriterLoop();
 
-	static DistIO* GetInstance()
-	{
-		if( s_instance == NULL ) s_instance = new DistIO();
-		return s_instance;
-	}
+	static void WaitAtExit();
+
+public:
+	static DistIO* GetInstance();
 
 	void SaveDistField(DistCalc *obj);
 
+	std::future<bool> SaveDistFieldAsync(DistCalc *obj, std::function<void(bool)> callback = std::function<void(bool)>());
+
+	void WaitWrites();
+
+	static bool WriteDistField(DistCalc *obj, std::string filename);
+
 	DistCalc* LoadDistField(CsiTSurf *surf, std::string filename);
 
+	static bool SaveBinaryField(DistCalc *obj, std::string filename);
+
+	static bool LoadBinaryField(DistCalc *obj, std::string filename);
+
+	static bool SaveLabels(DistCalc *obj, std::string filename);
+
 	static void CutExt( std::string fname, std::string &name, std::string &ext );
 };
+
+/**
+* Writes a streamed distance field into a text .df file, as SaveDistField does
+*/
+class DistFileWriter : public DistSlabSink
+{
+	std::string d_filename;
+	fstream d_file;
+
+public:
+	DistFileWriter(std::string filename) : d_filename(filename) {}
+
+	bool Begin(DistCalc *obj);
+
+	bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients);
+
+	bool End(DistCalc *obj);
+};
+
+/**
+* Writes a streamed distance field into a binary .dfb file, as SaveBinaryField does
+*/
+class DistBinaryWriter : public DistSlabSink
+{
+	std::string d_filename;
+	FILE *d_fp;
+	size_t d_nvoxels;
+	DistGradients d_codes; // encoded gradients of the current slab
+
+public:
+	DistBinaryWriter(std::string filename) : d_filename(filename), d_fp(NULL), d_nvoxels(0), d_codes() {}
+
+	~DistBinaryWriter() { if( d_fp != NULL ) fclose(d_fp); }
+
+	bool Begin(DistCalc *obj);
+
+	bool ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+		const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients);
+
+	bool End(DistCalc *obj);
+};
+
+/**
+* Read-only view of the voxels of a .dfb file, memory mapped where the platform allows, so that
+* a stored field can be streamed without a copy of it in memory
+*/
+class DistFieldView
+{
+	const char *d_data; // mapped file
+	size_t d_length;
+	std::vector<char> d_buffer; // whole file, where it cannot be mapped
+	const double *d_voxels;
+	size_t d_nvoxels;
+
+	DistFieldView(const DistFieldView&);
+	DistFieldView& operator=(const DistFieldView&);
+
+public:
+	int d_nx;
+	unsigned int d_ny, d_nz;
+	double d_size;
+	GeoPoint3D d_min;
+
+	DistFieldView() : d_data(NULL), d_length(0), d_buffer(), d_voxels(NULL), d_nvoxels(0), d_nx(0), d_ny(0), d_nz(0), d_size(0), d_min() {}
+
+	~DistFieldView() { Close(); }
+
+	bool Open(std::string filename);
+
+	void Close();
+
+	const double* Voxels() const { return d_voxels; }
+
+	size_t NumVoxels() const { return d_nvoxels; }
+};
 #endif
@@ -0,0 +1,46 @@
+#ifndef _distobjects_h_
+#define _distobjects_h_
+
+#include <vector>
+#include <string>
+#include "distcalc.h"
+
+/**
+* Distance fields of the separate objects of a multi-object GOCAD file. Every object gets its own
+* DistCalc over a tight box of its own, grown onto the lattice of the grid of the whole file, and
+* the fields of all objects are computed together, slab by slab, in one parallel loop. The
+* combined field keeps, at every grid point of the whole file, the value of the closest object.
+*/
+class DistObjects
+{
+	CsiTSurf *d_surf; // every object, as loaded
+	std::vector<CsiTSurf*> d_objects; // one surface per object, owned
+	std::vector<unsigned int> d_firsttri; // id in d_surf of the first triangle of each object
+	std::vector<GeoPoint3D> d_boxmin, d_boxmax; // bounding box of each object
+	std::vector<DistCalc*> d_fields; // field of each object, owned
+	DistCalc *d_combined; // grid of the whole file, holds the combined field, owned
+
+	void Split(std::string filename);
+
+public:
+	DistObjects(CsiTSurf *surf, std::string filename);
+
+	~DistObjects();
+
+	size_t NumObjects() const { return d_objects.size(); }
+
+	CsiTSurf* Object(size_t o) { return d_objects[o]; }
+
+	DistCalc* Field(size_t o) { return d_fields[o]; }
+
+	DistCalc* Combined() { return d_combined; }
+
+	void SetSignMode(int mode);
+
+	void SetClosestFeatures(bool enable);
+
+	void Grid2Mesh(unsigned int slabdepth = 4);
+
+	DistCalc* Combine();
+};
+#endif
@@ -0,0 +1,12 @@
+#ifndef _distomp_h_
+#define _distomp_h_
+
+/**
+* Threading of the parallel loops: number of OpenMP threads, and OpenMP always on with the
+* Windows compilers, where the project files do not define USE_OPENMP.
+*/
+#define NUM_THREADS 8
+#ifdef WIN32
+	#define USE_OPENMP
+#endif
+#endif
@@ -0,0 +1,49 @@
+#ifndef _distsample_h_
+#define _distsample_h_
+
+#include <vector>
+#include "distcalc.h"
+
+#define SAMPLE_TRILINEAR 0 // 8 voxels around the point
+#define SAMPLE_TRICUBIC 1 // Catmull-Rom over the 64 voxels around the point
+
+/**
+* Distance to a surface at arbitrary points, read from its computed field instead of queried from
+* its triangles: thickness between horizons at the vertices of the other one, or at the nodes of
+* a map. The distance is 1-Lipschitz, so the voxels around a point bound it from both sides, and a
+* point is queried exactly only where the interpolated value may be farther than the tolerance
+* from the true distance.
+*/
+class DistSampler
+{
+	DistCalc *d_field; // computed field of the surface the distances are taken to
+	int d_method; // SAMPLE_TRILINEAR or SAMPLE_TRICUBIC
+	double d_tolerance; // largest error bound accepted without an exact query
+	size_t d_exact; // points of the last batch that were queried exactly
+
+	double Interpolate(const GeoPoint3D &p, double &lo, double &hi) const;
+
+public:
+	DistSampler(DistCalc *field, int method = SAMPLE_TRILINEAR, double tolerance = 0)
+	: d_field(field), d_method(method), d_tolerance(tolerance), d_exact(0)
+	{
+	}
+
+	void SetMethod(int method) { d_method = method; }
+
+	void SetTolerance(double tolerance) { d_tolerance = tolerance; }
+
+	double Sample(const GeoPoint3D &p, bool *exact = NULL) const;
+
+	double LowerBound(const GeoPoint3D &p) const;
+
+	void Sample(const std::vector<GeoPoint3D> &points, std::vector<double> &dist);
+
+	void SampleVertices(CsiTSurf *surf, std::vector<double> &thickness);
+
+	void SampleMap(CsiTSurf *surf, double x0, double y0, double dx, double dy, unsigned int nx, unsigned int ny,
+		std::vector<double> &thickness);
+
+	size_t NumExact() const { return d_exact; }
+};
+#endif
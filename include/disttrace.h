@@ -0,0 +1,42 @@
+#ifndef _disttrace_h_
+#define _disttrace_h_
+
+#include <vector>
+#include "distcalc.h"
+#include "distsample.h"
+
+/**
+* Crossings of well paths with the surface of a distance field. A path is sphere traced: from
+* every point it skips the lower bound of the distance read from the field, which no part of the
+* surface can be closer than, and only where that bound falls below the minimum step is a short
+* piece of the path tested exactly against the triangles of the pieces' boxes in the hierarchy.
+*/
+class DistTracer
+{
+public:
+	typedef struct well_hit {
+		GeoPoint3D point;
+		double md; // length along the path
+		unsigned int segment; // segment of the path, from its point segment to segment+1
+		unsigned int triId; // triangle crossed
+		int orientation; // 1 if the path goes along the normal of the triangle, -1 against it
+	} Well_Hit;
+
+private:
+	DistCalc *d_field; // computed field of the surface
+	DistSampler d_sampler;
+	double d_minstep; // length of the pieces tested exactly
+
+	void IntersectPiece(const GeoPoint3D &p0, const GeoPoint3D &p1, double u0, double u1, bool closed,
+		unsigned int segment, double md, std::vector<Well_Hit> &hits) const;
+
+public:
+	DistTracer(DistCalc *field, double minstep = 0);
+
+	void Trace(const std::vector<GeoPoint3D> &path, std::vector<Well_Hit> &hits) const;
+
+	void Trace(const std::vector<std::vector<GeoPoint3D> > &paths, std::vector<std::vector<Well_Hit> > &hits) const;
+
+	void TraceRay(const GeoPoint3D &origin, const GeoPoint3D &dir, double length, std::vector<Well_Hit> &hits) const;
+};
+#endif
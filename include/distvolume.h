@@ -0,0 +1,53 @@
+#ifndef _distvolume_h_
+#define _distvolume_h_
+
+#include <vector>
+#include "distcalc.h"
+#include "distomp.h"
+
+#define VOLUME_NEGATIVE -1 // keep the side where the field is negative
+#define VOLUME_POSITIVE 1 // keep the side where the field is positive
+
+/**
+* Gross rock volume of the region on given sides of several horizons, below a contact and inside
+* an xy polygon, read from the signed fields of the horizons on a common grid. The region is
+* where the largest of the fields, each turned to its kept side, and of the height above the
+* contact is negative; every cell is split into six tetrahedra along its diagonal and the part
+* of each below zero is measured exactly from the crossings along their edges. Columns are
+* integrated in parallel and summed in a fixed order, so the totals do not depend on the threads.
+*/
+class DistVolume
+{
+	std::vector<DistCalc*> d_fields; // computed fields, on the grid of the first one
+	std::vector<int> d_sides; // VOLUME_NEGATIVE or VOLUME_POSITIVE, for each field
+	bool d_hascontact;
+	double d_contact; // height of the contact, the region is below it
+	std::vector<GeoPoint3D> d_polygon; // xy outline of the region, empty for the whole grid
+	std::vector<double> d_columns; // volume of each column of cells, row by row along x
+	double d_total;
+	int d_threads; // threads integrating the columns
+
+	double ColumnFraction(double x0, double y0, double x1, double y1) const;
+
+public:
+	DistVolume() : d_fields(), d_sides(), d_hascontact(false), d_contact(0), d_polygon(), d_columns(), d_total(0), d_threads(NUM_THREADS) {}
+
+	bool AddField(DistCalc *field, int side);
+
+	void SetContact(double z) { d_hascontact = true; d_contact = z; }
+
+	void ClearContact() { d_hascontact = false; }
+
+	void SetPolygon(const std::vector<GeoPoint3D> &polygon) { d_polygon = polygon; }
+
+	void SetThreads(int threads) { d_threads = threads > 0 ? threads : 1; }
+
+	double Integrate();
+
+	double Total() const { return d_total; }
+
+	const std::vector<double>& GetColumns() const { return d_columns; }
+
+	static double TetraFraction(const double f[4]);
+};
+#endif
@@ -0,0 +1,35 @@
+#ifndef _distwind_h_
+#define _distwind_h_
+
+#include <vector>
+#include "CsiTSurf.h"
+#include "distbvh.h"
+
+/**
+* Generalized winding number of a triangle mesh (Barill et al., Fast Winding Numbers for Soups
+* and Clouds): the nodes of the bounding volume hierarchy of the mesh keep the dipole expansion
+* of their triangles, so that a far cluster is evaluated with a single term and only the near
+* triangles need their exact solid angle. A point costs O(log T). The number is close to 1 inside
+* a closed shell and to 0 outside; small holes only blur it near the hole.
+*/
+class DistWinding
+{
+	const DistBVH *d_bvh; // hierarchy of the mesh, owned by the caller
+	std::vector<GeoPoint3D> d_centers; // area weighted centroid of the triangles of each node
+	std::vector<GeoPoint3D> d_dipoles; // sum of the area weighted normals of each node
+	std::vector<double> d_radii; // distance from the center to the farthest corner of the box of each node
+	std::vector<GeoPoint3D> d_corners; // vertices of the triangles, three each, in hierarchy order
+	double d_beta; // a node is expanded when the point is closer than beta times its radius
+
+public:
+	DistWinding(double beta = 2) : d_bvh(NULL), d_centers(), d_dipoles(), d_radii(), d_corners(), d_beta(beta) {}
+
+	void Build(const DistBVH &bvh, CsiTSurf *surf, const std::vector<CsiTriangle*> &triangles);
+
+	bool Empty() const { return d_centers.empty(); }
+
+	double Evaluate(const GeoPoint3D &p) const;
+
+	static double SolidAngle(const GeoPoint3D &a, const GeoPoint3D &b, const GeoPoint3D &c);
+};
+#endif
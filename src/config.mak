@@ -190,4 +190,17 @@ LIBS += openmp Xp z pthread dl
 
 SRC +=	\
 	distcalc.cpp \
-	distio.cpp 
+	distio.cpp \
+	distcache.cpp \
+	distckpt.cpp \
+	distexport.cpp \
+	distgrad.cpp \
+	distwind.cpp \
+	distborder.cpp \
+	distadj.cpp \
+	distobjects.cpp \
+	distbvh.cpp \
+	distexpr.cpp \
+	distsample.cpp \
+	disttrace.cpp \
+	distvolume.cpp
@@ -0,0 +1,200 @@
+#include <algorithm>
+
+#include "distadj.h"
+#include "distomp.h"
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _CountingSort
+* ------------------------------------------------------------------------
+* Buckets the items 0..n-1 by key, keeping their order inside each bucket. Every thread counts
+* and then places a fixed chunk of the items with its own offsets, so no locks are needed and
+* the result does not depend on the scheduling.
+* @param[in] keys - key of each item; items whose key is not below nkeys are left out
+* @param[in] nkeys - number of buckets
+* @param[out] first - offset of each bucket in items, nkeys+1 entries
+* @param[out] items - items in bucket order
+*/
+static void _CountingSort(const std::vector<unsigned int> &keys, size_t nkeys,
+	std::vector<unsigned int> &first, std::vector<unsigned int> &items)
+{
+	long long n = (long long)keys.size();
+	long long chunk = (n + NUM_THREADS - 1)/NUM_THREADS;
+	std::vector<unsigned int> offsets(NUM_THREADS*nkeys, 0);
+	int t;
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static, 1) private (t)
+#endif
+	for( t = 0; t < NUM_THREADS; t++ )
+	{
+		unsigned int *count = &offsets[t*nkeys];
+		for( long long i = t*chunk; i < std::min(n, (t+1)*chunk); i++ )
+			if( keys[i] < nkeys ) count[keys[i]]++;
+	}
+
+	// Bucket major, thread minor prefix sum
+	first.assign(nkeys + 1, 0);
+	unsigned int sum = 0;
+	for( size_t k = 0; k < nkeys; k++ )
+	{
+		first[k] = sum;
+		for( t = 0; t < NUM_THREADS; t++ )
+		{
+			unsigned int c = offsets[t*nkeys + k];
+			offsets[t*nkeys + k] = sum;
+			sum += c;
+		}
+	}
+	first[nkeys] = sum;
+
+	items.resize(sum);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static, 1) private (t)
+#endif
+	for( t = 0; t < NUM_THREADS; t++ )
+	{
+		unsigned int *next = &offsets[t*nkeys];
+		for( long long i = t*chunk; i < std::min(n, (t+1)*chunk); i++ )
+			if( keys[i] < nkeys ) items[next[keys[i]]++] = (unsigned int)i;
+	}
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Build
+* ------------------------------------------------------------------------
+* Builds every adjacency of a mesh: vertex to triangles by a counting sort of the triangle
+* corners, vertex to vertices from the corners of those triangles, and edge to triangles by a
+* counting sort of the edge ids of the triangle slots
+* @param[in] surf - triangle mesh
+*/
+void DistAdjacency::Build(CsiTSurf *surf)
+{
+	CsiTriangleList &trianglesList = surf->trianglesList();
+	long long nverts = (long long)surf->vertexArray().size();
+	long long v;
+
+	d_trivertices.clear();
+	d_trivertices.reserve(3*trianglesList.size());
+	for( CsiTriangleItr itr = trianglesList.begin(); itr != trianglesList.end(); ++itr )
+	{
+		d_trivertices.push_back(itr->v1);
+		d_trivertices.push_back(itr->v2);
+		d_trivertices.push_back(itr->v3);
+	}
+	long long nslots = (long long)d_trivertices.size();
+	long long s;
+
+	// Vertex to triangles
+	std::vector<unsigned int> keys(d_trivertices.begin(), d_trivertices.end());
+	_CountingSort(keys, nverts, d_vtxfirst, d_vtxtris);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (s)
+#endif
+	for( s = 0; s < nslots; s++ )
+		d_vtxtris[s] /= 3;
+
+	// Vertex to vertices: the other corners of the triangles around a vertex, two per triangle,
+	// deduplicated in place and then compacted
+	std::vector<unsigned int> nbrs(2*nslots);
+	std::vector<unsigned int> counts(nverts);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1024) private (v)
+#endif
+	for( v = 0; v < nverts; v++ )
+	{
+		unsigned int *row = nbrs.data() + 2*(size_t)d_vtxfirst[v];
+		unsigned int n = 0;
+		for( unsigned int e = d_vtxfirst[v]; e < d_vtxfirst[v+1]; e++ )
+		{
+			const int *c = &d_trivertices[3*(size_t)d_vtxtris[e]];
+			for( int k = 0; k < 3; k++ )
+				if( c[k] != v ) row[n++] = c[k];
+		}
+		std::sort(row, row + n);
+		counts[v] = (unsigned int)(std::unique(row, row + n) - row);
+	}
+
+	d_nbrfirst.assign(nverts + 1, 0);
+	d_edgefirst.assign(nverts + 1, 0);
+	for( v = 0; v < nverts; v++ )
+	{
+		const unsigned int *row = nbrs.data() + 2*(size_t)d_vtxfirst[v];
+		d_nbrfirst[v+1] = d_nbrfirst[v] + counts[v];
+		d_edgefirst[v+1] = d_edgefirst[v] + (unsigned int)(row + counts[v] - std::upper_bound(row, row + counts[v], (unsigned int)v));
+	}
+
+	d_nbrs.resize(d_nbrfirst[nverts]);
+	d_edgevertices.resize(2*(size_t)d_edgefirst[nverts]);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1024) private (v)
+#endif
+	for( v = 0; v < nverts; v++ )
+	{
+		const unsigned int *row = nbrs.data() + 2*(size_t)d_vtxfirst[v];
+		std::copy(row, row + counts[v], d_nbrs.begin() + d_nbrfirst[v]);
+
+		unsigned int edge = d_edgefirst[v];
+		for( const unsigned int *hi = std::upper_bound(row, row + counts[v], (unsigned int)v); hi < row + counts[v]; hi++, edge++ )
+		{
+			d_edgevertices[2*(size_t)edge] = (int)v;
+			d_edgevertices[2*(size_t)edge+1] = (int)*hi;
+		}
+	}
+
+	// Edge of each triangle slot, and edge to triangles
+	d_triedges.resize(nslots);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (s)
+#endif
+	for( s = 0; s < nslots; s++ )
+	{
+		int a, b;
+		SlotVertices((int)(s%3), a, b);
+		d_triedges[s] = FindEdge(d_trivertices[s - s%3 + a], d_trivertices[s - s%3 + b]);
+	}
+
+	// Slots of degenerate triangles joining a vertex to itself have no edge and are left out
+	_CountingSort(d_triedges, NumEdges(), d_edgetrifirst, d_edgetris);
+	long long nedgetris = (long long)d_edgetris.size();
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (s)
+#endif
+	for( s = 0; s < nedgetris; s++ )
+		d_edgetris[s] /= 3;
+}
+
+/**
+* FindEdge
+* ------------------------------------------------------------------------
+* Returns the id of the edge joining two vertices, NO_EDGE if there is none
+*/
+unsigned int DistAdjacency::FindEdge(int a, int b) const
+{
+	int lo = std::min(a, b), hi = std::max(a, b);
+	const unsigned int *row = VertexNeighbors(lo);
+	const unsigned int *end = row + NumVertexNeighbors(lo);
+	const unsigned int *upper = std::upper_bound(row, end, (unsigned int)lo);
+	const unsigned int *found = std::lower_bound(upper, end, (unsigned int)hi);
+	if( found == end || *found != (unsigned int)hi ) return NO_EDGE;
+	return d_edgefirst[lo] + (unsigned int)(found - upper);
+}
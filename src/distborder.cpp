@@ -0,0 +1,137 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "distborder.h"
+#include "distomp.h"
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* ReadRecords
+* ------------------------------------------------------------------------
+* Adds the BSTONE (border vertex) and BORDER (border edge) records of a GOCAD TSurf file to the
+* flags. Record ids are mapped to mesh vertices through the TRGL records, which are read in the
+* same order as the triangle list; ids are local to each object of the file.
+* @param[in] filename - .ts file
+* @param[in] adjacency - adjacency of the mesh
+* @param[in,out] vflags, eflags - border flags of vertices and edges
+*/
+void BorderMap::ReadRecords(std::string filename, const DistAdjacency &adjacency,
+	std::vector<unsigned char> &vflags, std::vector<unsigned char> &eflags)
+{
+	FILE *fp = fopen(filename.c_str(), "r");
+	if( fp == NULL ) return;
+
+	std::vector<int> ids; // mesh vertex of each record id of the current object
+	size_t ntri = 0;
+	char line[1024];
+	while( fgets(line, sizeof(line), fp) != NULL )
+	{
+		if( strncmp(line, "GOCAD ", 6) == 0 ) ids.clear();
+		else if( strncmp(line, "TRGL ", 5) == 0 && ntri < adjacency.NumTriangles() )
+		{
+			int r[3], v[3] = { adjacency.TriangleVertex(ntri, 0), adjacency.TriangleVertex(ntri, 1), adjacency.TriangleVertex(ntri, 2) };
+			ntri++;
+			if( sscanf(line + 5, "%d %d %d", &r[0], &r[1], &r[2]) != 3 ) continue;
+			for( int k = 0; k < 3; k++ )
+			{
+				if( r[k] < 0 ) continue;
+				if( (size_t)r[k] >= ids.size() ) ids.resize(r[k] + 1, -1);
+				ids[r[k]] = v[k];
+			}
+		}
+		else if( strncmp(line, "BSTONE ", 7) == 0 )
+		{
+			int r;
+			if( sscanf(line + 7, "%d", &r) == 1 && r >= 0 && (size_t)r < ids.size() && ids[r] >= 0 ) vflags[ids[r]] = 1;
+		}
+		else if( strncmp(line, "BORDER ", 7) == 0 )
+		{
+			int id, r0, r1;
+			if( sscanf(line + 7, "%d %d %d", &id, &r0, &r1) != 3 || r0 < 0 || r1 < 0 ) continue;
+			if( (size_t)r0 >= ids.size() || (size_t)r1 >= ids.size() || ids[r0] < 0 || ids[r1] < 0 ) continue;
+
+			unsigned int edge = adjacency.FindEdge(ids[r0], ids[r1]);
+			if( edge == NO_EDGE ) continue;
+			vflags[ids[r0]] = vflags[ids[r1]] = 1;
+			eflags[edge] = 1;
+		}
+	}
+	fclose(fp);
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Build
+* ------------------------------------------------------------------------
+* Finds the border vertices and edges of a mesh in linear time, from the number of triangles
+* sharing each edge of the adjacency
+* @param[in] adjacency - adjacency of the mesh
+* @param[in] filename - optional GOCAD file of the mesh, whose border records are merged
+*/
+void BorderMap::Build(const DistAdjacency &adjacency, std::string filename)
+{
+	long long nverts = (long long)adjacency.NumVertices();
+	long long nedges = (long long)adjacency.NumEdges();
+	long long ntris = (long long)adjacency.NumTriangles();
+	long long v, e, t;
+
+	// Edges used by a single triangle
+	std::vector<unsigned char> eflags(nedges, 0);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (e)
+#endif
+	for( e = 0; e < nedges; e++ )
+		eflags[e] = adjacency.NumEdgeTriangles((unsigned int)e) == 1;
+
+	// Vertices with a border edge; edges belong to their lower vertex
+	std::vector<unsigned char> vflags(nverts, 0);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1024) private (v)
+#endif
+	for( v = 0; v < nverts; v++ )
+	{
+		const unsigned int *nbrs = adjacency.VertexNeighbors((int)v);
+		for( unsigned int n = 0; n < adjacency.NumVertexNeighbors((int)v) && vflags[v] == 0; n++ )
+		{
+			unsigned int edge = adjacency.FindEdge((int)v, (int)nbrs[n]);
+			if( edge != NO_EDGE && eflags[edge] ) vflags[v] = 1;
+		}
+	}
+
+	if( filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".ts") == 0 )
+		ReadRecords(filename, adjacency, vflags, eflags);
+
+	// Pack into bitsets, edges by triangle slot
+	d_vertices.assign(nverts, false);
+	d_edges.assign(3*ntris, false);
+	d_nvertices = d_nedges = 0;
+	for( v = 0; v < nverts; v++ )
+		if( vflags[v] ) { d_vertices[v] = true; d_nvertices++; }
+	for( e = 0; e < nedges; e++ )
+		if( eflags[e] ) d_nedges++;
+	for( t = 0; t < ntris; t++ )
+		for( int slot = 0; slot < 3; slot++ )
+		{
+			unsigned int edge = adjacency.Edge(t, slot);
+			if( edge != NO_EDGE && eflags[edge] ) d_edges[3*t + slot] = true;
+		}
+}
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "distbvh.h"
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* BuildNode
+* ------------------------------------------------------------------------
+* Builds the subtree of a range of triangles, splitting it at the median centroid along the
+* longest axis of the centroids
+* @param[in] centroids - centroid of each triangle
+* @param[in] tmin, tmax - bounding box of each triangle
+* @param[in] first, count - range of d_order owned by the node
+* @param[in] leafsize - maximum number of triangles of a leaf
+* @param[in] level - depth of the node, 0 for the root
+* @return - node index
+*/
+unsigned int DistBVH::BuildNode(const std::vector<GeoPoint3D> &centroids, const std::vector<GeoPoint3D> &tmin,
+	const std::vector<GeoPoint3D> &tmax, unsigned int first, unsigned int count, unsigned int leafsize, unsigned int level)
+{
+	unsigned int id = (unsigned int)d_nodes.size();
+	d_nodes.push_back(BVH_Node());
+	d_depth = std::max(d_depth, level);
+
+	BVH_Node node;
+	node.bmin = tmin[d_order[first]];
+	node.bmax = tmax[d_order[first]];
+	GeoPoint3D cmin = centroids[d_order[first]], cmax = cmin;
+	for(unsigned int i = first; i < first + count; ++i)
+	{
+		const GeoPoint3D &a = tmin[d_order[i]], &b = tmax[d_order[i]], &g = centroids[d_order[i]];
+		node.bmin = GeoPoint3D(std::min(node.bmin.x, a.x), std::min(node.bmin.y, a.y), std::min(node.bmin.z, a.z));
+		node.bmax = GeoPoint3D(std::max(node.bmax.x, b.x), std::max(node.bmax.y, b.y), std::max(node.bmax.z, b.z));
+		cmin = GeoPoint3D(std::min(cmin.x, g.x), std::min(cmin.y, g.y), std::min(cmin.z, g.z));
+		cmax = GeoPoint3D(std::max(cmax.x, g.x), std::max(cmax.y, g.y), std::max(cmax.z, g.z));
+	}
+
+	node.first = first;
+	if( count <= leafsize )
+	{
+		node.count = count;
+		node.left = node.right = 0;
+	}
+	else
+	{
+		GeoPoint3D ext = cmax - cmin;
+		int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+		unsigned int half = count/2;
+		std::nth_element(d_order.begin() + first, d_order.begin() + first + half, d_order.begin() + first + count,
+			[&centroids, axis](unsigned int a, unsigned int b) {
+				const GeoPoint3D &ga = centroids[a], &gb = centroids[b];
+				return axis == 0 ? ga.x < gb.x : (axis == 1 ? ga.y < gb.y : ga.z < gb.z);
+			});
+
+		node.count = 0;
+		node.left = BuildNode(centroids, tmin, tmax, first, half, leafsize, level + 1);
+		node.right = BuildNode(centroids, tmin, tmax, first + half, count - half, leafsize, level + 1);
+	}
+
+	d_nodes[id] = node;
+	return id;
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Build
+* ------------------------------------------------------------------------
+* Builds the hierarchy over the triangles of a surface
+* @param[in] surf - triangle mesh
+* @param[in] triangles - triangles of the mesh, indexed by their ids
+* @param[in] leafsize - maximum number of triangles per leaf
+*/
+void DistBVH::Build(CsiTSurf *surf, const std::vector<CsiTriangle*> &triangles, unsigned int leafsize)
+{
+	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
+	unsigned int ntris = (unsigned int)triangles.size();
+
+	std::vector<GeoPoint3D> centroids(ntris), tmin(ntris), tmax(ntris);
+	d_order.resize(ntris);
+	for(unsigned int t = 0; t < ntris; ++t)
+	{
+		const GeoPoint3D &a = *vtxArray[triangles[t]->v1], &b = *vtxArray[triangles[t]->v2], &c = *vtxArray[triangles[t]->v3];
+		tmin[t] = GeoPoint3D(std::min(std::min(a.x, b.x), c.x), std::min(std::min(a.y, b.y), c.y), std::min(std::min(a.z, b.z), c.z));
+		tmax[t] = GeoPoint3D(std::max(std::max(a.x, b.x), c.x), std::max(std::max(a.y, b.y), c.y), std::max(std::max(a.z, b.z), c.z));
+		centroids[t] = (1.0/3)*(a + b + c);
+		d_order[t] = t;
+	}
+
+	d_nodes.clear();
+	d_depth = 0;
+	if( ntris == 0 ) return;
+
+	d_nodes.reserve(2*ntris/std::max(leafsize, 1u) + 1);
+	BuildNode(centroids, tmin, tmax, 0, ntris, std::max(leafsize, 1u), 0);
+}
@@ -0,0 +1,320 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+	#include <dirent.h>
+	#include <utime.h>
+	#include <unistd.h>
+#else
+	#define NOMINMAX
+	#include <windows.h>
+	#include <direct.h>
+	#include <process.h>
+	#include <sys/utime.h>
+	#define getpid _getpid
+	#define utime _utime
+	#define stat _stati64 // sizes of entries beyond 2 GB
+#endif
+
+#include "distcache.h"
+#include "distio.h"
+
+// Parameters of the distance field engine that are part of the cache key
+#ifdef USE_PTHREADS
+	#define CACHE_ENGINE "bvh-pthreads"
+#else
+	#define CACHE_ENGINE "bvh"
+#endif
+#define CACHE_BAND 0.0 // 0 means the whole grid is computed, no narrow band
+#define CACHE_PRECISION "f64" // voxels; gradients are octahedral codes of DistCalc::GradientBits bits
+#define CACHE_EXT ".dfb"
+
+using namespace std;
+
+DistCache *DistCache::s_instance;
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _Hash
+* ------------------------------------------------------------------------
+* Feeds a block of bytes into a pair of FNV-1a 64 bit hashes (128 bit key)
+* @param[in,out] h - hash pair
+* @param[in] data - bytes to be hashed
+* @param[in] len - number of bytes
+*/
+static inline void _Hash(unsigned long long h[2], const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for( size_t i = 0; i < len; i++ )
+	{
+		h[0] = (h[0] ^ p[i]) * 1099511628211ULL;
+		h[1] = (h[1] ^ p[i]) * 1099511628211ULL;
+	}
+}
+
+static inline void _HashDouble(unsigned long long h[2], double v)
+{
+	if( v == 0.0 ) v = 0.0; // -0.0 and 0.0 describe the same grid
+	_Hash(h, &v, sizeof(v));
+}
+
+/**
+* _ListEntries
+* ------------------------------------------------------------------------
+* Lists the cache entries of a directory
+* @param[in] dir - cache directory
+* @param[out] entries - (last access, (size, path)) of every entry
+* @return - false if the directory cannot be read
+*/
+static bool _ListEntries(const std::string &dir,
+	std::vector< std::pair< time_t, std::pair< unsigned long long, std::string > > > &entries)
+{
+	std::vector<std::string> names;
+#ifndef _WIN32
+	DIR *d = opendir(dir.c_str());
+	if( d == NULL ) return false;
+	struct dirent *ent;
+	while( (ent = readdir(d)) != NULL )
+		names.push_back(ent->d_name);
+	closedir(d);
+#else
+	WIN32_FIND_DATAA data;
+	HANDLE h = FindFirstFileA((dir + "/*" + CACHE_EXT).c_str(), &data);
+	if( h == INVALID_HANDLE_VALUE ) return false;
+	do names.push_back(data.cFileName);
+	while( FindNextFileA(h, &data) );
+	FindClose(h);
+#endif
+
+	for( size_t i = 0; i < names.size(); i++ )
+	{
+		const std::string &name = names[i];
+		if( name.size() <= strlen(CACHE_EXT) || name.compare(name.size() - strlen(CACHE_EXT), std::string::npos, CACHE_EXT) != 0 )
+			continue;
+
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if( stat(path.c_str(), &st) != 0 ) continue;
+		entries.push_back(std::make_pair(st.st_mtime, std::make_pair((unsigned long long)st.st_size, path)));
+	}
+	return true;
+}
+
+/**
+* EntryPath
+* ------------------------------------------------------------------------
+* Returns the path of the cache entry of a given key
+*/
+std::string DistCache::EntryPath(const std::string &key)
+{
+	return d_dir + "/" + key + CACHE_EXT;
+}
+
+/**
+* Evict
+* ------------------------------------------------------------------------
+* Removes the least recently used entries until the cache fits in its size bound.
+* The most recent entry is always kept.
+*/
+void DistCache::Evict()
+{
+	std::lock_guard<std::mutex> lock(d_mutex);
+
+	// (last access, (size, path)) of every entry
+	std::vector< std::pair< time_t, std::pair< unsigned long long, std::string > > > entries;
+	if( !_ListEntries(d_dir, entries) ) return;
+
+	unsigned long long total = 0;
+	for( size_t i = 0; i < entries.size(); i++ )
+		total += entries[i].second.first;
+
+	std::sort(entries.begin(), entries.end());
+	for( size_t i = 0; total > d_maxbytes && i + 1 < entries.size(); i++ )
+	{
+		if( remove(entries[i].second.second.c_str()) != 0 ) continue;
+		total -= entries[i].second.first;
+		d_evictions++;
+	}
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* SetDirectory
+* ------------------------------------------------------------------------
+* Sets where the cache entries are kept and how much disk they may use
+* @param[in] dir - cache directory
+* @param[in] maxbytes - size bound of the directory, in bytes
+*/
+void DistCache::SetDirectory(std::string dir, unsigned long long maxbytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(d_mutex);
+		d_dir = dir;
+		d_maxbytes = maxbytes;
+	}
+	Evict();
+}
+
+/**
+* Key
+* ------------------------------------------------------------------------
+* Content address of a distance field: hash of the mesh geometry and of every
+* parameter that affects the result (grid origin, spacing, dimensions, engine,
+* band width, precision, gradient encoding, closest feature channel, sign mode and triangle labels)
+* @param[in] obj - distance field object
+* @return - 32 character hexadecimal key
+*/
+std::string DistCache::Key(DistCalc *obj)
+{
+	unsigned long long h[2] = { 14695981039346656037ULL, 0x6a09e667f3bcc909ULL };
+
+	CsiTSurfVertexArray &vtxArray = obj->d_surf->vertexArray();
+	CsiTriangleList &triangles = obj->d_surf->trianglesList();
+
+	unsigned long long counts[2] = { (unsigned long long)vtxArray.size(), (unsigned long long)triangles.size() };
+	_Hash(h, counts, sizeof(counts));
+	for( CsiTriangleItr itr = triangles.begin(); itr != triangles.end(); ++itr )
+	{
+		CsiTriangle *tri = itr.self();
+		const CsiTSurfVertex *v[3] = { vtxArray[tri->v1], vtxArray[tri->v2], vtxArray[tri->v3] };
+		for( int c = 0; c < 3; c++ )
+		{
+			_HashDouble(h, v[c]->x);
+			_HashDouble(h, v[c]->y);
+			_HashDouble(h, v[c]->z);
+		}
+	}
+
+	_HashDouble(h, obj->d_min.x);
+	_HashDouble(h, obj->d_min.y);
+	_HashDouble(h, obj->d_min.z);
+	_HashDouble(h, obj->d_size);
+	long long dims[3] = { obj->d_nx, obj->d_ny, obj->d_nz };
+	_Hash(h, dims, sizeof(dims));
+	_Hash(h, CACHE_ENGINE, strlen(CACHE_ENGINE));
+	_HashDouble(h, CACHE_BAND);
+	_Hash(h, CACHE_PRECISION, strlen(CACHE_PRECISION));
+	int gradbits = obj->GradientBits();
+	_Hash(h, &gradbits, sizeof(gradbits));
+	int features = obj->ClosestFeatures() ? 1 : 0;
+	_Hash(h, &features, sizeof(features));
+	int signmode = obj->SignMode();
+	_Hash(h, &signmode, sizeof(signmode));
+	const std::vector<unsigned short> &labels = obj->GetTriangleLabels();
+	if( !labels.empty() ) _Hash(h, &labels[0], labels.size()*sizeof(unsigned short));
+
+	char key[33];
+	snprintf(key, sizeof(key), "%016llx%016llx", h[0], h[1]);
+	return key;
+}
+
+/**
+* Load
+* ------------------------------------------------------------------------
+* Fills the object's distance field from the cache, if an entry with its key exists
+* @param[in] obj - distance field object
+* @return - true on a cache hit
+*/
+bool DistCache::Load(DistCalc *obj)
+{
+	// The label channel is not part of the .dfb format
+	if( obj->HasTriangleLabels() )
+	{
+		d_misses++;
+		return false;
+	}
+
+	std::string path = EntryPath(Key(obj));
+
+	if( DistIO::LoadBinaryField(obj, path) == false )
+	{
+		d_misses++;
+		return false;
+	}
+
+	// Refresh the entry's access time, which drives the LRU eviction
+	utime(path.c_str(), NULL);
+	d_hits++;
+	cerr << "Distance field loaded from cache: " << path << endl;
+	return true;
+}
+
+/**
+* Store
+* ------------------------------------------------------------------------
+* Adds the object's distance field to the cache and evicts old entries if needed
+* @param[in] obj - distance field object
+* @return - true if the entry was written
+*/
+bool DistCache::Store(DistCalc *obj)
+{
+	if( obj->HasTriangleLabels() ) return false;
+
+#ifndef _WIN32
+	mkdir(d_dir.c_str(), 0755);
+#else
+	_mkdir(d_dir.c_str());
+#endif
+
+	std::string path = EntryPath(Key(obj));
+
+	// Write to a temporary file first, so that readers never map a partial entry
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+	std::string tmppath = path + suffix;
+	bool saved = DistIO::SaveBinaryField(obj, tmppath);
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows
+	if( saved ) remove(path.c_str());
+#endif
+	if( saved == false || rename(tmppath.c_str(), path.c_str()) != 0 )
+	{
+		remove(tmppath.c_str());
+		cerr << "Could not store distance field in cache: " << path << endl;
+		return false;
+	}
+
+	Evict();
+	return true;
+}
+
+/**
+* Bytes
+* ------------------------------------------------------------------------
+* Returns how much disk the cache entries are currently using
+*/
+unsigned long long DistCache::Bytes()
+{
+	std::lock_guard<std::mutex> lock(d_mutex);
+
+	std::vector< std::pair< time_t, std::pair< unsigned long long, std::string > > > entries;
+	_ListEntries(d_dir, entries);
+
+	unsigned long long total = 0;
+	for( size_t i = 0; i < entries.size(); i++ )
+		total += entries[i].second.first;
+	return total;
+}
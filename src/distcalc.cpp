@@ -1,20 +1,20 @@
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <limits>
 #include <iomanip>
+#include <sstream>
 #include <utility>
+#include <algorithm>
 #include <omp.h>
 
 #include "distcalc.h"
+#include "distckpt.h"
+#include "distomp.h"
 
-#define NUM_THREADS 8
-#ifdef WIN32
-	#define USE_OPENMP
-#else
-	#ifdef USE_PTHREADS 
-		#include <pthread.h>
-	#endif	
+#if !defined(WIN32) && defined(USE_PTHREADS)
+	#include <pthread.h>
 #endif
 
 #ifdef DBGTEST
@@ -25,10 +25,17 @@ bool reg3 = false;
 bool reg4 = false;
 bool reg5 = false;
 bool reg6 = false;
+unsigned int ckptStopAfter = 0; // Grid2Mesh stops, as if killed, after computing this many checkpoint tiles
 #endif
 
 using namespace std;
 
+// Gradients of a field, resident or in bricks, for the templates indexing them
+typedef struct grad_reader {
+	const DistCalc *obj;
+	GeoPoint3D operator[](size_t idx) const { return obj->Gradient(idx); }
+} Grad_Reader;
+
 #ifdef USE_PTHREADS
 typedef struct thread_data {
 	int thread_id;
@@ -56,11 +63,12 @@ typedef struct thread_data {
 * @param[in] pt   - current loop iteration 
 * @param[in] n - total number of loop iterations 
 * @param[in] w - width of loadbar
+* @param[in] force - print even if i is not on a percent boundary (coarse grained loops)
 */ 
-static inline void _Loadbar(unsigned int i, unsigned int n, unsigned int w = 50)
+static inline void _Loadbar(unsigned int i, unsigned int n, unsigned int w = 50, bool force = false)
 {
-	if ( n < 1000 ) return;
-	if ( (i != n) && (i % (n/100) != 0) ) return;
+	if ( !force && n < 1000 ) return;
+	if ( !force && (i != n) && (i % (n/100) != 0) ) return;
 	
 	float ratio = i/(float)n;
 	unsigned int c = ratio * w;
@@ -124,6 +132,130 @@ static void* _ThreadWork(void *threadarg)
 }
 #endif
 
+/* --------------------------------
+EdgeFace table of SurfaceNets:
+   edge       face1 face2
+   ---------- ----- -----
+   up-right     up  right
+   down-left   down left
+   up-front     up  front
+   down-back   down back
+   front-right front right 
+   back-left   back left
+Front/back is -y/+y, down/up is -z/+z and left/right is -x/+x.
+---------------------------------*/
+
+// Cell corners, as (i,j,k) offsets, whose gradients are compared by each edge case
+static const int s_netEdges[6][2][3] = {
+	{ {1,0,1}, {1,1,1} }, // up-right: FrontUpRight, BackUpRight
+	{ {0,0,0}, {0,1,0} }, // down-left: FrontDownLeft, BackDownLeft
+	{ {0,0,1}, {1,0,1} }, // up-front: FrontUpLeft, FrontUpRight
+	{ {0,1,0}, {1,1,0} }, // down-back: BackDownLeft, BackDownRight
+	{ {1,0,1}, {1,0,0} }, // front-right: FrontUpRight, FrontDownRight
+	{ {0,1,0}, {0,1,1} }  // back-left: BackDownLeft, BackUpLeft
+};
+
+// Neighbour cells, as (i,j,k) offsets, of the triangle created by each edge case
+static const int s_netNeighbors[6][2][3] = {
+	{ {0,0,1}, {1,0,0} },  // up-right: up, right
+	{ {0,0,-1}, {-1,0,0} }, // down-left: down, left
+	{ {0,0,1}, {0,-1,0} }, // up-front: up, front
+	{ {0,0,-1}, {0,1,0} }, // down-back: down, back
+	{ {0,-1,0}, {1,0,0} }, // front-right: front, right
+	{ {0,1,0}, {-1,0,0} }  // back-left: back, left
+};
+
+// Vertex of an offset surface, placed in a grid cell
+typedef struct net_vertex {
+	size_t cell;
+	GeoPoint3D pos;
+} Net_Vertex;
+
+/**
+* _AttractCellVertex
+* ------------------------------------------------------------------------
+* Calculates the new coordinate of the regenerated surface vertex of a cell, attracting the cell
+* corners towards the original surface (v -= dist * n) and averaging them. Only the corners whose
+* closest point is on the surface border are used, if there are any.
+* @param[in] cellcenter - cell center
+* @param[in] size - cell size
+* @param[in] d, border, g - distance, border flag and gradient of the corners, x varying fastest
+* @param[out] fromBorder - whether the border corners were used
+*/ 
+static GeoPoint3D _AttractCellVertex(GeoPoint3D cellcenter, double size, const double d[8], const bool border[8],
+	const GeoPoint3D g[8], bool &fromBorder)
+{
+	// Attracted corners: FrontDownLeft, FrontDownRight, BackDownLeft, BackDownRight,
+	// FrontUpLeft, FrontUpRight, BackUpLeft, BackUpRight
+	GeoPoint3D corners[8];
+	for(int c = 0; c < 8; ++c)
+	{
+		corners[c] = GeoPoint3D(cellcenter.x + ((c & 1) ? size/2 : -size/2), cellcenter.y + (((c >> 1) & 1) ? size/2 : -size/2),
+			cellcenter.z + (((c >> 2) & 1) ? size/2 : -size/2));
+		corners[c] -= std::abs(d[c]) * g[c];
+	}
+
+	GeoPoint3D interp(0,0,0);
+	int ptsize = 0;
+	for(int c = 0; c < 8; ++c)
+	{
+		if( border[c] == false ) continue;
+		interp += corners[c];
+		ptsize++;
+	}
+
+	fromBorder = ptsize > 0;
+	if( ptsize == 0 )
+	{
+		for(int c = 0; c < 8; ++c)
+			interp += corners[c];
+		ptsize = 8;
+	}
+
+	interp.x /= ptsize;
+	interp.y /= ptsize;
+	interp.z /= ptsize;
+	return interp;
+}
+
+/**
+* _NetCellMask
+* ------------------------------------------------------------------------
+* Classifies a cell for SurfaceNets: one bit per edge case whose triangle is created, that is, whose
+* corner gradients flip sign and whose neighbour cells are inside the grid
+* @param[in] grads - voxel gradients, anything indexable returning a GeoPoint3D
+* @param[in] idxV - index in grads of the cell's lowest corner
+* @param[in] voxoff - index offsets of grads along x, y and z
+* @param[in] pos - cell indices in the grid
+* @param[in] dims - number of cells of the grid along x, y and z
+*/ 
+template <class Grads>
+static unsigned char _NetCellMask(const Grads &grads, size_t idxV, const long long voxoff[3], const int pos[3], const int dims[3])
+{
+	unsigned char m = 0;
+	for(int e = 0; e < 6; ++e)
+	{
+		// Triangles with a neighbour outside the grid are not created
+		bool inside = true;
+		for(int n = 0; n < 2; ++n)
+			for(int a = 0; a < 3; ++a)
+			{
+				int p = pos[a] + s_netNeighbors[e][n][a];
+				if( p < 0 || p >= dims[a] ) inside = false;
+			}
+		if( !inside ) continue;
+
+		size_t idxa = idxV, idxb = idxV;
+		for(int a = 0; a < 3; ++a)
+		{
+			idxa += s_netEdges[e][0][a]*voxoff[a];
+			idxb += s_netEdges[e][1][a]*voxoff[a];
+		}
+		if( inner(grads[idxa], grads[idxb]) < 0 ) m |= 1 << e;
+	}
+	return m;
+}
+
 /**
 * _AddVertexIntoSurf
 * ------------------------------------------------------------------------
@@ -137,104 +269,70 @@ static CsiTSurfVertex* _AddVertexIntoSurf( CsiTSurf *surf, GeoPoint3D pt)
 }
 
 /**
-* CheckNeighborVtxTriangles
+* _Unit
 * ------------------------------------------------------------------------
-* isInBorder auxiliary function 
+* Returns the vector scaled to unit length, or the fallback if it has no length
 */ 
-static bool CheckNeighborVtxTriangles(CsiTSurf *surf, CsiTSurfVertex *oriVtx, CsiTSurfVertex *currVtx)
+static inline GeoPoint3D _Unit(const GeoPoint3D &v, const GeoPoint3D &fallback)
 {
-	// Get all surface vertices
-	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
-
-	// Get current vertex triangles
-	CsiTriangleItrList &triList = currVtx->triangleitrList();
-
-	int count = 0; // Count how many times does oriVtx occur in currVtx triangles
-
-	for (CsiTriangleItrItr titritr=triList.begin(); titritr!=triList.end(); ++titritr)
-	{
-		CsiTriangle *t = titritr->self();
-
-		if( vtxArray[t->v1] == oriVtx ) count++;
-		else if( vtxArray[t->v2] == oriVtx ) count++;
-		else if( vtxArray[t->v3] == oriVtx ) count++;
-	}
-
-	if(count == 1) return true;
-	else return false;
+	double length = sqrt(inner(v, v));
+	return length > 0 ? GeoPoint3D(v.x/length, v.y/length, v.z/length) : fallback;
 }
 
 /**
-* CheckNeighborVertices
+* _CopySurface
 * ------------------------------------------------------------------------
-* isInBorder auxiliary function 
+* Returns a new triangle mesh with the same name, vertices and triangles as a given one
+* @param[in] surf - triangle mesh
 */ 
-static bool CheckNeighborVertices(CsiTSurf *surf, CsiTriangle *t, CsiTSurfVertex *oriVtx)
+static CsiTSurf* _CopySurface(CsiTSurf *surf)
 {
-	// Get all surface vertices
+	CsiTSurf *copy = new CsiTSurf(surf->name());
 	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
-
-	CsiTSurfVertex *vtx1 = vtxArray[t->v1];
-	CsiTSurfVertex *vtx2 = vtxArray[t->v2];
-	CsiTSurfVertex *vtx3 = vtxArray[t->v3];
-
-	if( vtx1 != oriVtx )
-	{
-		if( CheckNeighborVtxTriangles(surf, oriVtx, vtx1) == true ) return true;
-	}
-
-	if( vtx2 != oriVtx )
-	{
-		if( CheckNeighborVtxTriangles(surf, oriVtx, vtx2) == true ) return true;
-	}
-
-	if( vtx3 != oriVtx )
-	{
-		if( CheckNeighborVtxTriangles(surf, oriVtx, vtx3) == true ) return true;
-	}
-	return false;
+	for(int v = 0; v < vtxArray.size(); ++v)
+		copy->addVertex(vtxArray[v]->x, vtxArray[v]->y, vtxArray[v]->z, 1);
+	CsiTriangleList &triangles = surf->trianglesList();
+	for(CsiTriangleItr itr = triangles.begin(); itr != triangles.end(); ++itr)
+		copy->addTriangle(itr->v1, itr->v2, itr->v3);
+	return copy;
 }
 
 /**
-* isInBorder
+* _FeatureOnBorder
 * ------------------------------------------------------------------------
-* Informs if given surface vertex is located on the surface border 
-* @param[in] surf - triangle mesh 
-* @param[in] oriVtx - vertex to be inquired 
+* Whether a closest feature of a triangle lies on the surface border: a border vertex or a
+* border edge
+* @param[in] borders - border map of the surface
+* @param[in] tri - triangle
+* @param[in] triId - triangle id
+* @param[in] feat - closest feature, see Point2TriangleDistance
 */ 
-bool DistCalc::isInBorder(CsiTSurf *surf, CsiTSurfVertex *oriVtx)
+static bool _FeatureOnBorder(const BorderMap &borders, CsiTriangle *tri, unsigned int triId, int feat)
 {
-	// Get original vertex triangles
-	CsiTriangleItrList &triList = oriVtx->triangleitrList();
-
-	// Vertex belongs to only one triangle, thus it is on the border
-	if(triList.size() == 1) return true;
-
-	for (CsiTriangleItrItr titritr=triList.begin(); titritr!=triList.end(); ++titritr)
+	switch( feat )
 	{
-		CsiTriangle *t = titritr->self();
-
-		if( CheckNeighborVertices(surf, t, oriVtx) == true ) return true;
+		case FEAT_V1: return borders.Vertex(tri->v1);
+		case FEAT_V2: return borders.Vertex(tri->v2);
+		case FEAT_V3: return borders.Vertex(tri->v3);
+		case FEAT_E12: case FEAT_E13: case FEAT_E23: return borders.Edge(triId, feat - FEAT_E12);
 	}
-
 	return false;
 }
 
 /**
 * MountBorderMap
 * ------------------------------------------------------------------------
-* Identifies every border vertex of a surface 
+* Identifies every border vertex and edge of a surface, see BorderMap. Vertex border flags are
+* also stored in property 0 of the vertices.
 */ 
 void DistCalc::MountBorderMap(void)
 {
 	CsiTSurfVertexArray& varray = d_surf->vertexArray();
-	bool isBorder;
 
 	cerr << "Mapping Surface Boundaries..." << endl;
-	for (int i = 0; i < varray.size(); ++i) {
-		isBorder = isInBorder(d_surf, varray[i]);
-		varray[i]->setProp(0, (double)isBorder);
-	}
+	d_bordermap.Build(d_adjacency, d_filename);
+	for (int i = 0; i < varray.size(); ++i)
+		varray[i]->setProp(0, (double)d_bordermap.Vertex(i));
 
 	cerr << "Done." << endl;
 }
@@ -242,37 +340,80 @@ void DistCalc::MountBorderMap(void)
 /**
 * CheckVertexPositions
 * ------------------------------------------------------------------------
-* Check if surface vertex coordinates are located in cell centers 
+* Check if surface vertex coordinates are located in cell centers, one vertex per cell. The cell of
+* each vertex is computed from its coordinates and counted in a byte per grid cell, then the vertices
+* of the cells counted more than once are duplicates; both passes are linear in the vertices and
+* run in parallel.
 * @param[in] surf - triangle mesh 
+* @param[out] misplaced - number of vertices not lying on a cell center
+* @param[out] duplicates - number of vertices sharing a cell with another vertex
+* @return - true if every vertex is correctly placed
 */ 
-void DistCalc::CheckVertexPositions(CsiTSurf *surf)
+bool DistCalc::CheckVertexPositions(CsiTSurf *surf, unsigned int *misplaced, unsigned int *duplicates)
 {
 	int i;
 	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
-	CsiTSurfVertex *currPoint;
 	int numVtx = vtxArray.size();
-	
+	size_t ncells = (size_t)d_nx*d_ny*d_nz;
+	std::vector<size_t> cells(numVtx);
+	int nmisplaced = 0;
+
 #ifdef USE_OPENMP
-#pragma omp parallel for num_threads(NUM_THREADS) private (i,currPoint)
+#pragma omp parallel for num_threads(NUM_THREADS) private (i) reduction(+:nmisplaced)
 #endif
-	for(i = 1; i < numVtx; i++)
+	for(i = 0; i < numVtx; i++)
 	{
-		bool found = false;
-		int count = 0;
-		currPoint = vtxArray[i];
-		
-		for( auto &pairPoint : d_surfcells )
+		CsiTSurfVertex *currPoint = vtxArray[i];
+		double ci = floor((currPoint->x - d_min.x) / d_size);
+		double cj = floor((currPoint->y - d_min.y) / d_size);
+		double ck = floor((currPoint->z - d_min.z) / d_size);
+		cells[i] = ncells; // misplaced vertices are not counted as duplicates
+
+		if( ci < 0 || cj < 0 || ck < 0 || ci >= d_nx || cj >= d_ny || ck >= d_nz )
 		{
-			if (pairPoint.first.x == currPoint->x && pairPoint.first.y == currPoint->y && pairPoint.first.z == currPoint->z ) {
-				found = true;
-				count++;
-			}
+			nmisplaced++;
+			continue;
 		}
-		
-		if (found == false || count != 1) {
-			std::cerr << "Ponto posicionado incorretamente!" << std::endl;
+
+		GeoPoint3D center = CellCenter((int)ci, (unsigned int)cj, (unsigned int)ck);
+		if( currPoint->x != center.x || currPoint->y != center.y || currPoint->z != center.z )
+		{
+			nmisplaced++;
+			continue;
 		}
+		cells[i] = (size_t)d_nx*d_ny*(size_t)ck + (size_t)d_nx*(size_t)cj + (size_t)ci;
+	}
+
+	// Vertices per cell; a count could only wrap back to one with 257 vertices in a cell
+	std::vector<unsigned char> counts(ncells);
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(NUM_THREADS) private (i)
+#endif
+	for(i = 0; i < numVtx; i++)
+	{
+		if( cells[i] == ncells ) continue;
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+		counts[cells[i]]++;
+	}
+
+	int nduplicates = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for num_threads(NUM_THREADS) private (i) reduction(+:nduplicates)
+#endif
+	for(i = 0; i < numVtx; i++)
+		if( cells[i] != ncells && counts[cells[i]] != 1 ) nduplicates++;
+
+	if( misplaced != NULL ) *misplaced = nmisplaced;
+	if( duplicates != NULL ) *duplicates = nduplicates;
+
+	if( nmisplaced > 0 || nduplicates > 0 )
+	{
+		std::cerr << "Ponto posicionado incorretamente! " << nmisplaced << " misplaced and " << nduplicates << " duplicate vertices" << std::endl;
+		return false;
 	}
+	return true;
 }
 
 /**
@@ -281,164 +422,249 @@ void DistCalc::CheckVertexPositions(CsiTSurf *surf)
 * Calculates the new coordinate of a given point of the regenerated surface,
 * performing the attraction towards the original surface.
 */ 
-GeoPoint3D DistCalc::InterpolatePoint(int i, unsigned int j, unsigned int k)
+GeoPoint3D DistCalc::InterpolatePoint(int i, unsigned int j, unsigned int k, CsiTSurfVertex *vtx)
 {
-	unsigned int idxFrontDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +i;
-	unsigned int idxFrontDownRight = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +(i+1);
-	unsigned int idxBackDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j+1) +i;
-	unsigned int idxFrontUpLeft = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*j +i;
-	unsigned int idxBackDownRight = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j+1) +(i+1);
-	unsigned int idxFrontUpRight = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*j +(i+1);
-	unsigned int idxBackUpLeft = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*(j+1) +i;
-	unsigned int idxBackUpRight = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*(j+1) +(i+1);
-
-	std::vector<GeoPoint3D> points; 
-
-	unsigned int idxC = (d_nx)*(d_ny)*k + (d_nx)*j +i;
-	GeoPoint3D cellcenter = d_surfcells[idxC].first;
-
-	// Get voxel coordinates 
-	GeoPoint3D FrontDownLeft(cellcenter.x-d_size/2, cellcenter.y-d_size/2, cellcenter.z-d_size/2);
-	GeoPoint3D FrontDownRight(cellcenter.x+d_size/2, cellcenter.y-d_size/2, cellcenter.z-d_size/2);
-	GeoPoint3D BackDownLeft(cellcenter.x-d_size/2, cellcenter.y+d_size/2, cellcenter.z-d_size/2);
-	GeoPoint3D BackDownRight(cellcenter.x+d_size/2, cellcenter.y+d_size/2, cellcenter.z-d_size/2);
-	GeoPoint3D FrontUpLeft(cellcenter.x-d_size/2, cellcenter.y-d_size/2, cellcenter.z+d_size/2);
-	GeoPoint3D FrontUpRight(cellcenter.x+d_size/2, cellcenter.y-d_size/2, cellcenter.z+d_size/2);
-	GeoPoint3D BackUpLeft(cellcenter.x-d_size/2, cellcenter.y+d_size/2, cellcenter.z+d_size/2);
-	GeoPoint3D BackUpRight(cellcenter.x+d_size/2, cellcenter.y+d_size/2, cellcenter.z+d_size/2);
-
-	if(d_borders[idxFrontDownLeft] == true)
-	{
-		//attract grid point of cell  v -= dist * n
-		FrontDownLeft  -= std::abs(d_voxels[idxFrontDownLeft]) * d_gradients[idxFrontDownLeft];
-		points.push_back(FrontDownLeft);
-	}
+	size_t idxV = (size_t)(d_nx+1)*(d_ny+1)*k + (size_t)(d_nx+1)*j + i;
+	size_t voxoff[3] = { 1, (size_t)d_nx+1, (size_t)(d_nx+1)*(d_ny+1) };
 
-	if(d_borders[idxFrontDownRight] == true) 
+	double d[8];
+	bool border[8];
+	GeoPoint3D g[8];
+	for(int c = 0; c < 8; ++c)
 	{
-		//attract grid point of cell  v -= dist * n
-		FrontDownRight -= std::abs(d_voxels[idxFrontDownRight]) * d_gradients[idxFrontDownRight];
-		points.push_back(FrontDownRight);
+		size_t idx = idxV + (c & 1)*voxoff[0] + ((c >> 1) & 1)*voxoff[1] + ((c >> 2) & 1)*voxoff[2];
+		d[c] = d_voxels[idx];
+		border[c] = d_borders[idx];
+		g[c] = Gradient(idx);
 	}
 
-	if(d_borders[idxBackDownLeft] == true)
-	{
-		//attract grid point of cell  v -= dist * n
-		BackDownLeft   -= std::abs(d_voxels[idxBackDownLeft]) * d_gradients[idxBackDownLeft];
-		points.push_back(BackDownLeft);
-	}
-
-	if(d_borders[idxBackDownRight] == true)
-	{
-		//attract grid point of cell  v -= dist * n
-		BackDownRight  -= std::abs(d_voxels[idxBackDownRight]) * d_gradients[idxBackDownRight];
-		points.push_back(BackDownRight);
-	}
+	bool fromBorder;
+	GeoPoint3D interp = _AttractCellVertex(CellCenter(i, j, k), d_size, d, border, g, fromBorder);
+	vtx->setProp(0, fromBorder ? 99 : 5);
+	return interp;
+}
 
-	if(d_borders[idxFrontUpLeft] == true)
+/**
+* ProjectInCell
+* ------------------------------------------------------------------------
+* Moves a point of a cell onto the original surface with one Newton step on the signed distance
+* field, trilinearly interpolated from the cell corners, and keeps it inside the cell
+* @param[in] p - point to be projected
+* @param[in] i, j, k - cell indices
+*/ 
+GeoPoint3D DistCalc::ProjectInCell(GeoPoint3D p, int i, unsigned int j, unsigned int k)
+{
+	GeoPoint3D cellmin(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
+	double u[3] = { (p.x - cellmin.x)/d_size, (p.y - cellmin.y)/d_size, (p.z - cellmin.z)/d_size };
+	for(int a = 0; a < 3; ++a) u[a] = std::min(std::max(u[a], 0.0), 1.0);
+
+	size_t idxV = (size_t)(d_nx+1)*(d_ny+1)*k + (size_t)(d_nx+1)*j + i;
+	size_t voxoff[3] = { 1, (size_t)d_nx+1, (size_t)(d_nx+1)*(d_ny+1) };
+	double d = 0;
+	GeoPoint3D n(0,0,0);
+	for(int c = 0; c < 8; ++c)
 	{
-		//attract grid point of cell  v -= dist * n
-		FrontUpLeft    -= std::abs(d_voxels[idxFrontUpLeft]) * d_gradients[idxFrontUpLeft];
-		points.push_back(FrontUpLeft);
-	}
+		size_t idx = idxV + (c & 1)*voxoff[0] + ((c >> 1) & 1)*voxoff[1] + ((c >> 2) & 1)*voxoff[2];
+		double w = ((c & 1) ? u[0] : 1-u[0]) * (((c >> 1) & 1) ? u[1] : 1-u[1]) * (((c >> 2) & 1) ? u[2] : 1-u[2]);
 
-	if(d_borders[idxFrontUpRight] == true)
-	{
-		//attract grid point of cell  v -= dist * n
-		FrontUpRight   -= std::abs(d_voxels[idxFrontUpRight]) * d_gradients[idxFrontUpRight];
-		points.push_back(FrontUpRight);
+		// Stored gradients point away from the surface, the signed field grows along sign(d)*g
+		d += w*d_voxels[idx];
+		n += (w*(d_voxels[idx] < 0 ? -1 : 1)) * Gradient(idx);
 	}
 
-	if(d_borders[idxBackUpLeft] == true)
+	double len = sqrt(inner(n, n));
+	if( len > 1e-12 )
 	{
-		//attract grid point of cell  v -= dist * n
-		BackUpLeft     -= std::abs(d_voxels[idxBackUpLeft]) * d_gradients[idxBackUpLeft];
-		points.push_back(BackUpLeft);
+		n = (1/len) * n;
+		for(int a = 0; a < 3; ++a) u[a] -= d * (a == 0 ? n.x : a == 1 ? n.y : n.z) / d_size;
 	}
+	for(int a = 0; a < 3; ++a) u[a] = std::min(std::max(u[a], 0.0), 1.0);
+	return GeoPoint3D(cellmin.x + u[0]*d_size, cellmin.y + u[1]*d_size, cellmin.z + u[2]*d_size);
+}
 
-	if(d_borders[idxBackUpRight] == true)
-	{
-		//attract grid point of cell  v -= dist * n
-		BackUpRight    -= std::abs(d_voxels[idxBackUpRight]) * d_gradients[idxBackUpRight];
-		points.push_back(BackUpRight);
-	}
+/**
+* _BrickCells
+* ------------------------------------------------------------------------
+* Finds the active cells lying in a brick of cell planes, so that they can be processed with only
+* the gradients of that brick present
+* @param[in] cells - active cells, sorted
+* @param[in] planecells - number of cells of a plane
+* @param[in] k0 - first plane of the brick
+* @param[in] nz - number of cell planes
+* @param[out] v0, v1 - the cells of the brick are [v0, v1)
+*/ 
+static void _BrickCells(const std::vector<size_t> &cells, size_t planecells, unsigned int k0, unsigned int nz, long long &v0, long long &v1)
+{
+	unsigned int k1 = std::min(k0 + GRAD_BRICK, nz);
+	v0 = (long long)(std::lower_bound(cells.begin(), cells.end(), planecells*k0) - cells.begin());
+	v1 = (long long)(std::lower_bound(cells.begin() + v0, cells.end(), planecells*k1) - cells.begin());
+}
 
-	GeoPoint3D interp(0,0,0);
+/**
+* RelaxSurfVertices
+* ------------------------------------------------------------------------
+* Atracts all the vertices of the regenerated surface to their correct positions according to the
+* distance field. Further iterations smooth every vertex towards the mean of its face neighbours and
+* project it back onto the surface, until no vertex moves more than the tolerance. Each pass walks the
+* active cells a brick of planes at a time, so dropped gradients are computed only for the current brick.
+* @param[in] maxIter - maximum number of iterations, the first one is the attraction step
+* @param[in] tol - iterations stop when no vertex moves more than this distance
+*/ 
+void DistCalc::RelaxSurfVertices(unsigned int maxIter, double tol)
+{
+	size_t planecells = (size_t)d_nx*d_ny;
+	long long nverts = (long long)d_activecells.size();
+	long long v, v0, v1;
 
-	int ptsize = points.size();
-	if(ptsize == 0)
+	// Attraction step
+	for(unsigned int k0 = 0; k0 < d_nz; k0 += GRAD_BRICK)
 	{
-		d_surfcells[idxC].second->setProp(0, 5);
-		FrontDownLeft  -= std::abs(d_voxels[idxFrontDownLeft]) * d_gradients[idxFrontDownLeft];
-		FrontDownRight -= std::abs(d_voxels[idxFrontDownRight]) * d_gradients[idxFrontDownRight];
-		BackDownLeft   -= std::abs(d_voxels[idxBackDownLeft]) * d_gradients[idxBackDownLeft];
-		BackDownRight  -= std::abs(d_voxels[idxBackDownRight]) * d_gradients[idxBackDownRight];
-		FrontUpLeft    -= std::abs(d_voxels[idxFrontUpLeft]) * d_gradients[idxFrontUpLeft];
-		FrontUpRight   -= std::abs(d_voxels[idxFrontUpRight]) * d_gradients[idxFrontUpRight];
-		BackUpLeft     -= std::abs(d_voxels[idxBackUpLeft]) * d_gradients[idxBackUpLeft];
-		BackUpRight    -= std::abs(d_voxels[idxBackUpRight]) * d_gradients[idxBackUpRight];
-
-		points.push_back(FrontDownLeft);
-		points.push_back(FrontDownRight);
-		points.push_back(BackDownLeft);
-		points.push_back(BackDownRight);
-		points.push_back(FrontUpLeft);
-		points.push_back(FrontUpRight);
-		points.push_back(BackUpLeft);
-		points.push_back(BackUpRight);
-	}
-	//////
-	else
-	{
-		d_surfcells[idxC].second->setProp(0, 99);
+		_BrickCells(d_activecells, planecells, k0, d_nz, v0, v1);
+		if( v0 < v1 ) EnsureGradients(k0, k0 + GRAD_BRICK+1);
+#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 256) private (v)
+#endif
+		for(v = v0; v < v1; ++v)
+		{
+			size_t idx = d_activecells[v];
+			CsiTSurfVertex *vtx = d_cellvertices[v];
+			GeoPoint3D interpPt = InterpolatePoint((int)(idx % d_nx), (unsigned int)((idx % planecells) / d_nx), (unsigned int)(idx / planecells), vtx);
+			vtx->x = interpPt.x; 
+			vtx->y = interpPt.y;
+			vtx->z = interpPt.z;
+		}
+		ReleaseGradients(0, k0 + GRAD_BRICK+1);
 	}
 
-	// refresh value
-	ptsize = points.size();
+	// Smoothing iterations, computed from the previous positions of all the vertices
+	std::vector<GeoPoint3D> newpos(nverts);
+	std::vector<double> moves(nverts);
+	long long celloff[3] = { 1, (long long)d_nx, (long long)planecells };
+	int dims[3] = { d_nx, (int)d_ny, (int)d_nz };
+	unsigned int iter;
+	for(iter = 1; iter < maxIter; ++iter)
+	{
+		for(unsigned int k0 = 0; k0 < d_nz; k0 += GRAD_BRICK)
+		{
+			_BrickCells(d_activecells, planecells, k0, d_nz, v0, v1);
+			if( v0 < v1 ) EnsureGradients(k0, k0 + GRAD_BRICK+1);
+#ifdef USE_OPENMP
+			#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 256) private (v)
+#endif
+			for(v = v0; v < v1; ++v)
+			{
+				size_t idx = d_activecells[v];
+				int pos[3] = { (int)(idx % d_nx), (int)((idx % planecells) / d_nx), (int)(idx / planecells) };
+				CsiTSurfVertex *vtx = d_cellvertices[v];
 
-	for(int i = 0; i < ptsize; i++)
-		interp += points[i];
+				GeoPoint3D mean(0,0,0);
+				int cnt = 0;
+				for(int a = 0; a < 3; ++a)
+				{
+					for(int dir = -1; dir <= 1; dir += 2)
+					{
+						if( pos[a] + dir < 0 || pos[a] + dir >= dims[a] ) continue;
+						CsiTSurfVertex *nb = CellVertex(idx + dir*celloff[a]);
+						if( nb == NULL ) continue;
+						mean += GeoPoint3D(nb->x, nb->y, nb->z);
+						cnt++;
+					}
+				}
 
-	interp.x /= points.size();
-	interp.y /= points.size();
-	interp.z /= points.size();
+				GeoPoint3D old(vtx->x, vtx->y, vtx->z);
+				if( cnt == 0 ) mean = old;
+				else
+				{
+					mean.x /= cnt;
+					mean.y /= cnt;
+					mean.z /= cnt;
+				}
+				newpos[v] = ProjectInCell(mean, pos[0], pos[1], pos[2]);
+				GeoPoint3D delta = newpos[v] - old;
+				moves[v] = sqrt(inner(delta, delta));
+			}
+			ReleaseGradients(0, k0 + GRAD_BRICK+1);
+		}
 
-	return interp;
+		double maxmove = 0;
+		for(v = 0; v < nverts; ++v)
+		{
+			CsiTSurfVertex *vtx = d_cellvertices[v];
+			vtx->x = newpos[v].x;
+			vtx->y = newpos[v].y;
+			vtx->z = newpos[v].z;
+			maxmove = std::max(maxmove, moves[v]);
+		}
+		if( maxmove <= tol ) break;
+	}
+	if( maxIter > 1 ) cerr << "Relaxation iterations: " << std::min(iter+1, maxIter) << endl;
 }
 
 /**
-* RelaxSurfVertices
+* ComputeVoxel
 * ------------------------------------------------------------------------
-* Atracts all the vertices of the regenerated surface to their correct positions according to the
-* distance field
+* Calculates the distance field values of a single grid point, see ComputePoint
+* @param[in] i, j, k - grid point indices
 */ 
-void DistCalc::RelaxSurfVertices()
+void DistCalc::ComputeVoxel(int i, unsigned int j, unsigned int k, double &d, bool &isBorder, GeoPoint3D &gradient,
+	unsigned int *triId, unsigned int *st)
 {
-	// loop variables
-	unsigned int j, k;
-	unsigned int idx;
-	int i;
-	GeoPoint3D defaultpoint;
-	GeoPoint3D interpPt;
+	GeoPoint3D point(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
+	ComputePoint(point, d, isBorder, gradient, triId, st);
+}
 
-	for(i = 0; i < d_nx; ++i)
+/**
+* _CellVertexQEF
+* ------------------------------------------------------------------------
+* Places the dual contouring vertex of a cell, minimizing the quadratic error of the planes
+* given by the closest points and normals of the cell corners. The solution is pulled towards
+* the mass point of the closest points, so that flat and creased regions stay well defined.
+* @param[in] q - closest point on the surface of each corner
+* @param[in] n - unit normal at each closest point
+* @param[in] cnt - number of corners
+* @param[in] lambda - weight of the mass point regularization
+* @return - vertex position, not yet clamped to the cell
+*/ 
+static GeoPoint3D _CellVertexQEF(const GeoPoint3D *q, const GeoPoint3D *n, int cnt, double lambda)
+{
+	GeoPoint3D mass(0,0,0);
+	for(int c = 0; c < cnt; ++c) mass += q[c];
+	mass.x /= cnt;
+	mass.y /= cnt;
+	mass.z /= cnt;
+
+	// Normal equations relative to the mass point: (AtA + lambda*I) y = Atb
+	double a[3][3] = { {lambda,0,0}, {0,lambda,0}, {0,0,lambda} };
+	double b[3] = { 0, 0, 0 };
+	for(int c = 0; c < cnt; ++c)
 	{
-		for(j = 0; j < d_ny; ++j)
+		double nv[3] = { n[c].x, n[c].y, n[c].z };
+		double dist = inner(n[c], q[c] - mass);
+		for(int r = 0; r < 3; ++r)
 		{
-			for(k = 0; k < d_nz; ++k)
-			{
-				idx = (d_nx)*(d_ny)*k + (d_nx)*j +i;
+			for(int l = 0; l < 3; ++l) a[r][l] += nv[r]*nv[l];
+			b[r] += nv[r]*dist;
+		}
+	}
 
-				// Not a vertex from the surface
-				if(d_surfcells[idx].second == NULL) continue;
+	// Solve by Cramer's rule, the system is positive definite for lambda > 0
+	double det = a[0][0]*(a[1][1]*a[2][2] - a[1][2]*a[2][1])
+	           - a[0][1]*(a[1][0]*a[2][2] - a[1][2]*a[2][0])
+	           + a[0][2]*(a[1][0]*a[2][1] - a[1][1]*a[2][0]);
+	if( std::abs(det) < 1e-12 ) return mass;
 
-				interpPt = InterpolatePoint(i, j, k);
-				d_surfcells[idx].second->x = interpPt.x; 
-				d_surfcells[idx].second->y = interpPt.y;
-				d_surfcells[idx].second->z = interpPt.z;
-			}
-		}
+	double y[3];
+	for(int col = 0; col < 3; ++col)
+	{
+		double m[3][3];
+		for(int r = 0; r < 3; ++r)
+			for(int l = 0; l < 3; ++l)
+				m[r][l] = (l == col) ? b[r] : a[r][l];
+		y[col] = (m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+		        - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+		        + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0])) / det;
 	}
+	return GeoPoint3D(mass.x + y[0], mass.y + y[1], mass.z + y[2]);
 }
 
 /**
@@ -459,37 +685,17 @@ void DistCalc::RelaxSurfVertices()
 #ifndef USE_PTHREADS 
 void DistCalc::Grid2Mesh()
 {
-	// loop variables
-	int i;
-	unsigned int j, k;
-
 	if( d_nx < 1 || d_ny < 1 || d_nz < 1 )
 		return ;
 
-	d_voxels.resize((d_nx+1)*(d_ny+1)*(d_nz+1));
-	d_borders.resize((d_nx+1)*(d_ny+1)*(d_nz+1));
-	d_gradients.resize((d_nx+1)*(d_ny+1)*(d_nz+1));
+	size_t planesize = (size_t)(d_nx+1)*(d_ny+1);
+	AllocateField();
 
 	// Variable to used for printing progress bar
 	cerr << "Loading Surface " << d_surf->name() << endl;
 	cerr << "Number of triangles: "<< d_surf->trianglesList().size() << endl;
 	cerr << "Number of vertices: "<< d_surf->vertexArray().size() << endl;
 	cerr << "Step Size: " << d_size << endl;
-	unsigned int progress = 0;
-
-	double d; // distance from voxel to the surface
-	unsigned int idx; // vector index
-
-	double s, t;
-	CsiTriangle *clostri;
-	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
-	GeoPoint3D point;
-	GeoPoint3D edge0;
-	GeoPoint3D edge1;
-	GeoPoint3D triangpoint;
-
-	bool *isBorder = new bool; // Flag that indicates whether the closest point in the surface from the voxel is located on the surface border 
-	*isBorder = false; 
 
 #ifdef USE_OPENMP
 	cerr << "Using OpenMP" << endl;
@@ -498,42 +704,63 @@ void DistCalc::Grid2Mesh()
 	// start timing measure
 	double ctimeBegin = omp_get_wtime();
 
-#ifdef USE_OPENMP
-	#pragma omp parallel for num_threads(NUM_THREADS) private (d,idx,i,j,k,clostri,s,t,point,triangpoint,edge0,edge1)
-#endif
-	for(i = 0; i <= d_nx; ++i)
+	// Resume from the checkpoint, if enabled, and compute only the missing tiles
+	DistCheckpoint *ckpt = NULL;
+	unsigned int tiledepth = 1;
+	if( d_ckptfile.empty() == false )
 	{
-		for(j = 0; j <= d_ny; ++j)
+		ckpt = new DistCheckpoint(d_ckptfile, d_ckpttile, d_ckptinterval);
+		if( ckpt->Open(this) == false )
 		{
-			for(k = 0; k <= d_nz; ++k)
-			{
-			 	// Set voxel coordinate
-				point = GeoPoint3D(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
-
-				// Calculate distance from voxel to surface
-				clostri = NULL;
-				d = Point2MeshDistance(point, s, t, isBorder, &clostri );
+			cerr << "Could not open checkpoint " << d_ckptfile << ", running without it" << endl;
+			delete ckpt;
+			ckpt = NULL;
+		}
+		else tiledepth = ckpt->TileDepth();
+	}
+	unsigned int ntiles = (d_nz+1 + tiledepth-1)/tiledepth;
+	unsigned int computed = 0;
 
-				// Store value in d_voxels
-				idx = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +i;
-				d_voxels[idx] = d;
+	// Border flags are bit packed and gradients encoded, so they are computed into tile buffers
+	std::vector<unsigned char> borders(planesize*tiledepth);
+	std::vector<GeoPoint3D> gradients(planesize*tiledepth);
+	for(unsigned int tile = 0; tile < ntiles; ++tile)
+	{
+		unsigned int k0 = tile*tiledepth;
+		unsigned int nk = std::min(tiledepth, d_nz+1 - k0);
+		if( ckpt != NULL && ckpt->IsDone(tile) ) continue;
+
+		size_t offset = planesize*k0;
+		ComputeSlab(k0, nk, &d_voxels[offset], &borders[0], &gradients[0],
+			d_features ? &d_clostris[offset] : NULL, d_features ? &d_closest[offset] : NULL,
+			d_labels.empty() ? NULL : &d_labels[offset]);
+		for(size_t idx = 0; idx < planesize*nk; ++idx)
+			d_borders[offset+idx] = borders[idx] != 0;
+		d_gradients.Encode(offset, &gradients[0], planesize*nk);
+
+		if( ckpt != NULL && ckpt->MarkDone(this, tile) == false )
+			cerr << endl << "Could not write checkpoint " << d_ckptfile << endl;
+		computed++;
 
-				// Store field distance gradient
-				// The triangle function is T(s; t) = B + sE0 + tE1
-				edge0 = GeoPoint3D(*vtxArray[clostri->v2] - *vtxArray[clostri->v1]);
-				edge1 = GeoPoint3D(*vtxArray[clostri->v3] - *vtxArray[clostri->v1]);
-				triangpoint = GeoPoint3D(*vtxArray[clostri->v1] + s*edge0 + t*edge1);
-				d_gradients[idx] = point - triangpoint;
-				d_gradients[idx] = normalize(d_gradients[idx]); 
+#ifdef DBGTEST
+		if( ckpt != NULL && computed == ckptStopAfter )
+		{
+			// Stop as a killed process would: the pending tiles are dropped, not flushed, and
+			// everything flushed before is already synced
+			delete ckpt;
+			return;
+		}
+#endif
 
-				// Store flag that indicates if closest point in the surface is on the border
-				d_borders[idx] = *isBorder;
+		// Update progress bar
+		_Loadbar(k0+nk, d_nz+1, 50, true);
+	}
 
-				// Update progress bar
-				progress++;
-				_Loadbar(progress, d_voxels.size());
-			}
-		}
+	// The field is complete, the checkpoint is no longer needed
+	if( ckpt != NULL )
+	{
+		ckpt->Remove();
+		delete ckpt;
 	}
 	
 	// end timing measure
@@ -565,6 +792,10 @@ void DistCalc::Grid2Mesh()
 	void *exit_status;
 	cerr << "Using Pthreads: " << endl;
 
+	// Threads split the grid along x, not in tiles of planes, so nothing can be resumed
+	if( d_ckptfile.empty() == false )
+		cerr << "Checkpoint " << d_ckptfile << " is not supported with Pthreads, running without it" << endl;
+
 	// Measure Time
 	double ctimeBegin = omp_get_wtime();
 
@@ -583,11 +814,441 @@ void DistCalc::Grid2Mesh()
   for(i = 0 ; i < NUM_THREADS; i++)
       pthread_join(threads[i], &exit_status);
 
-	// end timing measure
+	// end timing measure
+	double ctimeEnd = omp_get_wtime();
+	cerr << endl << "Distance Field calculation time: "<< ctimeEnd - ctimeBegin << endl;
+}
+#endif
+
+/**
+* Grid2MeshNets
+* ------------------------------------------------------------------------
+* Calculates the distance field and regenerates the surface (SurfaceNets) in one pass, brick by
+* brick, without keeping the whole grid: each brick computes its voxels plus a one voxel halo,
+* extracts and relaxes its own cell vertices and emits its triangles as global cell ids. Patches
+* are stitched at the end by sorting the vertices by cell. d_voxels, d_borders and d_gradients are
+* left untouched.
+* @param[in] brick - brick size, in cells along each axis
+*/ 
+CsiTSurf* DistCalc::Grid2MeshNets(unsigned int brick)
+{
+	if( d_nx < 1 || d_ny < 1 || d_nz < 1 )
+		return NULL;
+	if( brick < 1 ) brick = 1;
+
+	cerr << "Loading Surface " << d_surf->name() << endl;
+	cerr << "Number of triangles: "<< d_surf->trianglesList().size() << endl;
+	cerr << "Number of vertices: "<< d_surf->vertexArray().size() << endl;
+	cerr << "Step Size: " << d_size << endl;
+
+	double ctimeBegin = omp_get_wtime();
+
+	int dims[3] = { d_nx, (int)d_ny, (int)d_nz };
+	int nbricks[3];
+	for(int a = 0; a < 3; ++a) nbricks[a] = (dims[a] + brick-1) / brick;
+	int total = nbricks[0]*nbricks[1]*nbricks[2];
+	size_t planecells = (size_t)d_nx*d_ny;
+	long long celloff[3] = { 1, (long long)d_nx, (long long)planecells };
+
+	// Surface patch of every brick: relaxed cell vertices and triangles as global cell ids
+	std::vector< std::vector<Net_Vertex> > patchverts(total);
+	std::vector< std::vector<unsigned char> > patchprops(total);
+	std::vector< std::vector<size_t> > patchtris(total);
+	int done = 0;
+	int b;
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (b)
+#endif
+	for(b = 0; b < total; ++b)
+	{
+		int bpos[3] = { b % nbricks[0], (b / nbricks[0]) % nbricks[1], b / (nbricks[0]*nbricks[1]) };
+		int c0[3], c1[3]; // cells of the brick
+		int h0[3], h1[3]; // cells of the brick plus halo
+		int vdim[3]; // voxels of the brick plus halo
+		for(int a = 0; a < 3; ++a)
+		{
+			c0[a] = bpos[a]*brick;
+			c1[a] = std::min(c0[a] + (int)brick, dims[a]);
+			h0[a] = std::max(c0[a] - 1, 0);
+			h1[a] = std::min(c1[a] + 1, dims[a]);
+			vdim[a] = h1[a] - h0[a] + 1;
+		}
+		long long voxoff[3] = { 1, vdim[0], (long long)vdim[0]*vdim[1] };
+		size_t nvox = (size_t)vdim[0]*vdim[1]*vdim[2];
+
+		// Distance field of the brick and its halo
+		// Gradients are encoded as in d_gradients, so the result matches Grid2Mesh + SurfaceNets
+		std::vector<double> voxels(nvox);
+		std::vector<unsigned char> borders(nvox);
+		DistGradients gradients(d_gradients.Bits());
+		gradients.resize(nvox);
+		for(int k = 0; k < vdim[2]; ++k)
+			for(int j = 0; j < vdim[1]; ++j)
+				for(int i = 0; i < vdim[0]; ++i)
+				{
+					size_t idx = voxoff[2]*k + voxoff[1]*j + i;
+					bool isBorder;
+					GeoPoint3D gradient;
+					ComputeVoxel(h0[0]+i, h0[1]+j, h0[2]+k, voxels[idx], isBorder, gradient);
+					borders[idx] = isBorder;
+					gradients.set(idx, gradient);
+				}
+
+		// Classify the cells of the brick and its halo
+		int hdim[3] = { h1[0]-h0[0], h1[1]-h0[1], h1[2]-h0[2] };
+		std::vector<unsigned char> mask((size_t)hdim[0]*hdim[1]*hdim[2]);
+		for(int k = 0; k < hdim[2]; ++k)
+			for(int j = 0; j < hdim[1]; ++j)
+				for(int i = 0; i < hdim[0]; ++i)
+				{
+					int pos[3] = { h0[0]+i, h0[1]+j, h0[2]+k };
+					mask[((size_t)hdim[1]*k + j)*hdim[0] + i] = _NetCellMask(gradients, voxoff[2]*k + voxoff[1]*j + i, voxoff, pos, dims);
+				}
+
+		// Extract the cells of the brick
+		for(int k = c0[2]; k < c1[2]; ++k)
+			for(int j = c0[1]; j < c1[1]; ++j)
+				for(int i = c0[0]; i < c1[0]; ++i)
+				{
+					int lpos[3] = { i-h0[0], j-h0[1], k-h0[2] };
+					unsigned char m = mask[((size_t)hdim[1]*lpos[2] + lpos[1])*hdim[0] + lpos[0]];
+					size_t cell = planecells*k + (size_t)d_nx*j + i;
+					bool active = m != 0;
+
+					// Is this cell a neighbour in a triangle of another cell?
+					for(int e = 0; e < 6 && !active; ++e)
+					{
+						for(int n = 0; n < 2 && !active; ++n)
+						{
+							int o[3];
+							bool inside = true;
+							for(int a = 0; a < 3; ++a)
+							{
+								o[a] = lpos[a] - s_netNeighbors[e][n][a];
+								if( o[a] < 0 || o[a] >= hdim[a] ) inside = false;
+							}
+							if( inside && ((mask[((size_t)hdim[1]*o[2] + o[1])*hdim[0] + o[0]] >> e) & 1) ) active = true;
+						}
+					}
+					if( !active ) continue;
+
+					// Relaxed vertex of the cell
+					size_t idxV = voxoff[2]*lpos[2] + voxoff[1]*lpos[1] + lpos[0];
+					double d[8];
+					bool border[8];
+					GeoPoint3D g[8];
+					for(int c = 0; c < 8; ++c)
+					{
+						size_t idx = idxV + (c & 1)*voxoff[0] + ((c >> 1) & 1)*voxoff[1] + ((c >> 2) & 1)*voxoff[2];
+						d[c] = voxels[idx];
+						border[c] = borders[idx] != 0;
+						g[c] = gradients[idx];
+					}
+					GeoPoint3D cellcenter(d_min.x + i*d_size + d_size/2, d_min.y + j*d_size + d_size/2, d_min.z + k*d_size + d_size/2);
+					bool fromBorder;
+					Net_Vertex vtx;
+					vtx.cell = cell;
+					vtx.pos = _AttractCellVertex(cellcenter, d_size, d, border, g, fromBorder);
+					patchverts[b].push_back(vtx);
+					patchprops[b].push_back(fromBorder ? 99 : 5);
+
+					// Triangles owned by the cell
+					for(int e = 0; e < 6; ++e)
+					{
+						if( ((m >> e) & 1) == 0 ) continue;
+						patchtris[b].push_back(cell);
+						for(int n = 0; n < 2; ++n)
+						{
+							long long ncell = (long long)cell;
+							for(int a = 0; a < 3; ++a) ncell += s_netNeighbors[e][n][a]*celloff[a];
+							patchtris[b].push_back((size_t)ncell);
+						}
+					}
+				}
+
+#ifdef USE_OPENMP
+		#pragma omp atomic
+#endif
+		done++;
+#ifdef USE_OPENMP
+		if( omp_get_thread_num() == 0 )
+#endif
+			_Loadbar(done, total);
+	}
+	_Loadbar(total, total, 50, true);
+
+	// Stitch the patches: number the vertices by cell, cells are owned by a single brick
+	std::vector< std::pair<size_t, std::pair<int, size_t> > > order; // cell, (brick, vertex)
+	for(b = 0; b < total; ++b)
+		for(size_t v = 0; v < patchverts[b].size(); ++v)
+			order.push_back(std::make_pair(patchverts[b][v].cell, std::make_pair(b, v)));
+	std::sort(order.begin(), order.end());
+
+	CsiTSurf *newsurf = new CsiTSurf(d_surf->name() + "_NET");
+	std::vector<size_t> cells(order.size());
+	std::vector<CsiTSurfVertex*> vertices(order.size());
+	for(size_t v = 0; v < order.size(); ++v)
+	{
+		int pb = order[v].second.first;
+		size_t pv = order[v].second.second;
+		cells[v] = order[v].first;
+		vertices[v] = _AddVertexIntoSurf(newsurf, patchverts[pb][pv].pos);
+		vertices[v]->setProp(0, patchprops[pb][pv]);
+	}
+	for(b = 0; b < total; ++b)
+	{
+		for(size_t t = 0; t < patchtris[b].size(); t += 3)
+		{
+			CsiTSurfVertex *tv[3];
+			for(int c = 0; c < 3; ++c)
+				tv[c] = vertices[std::lower_bound(cells.begin(), cells.end(), patchtris[b][t+c]) - cells.begin()];
+			newsurf->addTriangle(tv[0]->pos, tv[1]->pos, tv[2]->pos);
+		}
+	}
+
+	cerr << "Number of triangles: "<< newsurf->trianglesList().size() << endl;
+	cerr << "Number of vertices: "<< newsurf->vertexArray().size() << endl;
+
+	double ctimeEnd = omp_get_wtime();
+	cerr << "Fused distance field and surface regeneration time: "<< ctimeEnd - ctimeBegin << endl;
+	return newsurf;
+}
+
+/**
+* SetCheckpoint
+* ------------------------------------------------------------------------
+* Makes Grid2Mesh periodically save completed tiles to a checkpoint file and resume from it
+* when restarted. The file is removed when the field is complete. Builds with USE_PTHREADS
+* ignore the checkpoint and say so.
+* @param[in] filename - checkpoint file, empty disables checkpointing
+* @param[in] tiledepth - number of grid planes per tile
+* @param[in] interval - minimum time between checkpoint writes, in seconds
+*/ 
+void DistCalc::SetCheckpoint(std::string filename, unsigned int tiledepth, double interval)
+{
+	d_ckptfile = filename;
+	d_ckpttile = tiledepth;
+	d_ckptinterval = interval;
+}
+
+/**
+* ComputeSlab
+* ------------------------------------------------------------------------
+* Calculates the distance field of the grid planes [k0, k0+nk) into caller provided buffers,
+* each one holding nk*(d_nx+1)*(d_ny+1) elements in grid order
+* @param[in] k0 - first plane of the slab
+* @param[in] nk - number of planes
+* @param[out] voxels - signed distances
+* @param[out] borders - border flags (0 or 1)
+* @param[out] gradients - unit gradients
+* @param[out] tris - optional, closest triangle ids
+* @param[out] st - optional, packed (s,t) of the closest points
+* @param[out] labels - optional, labels of the closest triangles, see SetTriangleLabels
+*/ 
+void DistCalc::ComputeSlab(unsigned int k0, unsigned int nk, double *voxels, unsigned char *borders, GeoPoint3D *gradients,
+	unsigned int *tris, unsigned int *st, unsigned short *labels)
+{
+	int nrows = (int)(nk*(d_ny+1));
+	int row;
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (row)
+#endif
+	for(row = 0; row < nrows; ++row)
+	{
+		unsigned int k = k0 + row/(d_ny+1);
+		unsigned int j = row%(d_ny+1);
+		size_t offset = (size_t)row*(d_nx+1);
+		for(int i = 0; i <= d_nx; ++i)
+		{
+			bool isBorder;
+			unsigned int tri;
+			unsigned int *triId = tris != NULL ? &tris[offset+i] : (labels != NULL ? &tri : NULL);
+			ComputeVoxel(i, j, k, voxels[offset+i], isBorder, gradients[offset+i], triId, st != NULL ? &st[offset+i] : NULL);
+			borders[offset+i] = isBorder;
+			if( labels != NULL ) labels[offset+i] = d_trilabels[*triId];
+		}
+	}
+}
+
+/**
+* AllocateField
+* ------------------------------------------------------------------------
+* Sizes the voxels, border flags, gradients and, if enabled, closest features for the grid
+*/ 
+void DistCalc::AllocateField()
+{
+	size_t nvoxels = (size_t)(d_nx+1)*(d_ny+1)*(d_nz+1);
+	d_voxels.resize(nvoxels);
+	d_borders.resize(nvoxels);
+	d_gradients.resize(nvoxels);
+	d_gradbricks.clear(); // gradients come with the field
+	d_clostris.assign(d_features ? nvoxels : 0, 0);
+	d_closest.assign(d_features ? nvoxels : 0, 0);
+	d_labels.assign(d_trilabels.empty() ? 0 : nvoxels, 0);
+}
+
+/**
+* AlignGrid
+* ------------------------------------------------------------------------
+* Grows the grid box outwards onto the lattice of another grid with the same step, so that the
+* grid points of both coincide
+* @param[in] origin - first grid point of the other grid
+*/ 
+void DistCalc::AlignGrid(const GeoPoint3D &origin)
+{
+	d_min.x = origin.x + floor((d_min.x - origin.x)/d_size)*d_size;
+	d_min.y = origin.y + floor((d_min.y - origin.y)/d_size)*d_size;
+	d_min.z = origin.z + floor((d_min.z - origin.z)/d_size)*d_size;
+
+	d_nx = (int)ceil((d_max.x - d_min.x)/d_size - 1e-9);
+	d_ny = (unsigned int)ceil((d_max.y - d_min.y)/d_size - 1e-9);
+	d_nz = (unsigned int)ceil((d_max.z - d_min.z)/d_size - 1e-9);
+
+	d_max.x = d_min.x + d_nx*d_size;
+	d_max.y = d_min.y + d_ny*d_size;
+	d_max.z = d_min.z + d_nz*d_size;
+}
+
+/**
+* SetGrid
+* ------------------------------------------------------------------------
+* Replaces the grid around the surface by a given one, so that the fields of several surfaces
+* can be computed on a common grid. The box is grown on its upper side to whole steps.
+* @param[in] min - first grid point
+* @param[in] max - opposite corner of the box
+* @param[in] size - grid step
+*/ 
+void DistCalc::SetGrid(const GeoPoint3D &min, const GeoPoint3D &max, double size)
+{
+	d_size = size;
+	d_min = min;
+
+	d_nx = (int)ceil(std::max(0.0, (max.x - min.x)/d_size - 1e-9));
+	d_ny = (unsigned int)ceil(std::max(0.0, (max.y - min.y)/d_size - 1e-9));
+	d_nz = (unsigned int)ceil(std::max(0.0, (max.z - min.z)/d_size - 1e-9));
+
+	d_max.x = d_min.x + d_nx*d_size;
+	d_max.y = d_min.y + d_ny*d_size;
+	d_max.z = d_min.z + d_nz*d_size;
+}
+
+/**
+* ComputePoint
+* ------------------------------------------------------------------------
+* Calculates the distance field values of any point, on the grid or not
+* @param[in] point - point
+* @param[out] d - signed distance from the point to the surface
+* @param[out] isBorder - whether the closest point on the surface is on its border
+* @param[out] gradient - unit direction from the closest point on the surface to the point
+* @param[out] triId - optional, id of the closest triangle
+* @param[out] st - optional, packed (s,t) of the closest point, see PackST
+*/ 
+void DistCalc::ComputePoint(GeoPoint3D point, double &d, bool &isBorder, GeoPoint3D &gradient,
+	unsigned int *triId, unsigned int *st)
+{
+	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
+	double s, t;
+	CsiTriangle *clostri = NULL;
+
+	// Calculate distance from point to surface
+	isBorder = false;
+	d = Point2MeshDistance(point, s, t, &isBorder, &clostri, triId);
+	if( st != NULL ) *st = PackST(s, t);
+
+	// Store field distance gradient
+	// The triangle function is T(s; t) = B + sE0 + tE1
+	GeoPoint3D edge0(*vtxArray[clostri->v2] - *vtxArray[clostri->v1]);
+	GeoPoint3D edge1(*vtxArray[clostri->v3] - *vtxArray[clostri->v1]);
+	GeoPoint3D triangpoint(*vtxArray[clostri->v1] + s*edge0 + t*edge1);
+	gradient = point - triangpoint;
+	gradient = normalize(gradient); 
+}
+
+/**
+* Grid2MeshStreamed
+* ------------------------------------------------------------------------
+* Calculates the distance field one z-slab at a time and hands every finished slab to a sink.
+* Only one slab is resident, so the grid does not have to fit in memory; d_voxels, d_borders
+* and d_gradients are left untouched.
+* @param[in] sink - receives the computed slabs
+* @param[in] slabdepth - number of grid planes per slab
+* @return - false if the sink failed
+*/ 
+bool DistCalc::Grid2MeshStreamed(DistSlabSink *sink, unsigned int slabdepth)
+{
+	if( d_nx < 1 || d_ny < 1 || d_nz < 1 || sink == NULL )
+		return false;
+	if( slabdepth < 1 ) slabdepth = 1;
+
+	size_t planesize = (size_t)(d_nx+1)*(d_ny+1);
+	std::vector<double> voxels(planesize*slabdepth);
+	std::vector<unsigned char> borders(planesize*slabdepth);
+	std::vector<GeoPoint3D> gradients(planesize*slabdepth);
+
+	cerr << "Streaming Surface " << d_surf->name() << endl;
+	cerr << "Step Size: " << d_size << endl;
+	cerr << "Slab size: " << slabdepth << " planes, " << planesize*slabdepth*(sizeof(double)+1+sizeof(GeoPoint3D)) << " bytes" << endl;
+
+	double ctimeBegin = omp_get_wtime();
+
+	if( sink->Begin(this) == false ) return false;
+	for(unsigned int k0 = 0; k0 <= d_nz; k0 += slabdepth)
+	{
+		unsigned int nk = std::min(slabdepth, d_nz+1 - k0);
+		ComputeSlab(k0, nk, &voxels[0], &borders[0], &gradients[0]);
+		if( sink->ConsumeSlab(this, k0, nk, &voxels[0], &borders[0], &gradients[0]) == false )
+		{
+			cerr << endl << "Distance field sink failed at plane " << k0 << endl;
+			return false;
+		}
+		_Loadbar(k0+nk, d_nz+1, 50, true);
+	}
+	bool ok = sink->End(this);
+
 	double ctimeEnd = omp_get_wtime();
 	cerr << endl << "Distance Field calculation time: "<< ctimeEnd - ctimeBegin << endl;
+	return ok;
+}
+
+/**
+* EmitSlabs
+* ------------------------------------------------------------------------
+* Hands the distance field already in memory to a sink, one z-slab at a time, as
+* Grid2MeshStreamed would. Voxels are passed in place; the bit packed border flags and
+* the gradient codes are unpacked one slab at a time, and dropped gradients are computed
+* for each slab and released behind it.
+* @param[in] sink - receives the slabs
+* @param[in] slabdepth - number of grid planes per slab
+* @return - false if there is no field or the sink failed
+*/ 
+bool DistCalc::EmitSlabs(DistSlabSink *sink, unsigned int slabdepth)
+{
+	size_t planesize = (size_t)(d_nx+1)*(d_ny+1);
+	if( sink == NULL || d_voxels.size() != planesize*(d_nz+1) || d_borders.size() != d_voxels.size() ||
+	    (d_gradients.size() != d_voxels.size() && d_gradbricks.empty()) )
+		return false;
+	if( slabdepth < 1 ) slabdepth = 1;
+
+	std::vector<unsigned char> borders(planesize*slabdepth);
+	std::vector<GeoPoint3D> gradients(planesize*slabdepth);
+	if( sink->Begin(this) == false ) return false;
+	for(unsigned int k0 = 0; k0 <= d_nz; k0 += slabdepth)
+	{
+		unsigned int nk = std::min(slabdepth, d_nz+1 - k0);
+		size_t offset = planesize*k0;
+		for(size_t idx = 0; idx < planesize*nk; ++idx)
+			borders[idx] = d_borders[offset+idx];
+		EnsureGradients(k0, k0+nk);
+		for(size_t idx = 0; idx < planesize*nk; ++idx)
+			gradients[idx] = Gradient(offset+idx);
+		ReleaseGradients(0, k0+nk);
+		if( sink->ConsumeSlab(this, k0, nk, &d_voxels[offset], &borders[0], &gradients[0]) == false )
+			return false;
+	}
+	return sink->End(this);
 }
-#endif
 
 /**
 * Point2MeshDistance
@@ -597,44 +1258,64 @@ void DistCalc::Grid2Mesh()
 * @param[out] s  - s coordinate in T of the closest point from pt
 * @param[out] t  - t coordinate in T of the closest point from pt
 * @param[out] tri - closest triangle between pt and the surface
+* @param[out] triId - id of the closest triangle, its position in the triangle list
 */ 
-double DistCalc::Point2MeshDistance(GeoPoint3D pt, double &s, double &t, bool *isBorder, CsiTriangle **clostri)
+double DistCalc::Point2MeshDistance(GeoPoint3D pt, double &s, double &t, bool *isBorder, CsiTriangle **clostri, unsigned int *triId)
 {
-	CsiTriangleList &triangles = d_surf->trianglesList();
 	double minDistance = std::numeric_limits<double>::max();
 
 	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
 
 	double s0 = s, t0 = t;
-	bool *regtemp	= new bool;
-	*regtemp	= false; 
-	for(CsiTriangleItr itr = triangles.begin(); itr != triangles.end(); ++itr) 
-	{
-		double curDistance = Point2TriangleDistance(pt, itr.self(), s0, t0, regtemp);
-		
-		// Update min values
-		if( curDistance < minDistance )
-		{
-			s = s0; t = t0; *isBorder = *regtemp;
-			minDistance = curDistance;
-			*clostri = itr.self();
-		}
-	}
+	int feat = FEAT_FACE, minfeat = FEAT_FACE;
+	CsiTriangle *mintri = NULL;
+	unsigned int minid = 0;
+
+	// Nearest first descent of the hierarchy, skipping the boxes farther than the closest triangle so far
+	d_bvh.Traverse(
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+#ifndef DBGTEST
+			return DistBVH::BoxDistance2(pt, node.bmin, node.bmax) <= minDistance*minDistance;
+#else
+			// Point2TriangleDistance returns squared distances in tests
+			return DistBVH::BoxDistance2(pt, node.bmin, node.bmax) <= minDistance;
+#endif
+		},
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			for(unsigned int i = node.first; i < node.first + node.count; ++i)
+			{
+				unsigned int id = d_bvh.Order(i);
+				double curDistance = Point2TriangleDistance(pt, d_triangles[id], s0, t0, &feat);
+
+				// Update min values, ties go to the first triangle of the list
+				if( curDistance < minDistance || (curDistance == minDistance && id < minid) )
+				{
+					s = s0; t = t0;
+					minfeat = feat;
+					minDistance = curDistance;
+					mintri = d_triangles[id];
+					minid = id;
+				}
+			}
+		}, &pt);
+	if( clostri != NULL ) *clostri = mintri;
+	if( triId != NULL ) *triId = minid;
+	if( isBorder != NULL ) *isBorder = _FeatureOnBorder(d_bordermap, mintri, minid, minfeat);
+
+	// Inside a closed shell, whatever its orientation
+	if( d_signmode == SIGN_WINDING )
+		return std::abs(d_winding.Evaluate(pt)) >= 0.5 ? -minDistance : minDistance;
 
 	// Account for distance field sign:
-	// if this point is "above" or below" the triangle, comparing the orientation
-	// between the point and the triangle
-
-	// Find the triangle normal vector
-	GeoPoint3D edge0 = *vtxArray[(*clostri)->v1] - *vtxArray[(*clostri)->v2];
-	GeoPoint3D edge1 = *vtxArray[(*clostri)->v1] - *vtxArray[(*clostri)->v3];
-	GeoPoint3D normal = cross(edge0, edge1);
-	GeoPoint3D vecpt(pt - *vtxArray[(*clostri)->v1]);
-
-	// inner product between point and triangle normal to check if the
-	// point is above or below the triangle
-	double orientation = inner(vecpt, normal);
-	if (orientation < 0) // point is below the triangle, put negative sign
+	// if this point is "above" or below" the surface, comparing the orientation between the
+	// point and the pseudonormal of the closest feature (the closest face in SIGN_FACE mode).
+	// Any point of the feature can be used, the pseudonormal of an edge is normal to it.
+	if( d_signmode == SIGN_FACE ) minfeat = FEAT_FACE;
+	int origin = (minfeat == FEAT_V2 || minfeat == FEAT_E23) ? mintri->v2 : (minfeat == FEAT_V3 ? mintri->v3 : mintri->v1);
+	GeoPoint3D vecpt(pt - *vtxArray[origin]);
+
+	double orientation = inner(vecpt, Pseudonormal(minid, minfeat));
+	if (orientation < 0) // point is below the surface, put negative sign
 		minDistance *= -1;
 	return minDistance;
 	
@@ -649,8 +1330,9 @@ double DistCalc::Point2MeshDistance(GeoPoint3D pt, double &s, double &t, bool *i
 * @param[in] tri - triangle tri
 * @param[out] s  - s coordinate in T of the closest point from pt
 * @param[out] t  - t coordinate in T of the closest point from pt
+* @param[out] feature - closest feature of the triangle: FEAT_FACE, a vertex (FEAT_V1..3) or an edge (FEAT_E12..23)
 */ 
-double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double &s, double &t, bool *isBorder)
+double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double &s, double &t, int *feature)
 {
 	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
 
@@ -670,11 +1352,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 	double sqrDistance;
 	s = b*e - c*d;
 	t = b*d - a*e;
-	if(isBorder != NULL) *isBorder = false;
-
-	bool vtx1Border = (bool) vtxArray[tri->v1]->getProp(0);
-	bool vtx2Border = (bool) vtxArray[tri->v2]->getProp(0);
-	bool vtx3Border = (bool) vtxArray[tri->v3]->getProp(0);
+	int feat = FEAT_FACE;
 
 	if (s + t <= delta)
 	{
@@ -696,17 +1374,13 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 						{
 							s = 1;
 							sqrDistance = a + 2*d + f;
-							// Check if it is on surface border
-							if(isBorder != NULL)
-								if( vtx2Border == true) *isBorder = true;
+							feat = FEAT_V2;
 						}
 						else
 						{
 							s = -d/a;
 							sqrDistance = d*s + f;
-							// Check if it is on surface border
-							if(isBorder != NULL)
-								if(vtx1Border == true && vtx2Border == true) *isBorder = true;
+							feat = FEAT_E12;
 						}
 					}
 					else
@@ -716,25 +1390,19 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 						{
 							t = 0;
 							sqrDistance = f;
-							// Check if it is on surface border
-							if(isBorder != NULL)
-								if(vtx1Border == true) *isBorder = true;
+							feat = FEAT_V1;
 						}
 						else if (-e >= c)
 						{
 							t = 1;
 							sqrDistance = c + 2*e + f;
-							// Check if it is on surface border
-							if(isBorder != NULL)
-								if(vtx3Border == true) *isBorder = true;
+							feat = FEAT_V3;
 						}
 						else
 						{
 							t = -e/c;
 							sqrDistance = e*t + f;
-							// Check if it is on surface border
-							if(isBorder != NULL)
-								if(vtx1Border == true && vtx3Border == true) *isBorder = true;
+							feat = FEAT_E13;
 						}
 					}
 				}
@@ -752,25 +1420,19 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					{
 						t = 0;
 						sqrDistance = f;
-						// Check if it is on surface border
-						if(isBorder != NULL)
-							if(vtx1Border == true) *isBorder = true;
+						feat = FEAT_V1;
 					}
 					else if (-e >= c) // (num >= denom): T > 0, minimum at 1, closest point is the upper left vertex
 					{
 						t = 1;
 						sqrDistance = c + 2*e + f;
-						// Check if it is on surface border
-						if(isBorder != NULL)
-							if(vtx3Border == true) *isBorder = true;
+						feat = FEAT_V3;
 					}
 					else // closest point is on t edge
 					{
 						t = -e/c;
 						sqrDistance = e*t + f;
-						// Check if it is on surface border
-						if(isBorder != NULL)
-							if(vtx1Border == true && vtx3Border == true) *isBorder = true;
+						feat = FEAT_E13;
 					}
 				}
 			}
@@ -788,25 +1450,19 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 				{
 					s = 0;
 					sqrDistance = f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true) *isBorder = true;
+					feat = FEAT_V1;
 				}
 				else if (-d >= a) // (num >= denom): S > 0, minimum at 1, closest point is the lower right vertex
 				{
 					s = 1;
 					sqrDistance = a + 2*d + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true) *isBorder = true;
+					feat = FEAT_V2;
 				}
 				else
 				{
 					s = -d/a;
 					sqrDistance = d*s + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true && vtx2Border == true) *isBorder = true;
+					feat = FEAT_E12;
 				}
 			}
 			else // region 0
@@ -848,9 +1504,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					s = 1;
 					t = 0;
 					sqrDistance = a + 2*d + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true) *isBorder = true;
+					feat = FEAT_V2;
 				}
 				else
 				{
@@ -858,9 +1512,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					t = 1 - s;
 					sqrDistance = s*(a*s + b*t + 2*d) +
 					              t*(b*s + c*t + 2*e) + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true && vtx3Border == true) *isBorder = true;
+					feat = FEAT_E23;
 				}
 			}
 			else // minimum on edge s=0
@@ -870,25 +1522,19 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 				{
 					t = 1;
 					sqrDistance = c + 2*e + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx3Border == true) *isBorder = true;
+					feat = FEAT_V3;
 				}
 				else if (e >= 0)
 				{
 					t = 0;
 					sqrDistance = f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true) *isBorder = true;
+					feat = FEAT_V1;
 				}
 				else
 				{
 					t = -e/c;
 					sqrDistance = e*t + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true && vtx3Border == true) *isBorder = true;
+					feat = FEAT_E13;
 				}
 			}
 		}
@@ -909,9 +1555,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					t = 1;
 					s = 0;
 					sqrDistance = c + 2*e + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx3Border == true) *isBorder = true;
+					feat = FEAT_V3;
 				}
 				else
 				{
@@ -919,9 +1563,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					s = 1 - t;
 					sqrDistance = s*(a*s + b*t + 2*d) +
 					              t*(b*s + c*t + 2*e) + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true && vtx3Border == true) *isBorder = true;
+					feat = FEAT_E23;
 				}
 			}
 			else //minimum on edge t=0
@@ -931,25 +1573,19 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 				{
 					s = 1;
 					sqrDistance = a + 2*d + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true) *isBorder = true;
+					feat = FEAT_V2;
 				}
 				else if (d >= 0)
 				{
 					s = 0;
 					sqrDistance = f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true) *isBorder = true;
+					feat = FEAT_V1;
 				}
 				else
 				{
 					s = -d/a;
 					sqrDistance = d*s + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx1Border == true && vtx2Border == true) *isBorder = true;
+					feat = FEAT_E12;
 				}
 			}
 		}
@@ -969,9 +1605,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 				s = 0;
 				t = 1;
 				sqrDistance = c + 2*e + f;
-				// Check if it is on surface border
-				if(isBorder != NULL)
-					if(vtx3Border == true) *isBorder = true;
+				feat = FEAT_V3;
 			}
 			else
 			{
@@ -981,9 +1615,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					s = 1;
 					t = 0;
 					sqrDistance = a + 2*d + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true) *isBorder = true;
+					feat = FEAT_V2;
 				}
 				else
 				{ // closest point is on the 1-s edge
@@ -991,9 +1623,7 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 					t = 1 - s;
 					sqrDistance = s*(a*s + b*t + 2*d) +
 					t*(b*s + c*t + 2*e) + f;
-					// Check if it is on surface border
-					if(isBorder != NULL)
-						if(vtx2Border == true && vtx3Border == true) *isBorder = true;
+					feat = FEAT_E23;
 				}
 			}
 		}
@@ -1005,6 +1635,8 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 		sqrDistance = 0;
 	}
 
+	if( feature != NULL ) *feature = feat;
+
 	// return the calculate distance
 #ifndef DBGTEST
 	double distance = sqrt(sqrDistance);
@@ -1013,35 +1645,282 @@ double DistCalc::Point2TriangleDistance(GeoPoint3D pt, CsiTriangle *tri, double
 	return sqrDistance;
 }
 
+/**
+* ComputePseudonormals
+* ------------------------------------------------------------------------
+* Precomputes the angle weighted pseudonormals of every face, vertex and edge of the surface
+* (Baerentzen and Aanaes): the unit face normal, the sum of the normals of the faces around a
+* vertex weighted by their angle at it, and the sum of the normals of the faces sharing an edge.
+* The sign of a point is then given by one dot product with the pseudonormal of its closest feature,
+* also when that feature is a shared edge or vertex. Zero area faces have no normal and are left
+* out of the sums; they take the normal of their edges, and a vertex or edge whose sum is still
+* zero takes the normal of one of its faces.
+*/ 
+void DistCalc::ComputePseudonormals()
+{
+	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
+	long long ntris = (long long)d_triangles.size();
+	long long nverts = (long long)vtxArray.size();
+	long long nedges = (long long)d_adjacency.NumEdges();
+	long long i;
+
+	d_facenormals.resize(ntris);
+	d_vertexnormals.resize(nverts);
+	d_edgenormals.resize(nedges);
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (i)
+#endif
+	for(i = 0; i < ntris; ++i)
+	{
+		CsiTriangle *tri = d_triangles[i];
+		d_facenormals[i] = _Unit(cross(*vtxArray[tri->v2] - *vtxArray[tri->v1], *vtxArray[tri->v3] - *vtxArray[tri->v1]), GeoPoint3D(0,0,0));
+	}
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (i)
+#endif
+	for(i = 0; i < nedges; ++i)
+	{
+		GeoPoint3D normal(0,0,0);
+		const unsigned int *tris = d_adjacency.EdgeTriangles((unsigned int)i);
+		for(unsigned int n = 0; n < d_adjacency.NumEdgeTriangles((unsigned int)i); ++n)
+			normal += d_facenormals[tris[n]];
+		d_edgenormals[i] = _Unit(normal, GeoPoint3D(0,0,0));
+	}
+
+	// Zero area faces take the normal of their edges, then the edges left without one that of a face
+	for(i = 0; i < ntris; ++i)
+	{
+		if( inner(d_facenormals[i], d_facenormals[i]) > 0 ) continue;
+		GeoPoint3D normal(0,0,0);
+		for(int e = 0; e < 3; ++e)
+		{
+			unsigned int edge = d_adjacency.Edge((unsigned int)i, e);
+			if( edge != NO_EDGE ) normal += d_edgenormals[edge];
+		}
+		d_facenormals[i] = _Unit(normal, GeoPoint3D(0,0,0));
+	}
+	for(i = 0; i < nedges; ++i)
+	{
+		if( inner(d_edgenormals[i], d_edgenormals[i]) > 0 || d_adjacency.NumEdgeTriangles((unsigned int)i) == 0 ) continue;
+		d_edgenormals[i] = d_facenormals[d_adjacency.EdgeTriangles((unsigned int)i)[0]];
+	}
+
+	// Each vertex gathers the faces around it, in triangle order
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1024) private (i)
+#endif
+	for(i = 0; i < nverts; ++i)
+	{
+		GeoPoint3D normal(0,0,0), fallback(0,0,0);
+		const unsigned int *tris = d_adjacency.VertexTriangles((int)i);
+		for(unsigned int n = 0; n < d_adjacency.NumVertexTriangles((int)i); ++n)
+		{
+			if( n == 0 ) fallback = d_facenormals[tris[n]];
+			int v[3] = { d_triangles[tris[n]]->v1, d_triangles[tris[n]]->v2, d_triangles[tris[n]]->v3 };
+			for(int c = 0; c < 3; ++c)
+			{
+				if( v[c] != i ) continue;
+				GeoPoint3D e0 = *vtxArray[v[(c+1)%3]] - *vtxArray[v[c]];
+				GeoPoint3D e1 = *vtxArray[v[(c+2)%3]] - *vtxArray[v[c]];
+				GeoPoint3D w = cross(e0, e1);
+				if( inner(w, w) == 0 ) continue; // no area, and no angle either
+				double angle = atan2(sqrt(inner(w, w)), inner(e0, e1));
+				normal += angle*d_facenormals[tris[n]];
+			}
+		}
+		d_vertexnormals[i] = _Unit(normal, fallback);
+	}
+}
+
+/**
+* SetSignMode
+* ------------------------------------------------------------------------
+* Selects how the sign of the distance field is decided
+* @param[in] mode - SIGN_PSEUDONORMAL (default), SIGN_FACE or SIGN_WINDING; the dipole expansion
+* of the winding number is built on the first selection of SIGN_WINDING
+*/ 
+void DistCalc::SetSignMode(int mode)
+{
+	d_signmode = mode;
+	if( mode == SIGN_WINDING && d_winding.Empty() )
+		d_winding.Build(d_bvh, d_surf, d_triangles);
+}
+
+/**
+* MergeSurfaces
+* ------------------------------------------------------------------------
+* Copies several surfaces into a single mesh whose triangles are labelled with the position of
+* their surface in the list, so that a single Grid2Mesh gives the distance to the nearest surface
+* of every grid point and, in the label channel, which one it is
+* @param[in] surfs - surfaces, at most 65536
+* @param[out] labels - label of each triangle of the merged mesh, for SetTriangleLabels
+* @return - merged mesh
+*/ 
+CsiTSurf* DistCalc::MergeSurfaces(const std::vector<CsiTSurf*> &surfs, std::vector<unsigned short> &labels)
+{
+	CsiTSurf *merged = new CsiTSurf("merged");
+	labels.clear();
+	for(size_t l = 0; l < surfs.size(); ++l)
+	{
+		CsiTSurfVertexArray &vtxArray = surfs[l]->vertexArray();
+		CsiTriangleList &triangles = surfs[l]->trianglesList();
+		int base = merged->vertexArray().size();
+		for(int v = 0; v < vtxArray.size(); ++v)
+			merged->addVertex(vtxArray[v]->x, vtxArray[v]->y, vtxArray[v]->z, 1);
+		for(CsiTriangleItr itr = triangles.begin(); itr != triangles.end(); ++itr)
+		{
+			merged->addTriangle(base + itr->v1, base + itr->v2, base + itr->v3);
+			labels.push_back((unsigned short)l);
+		}
+	}
+	return merged;
+}
+
+/**
+* Pseudonormal
+* ------------------------------------------------------------------------
+* Returns the pseudonormal of a feature of a triangle
+* @param[in] triId - triangle id
+* @param[in] feat - feature of the triangle, see Point2TriangleDistance
+*/ 
+GeoPoint3D DistCalc::Pseudonormal(unsigned int triId, int feat) const
+{
+	CsiTriangle *tri = d_triangles[triId];
+	switch( feat )
+	{
+		case FEAT_V1: return d_vertexnormals[tri->v1];
+		case FEAT_V2: return d_vertexnormals[tri->v2];
+		case FEAT_V3: return d_vertexnormals[tri->v3];
+		case FEAT_E12: case FEAT_E13: case FEAT_E23:
+		{
+			unsigned int edge = d_adjacency.Edge(triId, feat - FEAT_E12);
+			return edge == NO_EDGE ? d_facenormals[triId] : d_edgenormals[edge];
+		}
+	}
+	return d_facenormals[triId];
+}
+
 /**
 * AssignVtx2Cell
 * ------------------------------------------------------------------------
-* Sets the object's surcells vector, which contains every point pertaining to the
-* grid cell's center
+* Resets the map of active cells to their regenerated vertices. Cell centers are not stored,
+* see CellCenter; only the cells crossed by the surface get an entry, filled by SurfaceNets.
 */ 
 void DistCalc::AssignVtx2Cell()
 {
-	if( d_voxels.size() == 0 ) return;
+	d_activecells.clear();
+	d_cellvertices.clear();
+}
 
-	// loop variables
-	int i;
-	unsigned int j, k;
+/**
+* ClosestFeature
+* ------------------------------------------------------------------------
+* Reads the closest feature channel: closest triangle of a grid point and the (s,t) coordinates
+* of its closest point, T(s,t) = v1 + s(v2-v1) + t(v3-v1). Requires HasClosestFeatures.
+* @param[in] idx - grid point index
+* @param[out] triId - closest triangle id, see Triangle
+* @param[out] s, t - closest point coordinates in the triangle
+*/ 
+void DistCalc::ClosestFeature(size_t idx, unsigned int &triId, double &s, double &t) const
+{
+	triId = d_clostris[idx];
+	UnpackST(d_closest[idx], s, t);
+}
 
-	unsigned int idx;
-	d_surfcells.resize((d_nx)*(d_ny)*(d_nz));
+/**
+* ClosestPoint
+* ------------------------------------------------------------------------
+* Closest point on the surface of a grid point, from the closest feature channel, without
+* any mesh query
+* @param[in] idx - grid point index
+* @param[out] point - closest point
+* @return - false if the channel is not computed, or the grid point or its triangle is out of range
+*/ 
+bool DistCalc::ClosestPoint(size_t idx, GeoPoint3D &point)
+{
+	if( !HasClosestFeatures() || idx >= d_clostris.size() ) return false;
+
+	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
+	unsigned int triId;
+	double s, t;
+	ClosestFeature(idx, triId, s, t);
+	if( triId >= d_triangles.size() ) return false;
+
+	CsiTriangle *tri = d_triangles[triId];
+	GeoPoint3D edge0(*vtxArray[tri->v2] - *vtxArray[tri->v1]);
+	GeoPoint3D edge1(*vtxArray[tri->v3] - *vtxArray[tri->v1]);
+	point = *vtxArray[tri->v1] + s*edge0 + t*edge1;
+	return true;
+}
+
+/**
+* CellVertex
+* ------------------------------------------------------------------------
+* Returns the regenerated vertex of a cell, NULL if the cell is not active
+* @param[in] idxC - cell index
+*/ 
+CsiTSurfVertex* DistCalc::CellVertex(size_t idxC) const
+{
+	std::vector<size_t>::const_iterator it = std::lower_bound(d_activecells.begin(), d_activecells.end(), idxC);
+	if( it == d_activecells.end() || *it != idxC || d_cellvertices.empty() ) return NULL;
+	return d_cellvertices[it - d_activecells.begin()];
+}
+
+/**
+* ComputeGradientPlanes
+* ------------------------------------------------------------------------
+* Calculates the finite difference gradient of the unsigned distance field on a range of grid planes,
+* in parallel. Rows are contiguous in x; the one sided differences of the boundary are chosen once per
+* row in y and z and peeled off the row ends in x, so the loop along a row is plain central differences.
+* The octahedral codes keep the direction only, so every gradient is read back as a unit vector, or
+* zero where the differences cancel.
+* @param[in] k0, k1 - planes [k0, k1) of the grid
+* @param[out] gradients - receives the planes, sized by the caller
+* @param[in] first - grid point index of the first element of gradients
+*/ 
+void DistCalc::ComputeGradientPlanes(unsigned int k0, unsigned int k1, DistGradients &gradients, size_t first)
+{
+	size_t rowsize = (size_t)d_nx+1;
+	size_t planesize = rowsize*(d_ny+1);
+	double inv1 = 1/d_size, inv2 = 1/(2*d_size);
+	int k;
 
-	for(i = 0; i < d_nx; ++i)
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (k)
+#endif
+	for(k = (int)k0; k < (int)k1; ++k)
 	{
-		for(j = 0; j < d_ny; ++j)
+		// df/dz = ( f(z+delta) - f(z-delta) ) / 2*delta, one sided at the grid boundary
+		unsigned int kp = std::min((unsigned int)k+1, d_nz), km = k > 0 ? k-1 : 0;
+		double sz = (kp - km == 2) ? inv2 : inv1;
+		std::vector<GeoPoint3D> g(rowsize);
+
+		for(unsigned int j = 0; j <= d_ny; ++j)
 		{
-			for(k = 0; k < d_nz; ++k)
+			unsigned int jp = std::min(j+1, d_ny), jm = j > 0 ? j-1 : 0;
+			double sy = (jp - jm == 2) ? inv2 : inv1;
+
+			size_t row = planesize*k + rowsize*j;
+			const double *v = &d_voxels[row];
+			const double *vyp = &d_voxels[planesize*k + rowsize*jp];
+			const double *vym = &d_voxels[planesize*k + rowsize*jm];
+			const double *vzp = &d_voxels[planesize*kp + rowsize*j];
+			const double *vzm = &d_voxels[planesize*km + rowsize*j];
+
+			// df/dx, one sided at the row ends
+			g[0].x = d_nx > 0 ? (std::abs(v[1]) - std::abs(v[0]))*inv1 : 0;
+			for(int i = 1; i < d_nx; ++i)
+				g[i].x = (std::abs(v[i+1]) - std::abs(v[i-1]))*inv2;
+			if( d_nx > 0 ) g[d_nx].x = (std::abs(v[d_nx]) - std::abs(v[d_nx-1]))*inv1;
+
+			for(int i = 0; i <= d_nx; ++i)
 			{
-				GeoPoint3D point(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
-				idx = (d_nx)*(d_ny)*k + (d_nx)*j +i;
-				GeoPoint3D cellcenter(point.x + d_size/2, point.y + d_size/2, point.z + d_size/2);
-				d_surfcells[idx].first = cellcenter;
-				d_surfcells[idx].second = NULL; 
+				g[i].y = (std::abs(vyp[i]) - std::abs(vym[i]))*sy;
+				g[i].z = (std::abs(vzp[i]) - std::abs(vzm[i]))*sz;
 			}
+			gradients.Encode(row - first, &g[0], rowsize);
 		}
 	}
 }
@@ -1050,223 +1929,497 @@ void DistCalc::AssignVtx2Cell()
 * CalculateGradients
 * ------------------------------------------------------------------------
 * Sets the object's gradients vector, which contains the distance field gradient
-* for each voxel (uses finite difference)
+* direction for each voxel (uses finite difference)
 */ 
 void DistCalc::CalculateGradients()
 {
 	if( d_voxels.size() == 0 ) return;
 
-	// loop variables
-	int i;
-	unsigned int j, k;
+	std::lock_guard<std::mutex> lock(d_gradmutex);
+	d_gradbricks.clear();
+	d_gradients.resize(d_voxels.size());
+	ComputeGradientPlanes(0, d_nz+1, d_gradients, 0);
+}
 
-	unsigned int idx;
-	unsigned int idxFrontDownRight; 
-	unsigned int idxBackDownLeft; 
-	unsigned int idxFrontUpLeft; 
+/**
+* DropGradients
+* ------------------------------------------------------------------------
+* Releases the gradients vector; gradients are calculated again by finite difference, one brick of
+* planes at a time, when EnsureGradients first needs them
+*/ 
+void DistCalc::DropGradients()
+{
+	std::lock_guard<std::mutex> lock(d_gradmutex);
+	d_gradients.clear();
+	d_gradbricks.assign((d_nz+1 + GRAD_BRICK-1)/GRAD_BRICK, DistGradients(d_gradients.Bits()));
+}
+
+/**
+* EnsureGradients
+* ------------------------------------------------------------------------
+* Makes sure the gradients of a range of planes are available through Gradient, calculating the
+* missing bricks when they were dropped. Asked for the whole grid, it gathers the bricks back into
+* d_gradients, one at a time. Thread safe, but a gathering call must not run while others read
+* the bricks.
+* @param[in] k0, k1 - planes [k0, k1) of the grid, by default the whole grid
+*/ 
+void DistCalc::EnsureGradients(unsigned int k0, unsigned int k1)
+{
+	std::lock_guard<std::mutex> lock(d_gradmutex);
+	if( d_gradbricks.empty() || d_voxels.size() == 0 ) return;
+
+	size_t planesize = (size_t)(d_nx+1)*(d_ny+1);
+	bool gather = k0 == 0 && k1 >= d_nz+1;
+	k1 = std::min(k1, d_nz+1);
+	if( gather ) d_gradients.resize(d_voxels.size());
+
+	for(unsigned int b = k0/GRAD_BRICK; b*GRAD_BRICK < k1; ++b)
+	{
+		DistGradients &brick = d_gradbricks[b];
+		unsigned int b0 = b*GRAD_BRICK, b1 = std::min(b0 + GRAD_BRICK, d_nz+1);
+		if( gather )
+		{
+			if( brick.size() == 0 ) ComputeGradientPlanes(b0, b1, d_gradients, 0);
+			else memcpy((char*)d_gradients.Codes() + planesize*b0*brick.CodeSize(), brick.Codes(), brick.size()*brick.CodeSize());
+			brick = DistGradients(d_gradients.Bits());
+			continue;
+		}
+		if( brick.size() > 0 ) continue;
+		brick = DistGradients(d_gradients.Bits());
+		brick.resize(planesize*(b1 - b0));
+		ComputeGradientPlanes(b0, b1, brick, planesize*b0);
+	}
+
+	if( gather ) d_gradbricks.clear();
+}
 
-	d_gradients.resize((d_nx+1)*(d_ny+1)*(d_nz+1));
+/**
+* ReleaseGradients
+* ------------------------------------------------------------------------
+* Frees the dropped gradient bricks lying entirely in a range of planes, once a consumer has moved
+* past them; they are computed again if needed. Does nothing when the gradients are resident.
+* @param[in] k0, k1 - planes [k0, k1) of the grid
+*/ 
+void DistCalc::ReleaseGradients(unsigned int k0, unsigned int k1)
+{
+	std::lock_guard<std::mutex> lock(d_gradmutex);
+	if( d_gradbricks.empty() ) return;
 
-	double dx, dy, dz;
+	k1 = std::min(k1, d_nz+1);
+	for(unsigned int b = (k0 + GRAD_BRICK-1)/GRAD_BRICK; b < d_gradbricks.size(); ++b)
+	{
+		unsigned int b1 = std::min((b+1)*GRAD_BRICK, d_nz+1);
+		if( b1 > k1 ) break;
+		d_gradbricks[b] = DistGradients(d_gradients.Bits());
+	}
+}
 
-	unsigned int idxExtDown;
-	unsigned int idxExtDownLeft;
-	unsigned int idxExtDownFront;
+/**
+* SetGradientBits
+* ------------------------------------------------------------------------
+* Changes the size of the gradient codes, re-encoding the resident gradients and bricks
+* @param[in] bits - 32, or 16 for previews
+*/ 
+void DistCalc::SetGradientBits(int bits)
+{
+	std::lock_guard<std::mutex> lock(d_gradmutex);
+	d_gradients.SetBits(bits);
+	for(size_t b = 0; b < d_gradbricks.size(); ++b)
+		d_gradbricks[b].SetBits(bits);
+}
 
-	for(i = 0; i <= d_nx; ++i)
+/**
+* NetTopology
+* ------------------------------------------------------------------------
+* Finds the connectivity of the surface regenerated by SurfaceNets. Every cell crossed by the
+* surface, or referenced by a neighbour's triangle, gets exactly one vertex. Nothing is allocated per
+* cell of the grid: the planes are classified in parallel into lists of triangles given by their
+* cell indices, the active cells are the sorted set of the referenced cells and the vertices are
+* numbered by binary search in it.
+* @param[out] cells - active cells, in grid order; the vertex of a cell is its position in this list
+* @param[out] tris - triangles, three vertex numbers each
+*/ 
+void DistCalc::NetTopology(std::vector<size_t> &cells, std::vector<unsigned int> &tris)
+{
+	size_t planecells = (size_t)d_nx*d_ny;
+	std::vector< std::vector<size_t> > planetris(d_nz); // cells of the triangles of each plane
+	std::vector<size_t> planefirst(d_nz+1, 0);
+	int k;
+
+	// Offsets of a cell, in the cell grid, and of its corners, in the voxel grid
+	long long celloff[3] = { 1, (long long)d_nx, (long long)planecells };
+	long long voxoff[3] = { 1, (long long)d_nx+1, (long long)(d_nx+1)*(d_ny+1) };
+
+	// Classify cells and list their triangles, a brick of planes at a time, so that only the
+	// gradients of the planes being classified must be present
+	Grad_Reader gradients;
+	gradients.obj = this;
+	for(unsigned int k0 = 0; k0 < d_nz; k0 += GRAD_BRICK)
 	{
-		for(j = 0; j <= d_ny; ++j)
+		int k1 = (int)std::min(k0 + GRAD_BRICK, d_nz);
+		EnsureGradients(k0, k1+1);
+#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (k)
+#endif
+		for(k = (int)k0; k < k1; ++k)
 		{
-			for(k = 0; k <= d_nz; ++k)
+			std::vector<size_t> &plane = planetris[k];
+			for(unsigned int j = 0; j < d_ny; ++j)
 			{
-				idx = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +i;
-				idxFrontDownRight = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +(i+1);
-				idxBackDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j+1) +i;
-				idxFrontUpLeft = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*j +i;
-				idxExtDown = (d_nx+1)*(d_ny+1)*(k-1) + (d_nx+1)*j +i;
-				idxExtDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +(i-1);
-				idxExtDownFront = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j-1) +i;
-
-				// df/dx = ( f(x+delta) - f(x-delta) ) / 2*delta
-				if(i == 0)
-					dx = (std::abs(d_voxels[idx+1]) - std::abs(d_voxels[idx]))/d_size;
-				else if(i == d_nx)
-					dx = (std::abs(d_voxels[idx]) - std::abs(d_voxels[idx-1]))/d_size;
-				else
-					dx = (std::abs(d_voxels[idxFrontDownRight]) - std::abs(d_voxels[idxExtDownLeft]))/(2*d_size);
+				for(int i = 0; i < d_nx; ++i)
+				{
+					size_t idxC = planecells*k + (size_t)d_nx*j + i;
+					size_t idxV = voxoff[2]*k + voxoff[1]*j + i;
+					int pos[3] = { i, (int)j, k };
+					int dims[3] = { d_nx, (int)d_ny, (int)d_nz };
+					unsigned char mask = _NetCellMask(gradients, idxV, voxoff, pos, dims);
 
-				if(j == 0)
-					dy = (std::abs(d_voxels[idxBackDownLeft]) - std::abs(d_voxels[idx]))/d_size;
-				else if(j == d_ny)
-					dy = (std::abs(d_voxels[idx]) - std::abs(d_voxels[idxExtDownFront]))/d_size;
-				else
-					dy = (std::abs(d_voxels[idxBackDownLeft]) - std::abs(d_voxels[idxExtDownFront]))/(2*d_size);
+					for(int e = 0; e < 6; ++e)
+					{
+						if( ((mask >> e) & 1) == 0 ) continue;
 
-				if(k == 0)
-					dz = (std::abs(d_voxels[idxFrontUpLeft]) - std::abs(d_voxels[idx]))/d_size;
-				else if(k == d_nz)
-					dz = (std::abs(d_voxels[idx]) - std::abs(d_voxels[idxExtDown]))/d_size;
-				else
-					dz = (std::abs(d_voxels[idxFrontUpLeft]) - std::abs(d_voxels[idxExtDown]))/(2*d_size);
+						size_t idxN[2] = { idxC, idxC };
+						for(int n = 0; n < 2; ++n)
+							for(int a = 0; a < 3; ++a)
+								idxN[n] += s_netNeighbors[e][n][a]*celloff[a];
 
-				d_gradients[idx] = GeoPoint3D(dx, dy, dz);
+						plane.push_back(idxC);
+						plane.push_back(idxN[0]);
+						plane.push_back(idxN[1]);
+					}
+				}
 			}
 		}
+		ReleaseGradients(0, k1+1);
 	}
-}
 
+	// First triangle of each plane
+	for(k = 0; k < (int)d_nz; ++k)
+		planefirst[k+1] = planefirst[k] + planetris[k].size();
+
+	// Active cells: every cell referenced by a triangle
+	cells.resize(planefirst[d_nz]);
+	for(k = 0; k < (int)d_nz; ++k)
+		if( !planetris[k].empty() )
+			std::copy(planetris[k].begin(), planetris[k].end(), cells.begin() + planefirst[k]);
+	std::sort(cells.begin(), cells.end());
+	cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+	std::vector<size_t>(cells).swap(cells);
+
+	// Number the triangle vertices
+	tris.resize(planefirst[d_nz]);
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (k)
+#endif
+	for(k = 0; k < (int)d_nz; ++k)
+	{
+		std::vector<size_t> &plane = planetris[k];
+		for(size_t t = 0; t < plane.size(); ++t)
+			tris[planefirst[k] + t] = (unsigned int)(std::lower_bound(cells.begin(), cells.end(), plane[t]) - cells.begin());
+		std::vector<size_t>().swap(plane);
+	}
+}
 
 /**
 * SurfaceNets
 * ------------------------------------------------------------------------
 * Reconstructs the original surface, using the data obtained from the distance field calculuation 
+* @param[in] relaxIter - maximum number of relaxation iterations, see RelaxSurfVertices
+* @param[in] relaxTol - relaxation stops when no vertex moves more than this distance
 */ 
-CsiTSurf* DistCalc::SurfaceNets()
+CsiTSurf* DistCalc::SurfaceNets(unsigned int relaxIter, double relaxTol)
 {
 	// Mark cells for surface generation
-	//CalculateGradients(); Not being used
 	AssignVtx2Cell();
 
-	// Generate new Surface from cell vertexes
+	double ctimeBegin = omp_get_wtime();
+
+	// Find which cells get a vertex and how they are connected
+	std::vector<size_t> &cells = d_activecells;
+	std::vector<unsigned int> tris;
+	NetTopology(cells, tris);
+
+	// Generate new Surface from cell vertexes, each one created once at its cell center
 	CsiTSurf *newsurf = new CsiTSurf(d_surf->name() + "_NET");
+	std::vector<CsiTSurfVertex*> &vertices = d_cellvertices;
+	vertices.resize(cells.size());
+	for(size_t v = 0; v < cells.size(); ++v)
+		vertices[v] = _AddVertexIntoSurf(newsurf, CellCenter(cells[v]));
+	for(size_t t = 0; t < tris.size(); t += 3)
+		newsurf->addTriangle(vertices[tris[t]]->pos, vertices[tris[t+1]]->pos, vertices[tris[t+2]]->pos);
 
-	// loop variables
-	int i;
-	unsigned int j, k;
-	unsigned int idxC;
-	unsigned int idxFrontDownLeft; 
-	unsigned int idxFrontDownRight; 
-	unsigned int idxBackDownLeft; 
-	unsigned int idxFrontUpLeft; 
-	unsigned int idxBackDownRight; 
-	unsigned int idxFrontUpRight; 
-	unsigned int idxBackUpLeft; 
-	unsigned int idxBackUpRight; 
-
-	unsigned int idxExtDownC; 
-	unsigned int idxExtUpC; 
-	unsigned int idxExtFrontC; 
-	unsigned int idxExtBackC; 
-	unsigned int idxExtRightC; 
-	unsigned int idxExtLeftC; 
-
-	GeoPoint3D cellcenter;
-
-	for(i = 0; i < d_nx ; ++i)
+	cerr << "Number of triangles: "<< newsurf->trianglesList().size() << endl;
+	cerr << "Number of vertices: "<< newsurf->vertexArray().size() << endl;
+
+	// Sanity check: one vertex at the center of each active cell
+	CheckVertexPositions(newsurf);
+	
+	RelaxSurfVertices(relaxIter, relaxTol);
+
+	double ctimeEnd = omp_get_wtime();
+	cerr << "Surface regeneration time: "<< ctimeEnd - ctimeBegin << endl;
+	return newsurf;
+}
+
+/**
+* DualContouring
+* ------------------------------------------------------------------------
+* Reconstructs the original surface with the SurfaceNets connectivity, but places the vertex of
+* each cell at the minimizer of a QEF built from the closest points and directions stored by
+* Grid2Mesh (Hermite data). Sharp creases and border edges are kept even on coarse grids.
+* @param[in] lambda - weight pulling each vertex towards the mass point of its closest points
+*/ 
+CsiTSurf* DistCalc::DualContouring(double lambda)
+{
+	if( d_voxels.size() == 0 ) return NULL;
+
+	double ctimeBegin = omp_get_wtime();
+
+	std::vector<size_t> cells;
+	std::vector<unsigned int> tris;
+	NetTopology(cells, tris);
+
+	// Solve the QEF of every active cell, a brick of planes at a time
+	size_t planecells = (size_t)d_nx*d_ny;
+	size_t planesize = (size_t)(d_nx+1)*(d_ny+1);
+	std::vector<GeoPoint3D> positions(cells.size());
+	long long v, v0, v1;
+	for(unsigned int k0 = 0; k0 < d_nz; k0 += GRAD_BRICK)
 	{
-		for(j = 0; j < d_ny ; ++j)
+		_BrickCells(cells, planecells, k0, d_nz, v0, v1);
+		if( v0 < v1 ) EnsureGradients(k0, k0 + GRAD_BRICK+1);
+#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 256) private (v)
+#endif
+		for(v = v0; v < v1; ++v)
 		{
-			for(k = 0; k < d_nz ; ++k)
+			unsigned int k = (unsigned int)(cells[v] / planecells);
+			unsigned int j = (unsigned int)((cells[v] % planecells) / d_nx);
+			int i = (int)(cells[v] % d_nx);
+			GeoPoint3D cellmin(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
+
+			GeoPoint3D q[8], n[8];
+			int cnt = 0;
+			for(int c = 0; c < 8; ++c)
 			{
-				idxC = (d_nx)*(d_ny)*k + (d_nx)*j +i;
-				idxFrontDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +i;
-				idxFrontDownRight = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*j +(i+1);
-				idxBackDownLeft = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j+1) +i;
-				idxFrontUpLeft = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*j +i;
-				idxBackDownRight = (d_nx+1)*(d_ny+1)*k + (d_nx+1)*(j+1) +(i+1);
-				idxFrontUpRight = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*j +(i+1);
-				idxBackUpLeft = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*(j+1) +i;
-				idxBackUpRight = (d_nx+1)*(d_ny+1)*(k+1) + (d_nx+1)*(j+1) +(i+1);
-
-				idxExtDownC = (d_nx)*(d_ny)*(k-1) + (d_nx)*j +i;
-				idxExtUpC = (d_nx)*(d_ny)*(k+1) + (d_nx)*j +i;
-				idxExtFrontC = (d_nx)*(d_ny)*k + (d_nx)*(j-1) +i;
-				idxExtBackC = (d_nx)*(d_ny)*k + (d_nx)*(j+1) +i;
-				idxExtRightC = (d_nx)*(d_ny)*k + (d_nx)*j +(i+1);
-				idxExtLeftC = (d_nx)*(d_ny)*k + (d_nx)*j +(i-1);
-
-				cellcenter = d_surfcells[idxC].first;
-	/* --------------------------------
-	EdgeFace table:
-	   edge       face1 face2
-	   ---------- ----- -----
-	   up-right     up  right
-	   down-left   down left
-	   up-front     up  front
-	   down-back   down back
-	   front-right front right 
-	   back-left   back left
-	---------------------------------*/
-				// Create triangles 
-				if ( inner(d_gradients[idxFrontUpRight], d_gradients[idxBackUpRight]) < 0 ) // up-right
-				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
+				int di = c & 1, dj = (c >> 1) & 1, dk = (c >> 2) & 1;
+				size_t idx = planesize*(k+dk) + (size_t)(d_nx+1)*(j+dj) + (i+di);
+				GeoPoint3D g = Gradient(idx);
 
-					d_surfcells[idxExtUpC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtUpC].first);
+				// A corner lying on the surface has no direction
+				if( !(inner(g, g) > 0.5) ) continue;
 
-					d_surfcells[idxExtRightC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtRightC].first);
+				GeoPoint3D corner(cellmin.x + di*d_size, cellmin.y + dj*d_size, cellmin.z + dk*d_size);
+				q[cnt] = corner - std::abs(d_voxels[idx]) * g;
+				n[cnt] = g;
+				cnt++;
+			}
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtUpC].second->pos, d_surfcells[idxExtRightC].second->pos);
-				}
-				if ( inner(d_gradients[idxFrontDownLeft], d_gradients[idxBackDownLeft]) < 0 ) // down-left
+			GeoPoint3D pos(cellmin.x + d_size/2, cellmin.y + d_size/2, cellmin.z + d_size/2);
+			if( cnt > 0 )
+			{
+				// Solve in cell units, so that lambda does not depend on the grid spacing
+				for(int c = 0; c < cnt; ++c)
 				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
-
-					d_surfcells[idxExtDownC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtDownC].first);
+					q[c] = q[c] - cellmin;
+					q[c].x /= d_size;
+					q[c].y /= d_size;
+					q[c].z /= d_size;
+				}
+				GeoPoint3D x = _CellVertexQEF(q, n, cnt, lambda);
+				pos.x = cellmin.x + std::min(std::max(x.x, 0.0), 1.0)*d_size;
+				pos.y = cellmin.y + std::min(std::max(x.y, 0.0), 1.0)*d_size;
+				pos.z = cellmin.z + std::min(std::max(x.z, 0.0), 1.0)*d_size;
+			}
+			positions[v] = pos;
+		}
+		ReleaseGradients(0, k0 + GRAD_BRICK+1);
+	}
 
-					d_surfcells[idxExtLeftC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtLeftC].first);
+	// Generate new Surface
+	CsiTSurf *newsurf = new CsiTSurf(d_surf->name() + "_DC");
+	std::vector<CsiTSurfVertex*> vertices(cells.size());
+	for(size_t c = 0; c < cells.size(); ++c)
+		vertices[c] = _AddVertexIntoSurf(newsurf, positions[c]);
+	for(size_t t = 0; t < tris.size(); t += 3)
+		newsurf->addTriangle(vertices[tris[t]]->pos, vertices[tris[t+1]]->pos, vertices[tris[t+2]]->pos);
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtDownC].second->pos, d_surfcells[idxExtLeftC].second->pos);
-				}
-				if ( inner(d_gradients[idxFrontUpLeft], d_gradients[idxFrontUpRight]) < 0 ) // up-front
-				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
+	cerr << "Number of triangles: "<< newsurf->trianglesList().size() << endl;
+	cerr << "Number of vertices: "<< newsurf->vertexArray().size() << endl;
 
-					d_surfcells[idxExtUpC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtUpC].first);
+	double ctimeEnd = omp_get_wtime();
+	cerr << "Dual contouring time: "<< ctimeEnd - ctimeBegin << endl;
+	return newsurf;
+}
 
-					d_surfcells[idxExtFrontC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtFrontC].first);
+/**
+* OffsetSurfaces
+* ------------------------------------------------------------------------
+* Extracts the surfaces at the given signed distances from the original surface (SurfaceNets on
+* the field minus each iso-value), all in one parallel sweep over the grid. Every cell is classified
+* once against the sorted iso-values. Cells whose corners all have their closest point on the
+* surface border are skipped, so offsets do not wrap around the open edges of a horizon.
+* @param[in] isovalues - signed distances of the wanted surfaces, positive above the surface
+* @param[in] clipMin, clipMax - optional box, only cells with their center inside it are extracted
+* @return - one surface per iso-value, in the given order, each a separate object owned by the caller
+*/ 
+std::vector<CsiTSurf*> DistCalc::OffsetSurfaces(const std::vector<double> &isovalues, const GeoPoint3D *clipMin, const GeoPoint3D *clipMax)
+{
+	std::vector<CsiTSurf*> surfaces;
+	if( d_voxels.size() == 0 || isovalues.empty() ) return surfaces;
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtUpC].second->pos, d_surfcells[idxExtFrontC].second->pos);
-				}
-				if ( inner(d_gradients[idxBackDownLeft], d_gradients[idxBackDownRight]) < 0 ) // down-back
-				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
+	double ctimeBegin = omp_get_wtime();
 
-					d_surfcells[idxExtDownC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtDownC].first);
+	std::vector<double> isos(isovalues);
+	std::sort(isos.begin(), isos.end());
+	isos.erase(std::unique(isos.begin(), isos.end()), isos.end());
+	size_t nisos = isos.size();
 
-					d_surfcells[idxExtBackC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtBackC].first);
+	size_t planecells = (size_t)d_nx*d_ny;
+	long long voxoff[3] = { 1, (long long)d_nx+1, (long long)(d_nx+1)*(d_ny+1) };
+	long long celloff[3] = { 1, (long long)d_nx, (long long)planecells };
+	int k;
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtDownC].second->pos, d_surfcells[idxExtBackC].second->pos);
+	// Classify cells: vertices of every iso-value, per grid plane, in cell order
+	std::vector< std::vector< std::vector<Net_Vertex> > > planeverts(d_nz, std::vector< std::vector<Net_Vertex> >(nisos));
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (k)
+#endif
+	for(k = 0; k < (int)d_nz; ++k)
+	{
+		for(unsigned int j = 0; j < d_ny; ++j)
+		{
+			for(int i = 0; i < d_nx; ++i)
+			{
+				GeoPoint3D cellmin(d_min.x + i*d_size, d_min.y + j*d_size, d_min.z + k*d_size);
+				if( clipMin != NULL && (cellmin.x + d_size/2 < clipMin->x || cellmin.y + d_size/2 < clipMin->y || cellmin.z + d_size/2 < clipMin->z) )
+					continue;
+				if( clipMax != NULL && (cellmin.x + d_size/2 > clipMax->x || cellmin.y + d_size/2 > clipMax->y || cellmin.z + d_size/2 > clipMax->z) )
+					continue;
+
+				size_t idxV = voxoff[2]*k + voxoff[1]*j + i;
+				double val[8];
+				bool allborder = true;
+				double lo = std::numeric_limits<double>::max(), hi = -std::numeric_limits<double>::max();
+				for(int c = 0; c < 8; ++c)
+				{
+					size_t idx = idxV + (c & 1)*voxoff[0] + ((c >> 1) & 1)*voxoff[1] + ((c >> 2) & 1)*voxoff[2];
+					val[c] = d_voxels[idx];
+					allborder = allborder && d_borders[idx];
+					lo = std::min(lo, val[c]);
+					hi = std::max(hi, val[c]);
 				}
-				if ( inner(d_gradients[idxFrontUpRight], d_gradients[idxFrontDownRight]) < 0 ) // front-right
+				if( allborder ) continue;
+
+				// Iso-values crossing the cell: lo < iso <= hi
+				for(size_t s = std::upper_bound(isos.begin(), isos.end(), lo) - isos.begin(); s < nisos && isos[s] <= hi; ++s)
 				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
+					// Vertex at the mean of the iso crossings along the cell edges
+					GeoPoint3D pos(0,0,0);
+					int cnt = 0;
+					for(int c = 0; c < 8; ++c)
+					{
+						for(int a = 0; a < 3; ++a)
+						{
+							int o = c | (1 << a);
+							if( o == c || (val[c] < isos[s]) == (val[o] < isos[s]) ) continue;
+
+							double t = (isos[s] - val[c]) / (val[o] - val[c]);
+							pos.x += (c & 1) + t*((o & 1) - (c & 1));
+							pos.y += ((c >> 1) & 1) + t*(((o >> 1) & 1) - ((c >> 1) & 1));
+							pos.z += ((c >> 2) & 1) + t*(((o >> 2) & 1) - ((c >> 2) & 1));
+							cnt++;
+						}
+					}
 
-					d_surfcells[idxExtFrontC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtFrontC].first);
+					Net_Vertex vtx;
+					vtx.cell = planecells*k + (size_t)d_nx*j + i;
+					vtx.pos = GeoPoint3D(cellmin.x + pos.x/cnt*d_size, cellmin.y + pos.y/cnt*d_size, cellmin.z + pos.z/cnt*d_size);
+					planeverts[k][s].push_back(vtx);
+				}
+			}
+		}
+	}
 
-					d_surfcells[idxExtRightC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtRightC].first);
+	std::vector<CsiTSurf*> sorted(nisos);
+	for(size_t s = 0; s < nisos; ++s)
+	{
+		// Active cells of this iso-value, sorted, since planes are concatenated in order
+		std::vector<size_t> cells;
+		for(k = 0; k < (int)d_nz; ++k)
+			for(size_t v = 0; v < planeverts[k][s].size(); ++v)
+				cells.push_back(planeverts[k][s][v].cell);
+
+		// Quads around every crossed grid edge, each edge owned by the cell at its lower end
+		std::vector< std::vector<unsigned int> > planetris(d_nz);
+#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (k)
+#endif
+		for(k = 0; k < (int)d_nz; ++k)
+		{
+			for(size_t v = 0; v < planeverts[k][s].size(); ++v)
+			{
+				size_t cell = planeverts[k][s][v].cell;
+				int pos[3] = { (int)(cell % d_nx), (int)((cell % planecells) / d_nx), k };
+				size_t idxV = voxoff[2]*pos[2] + voxoff[1]*pos[1] + pos[0];
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtFrontC].second->pos, d_surfcells[idxExtRightC].second->pos);
-				}
-				if ( inner(d_gradients[idxBackDownLeft], d_gradients[idxBackUpLeft]) < 0 ) // back-left
+				for(int a = 0; a < 3; ++a)
 				{
-					if( d_surfcells[idxC].second == NULL )
-						d_surfcells[idxC].second = _AddVertexIntoSurf(newsurf, cellcenter);
+					int b = (a+1) % 3, c = (a+2) % 3;
+					if( pos[b] == 0 || pos[c] == 0 ) continue;
 
-					d_surfcells[idxExtBackC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtBackC].first);
+					bool in0 = d_voxels[idxV] < isos[s];
+					bool in1 = d_voxels[idxV + voxoff[a]] < isos[s];
+					if( in0 == in1 ) continue;
 
-					d_surfcells[idxExtLeftC].second = _AddVertexIntoSurf(newsurf, d_surfcells[idxExtLeftC].first);
+					size_t quad[4] = { cell, cell - celloff[b], cell - celloff[b] - celloff[c], cell - celloff[c] };
+					unsigned int vq[4];
+					bool found = true;
+					for(int q = 0; q < 4 && found; ++q)
+					{
+						std::vector<size_t>::const_iterator it = std::lower_bound(cells.begin(), cells.end(), quad[q]);
+						found = it != cells.end() && *it == quad[q];
+						if( found ) vq[q] = (unsigned int)(it - cells.begin());
+					}
+					if( !found ) continue; // clipped or skipped neighbour
 
-					newsurf->addTriangle(d_surfcells[idxC].second->pos,
-					d_surfcells[idxExtBackC].second->pos, d_surfcells[idxExtLeftC].second->pos);
+					// Keep the normals pointing towards increasing distance
+					if( in1 ) std::swap(vq[1], vq[3]);
+					unsigned int tri[6] = { vq[0], vq[1], vq[2], vq[0], vq[2], vq[3] };
+					planetris[k].insert(planetris[k].end(), tri, tri+6);
 				}
 			}
 		}
+
+		// Generate new Surface
+		std::ostringstream name;
+		name << d_surf->name() << "_OFF" << isos[s];
+		CsiTSurf *newsurf = new CsiTSurf(name.str());
+		std::vector<CsiTSurfVertex*> vertices;
+		vertices.reserve(cells.size());
+		for(k = 0; k < (int)d_nz; ++k)
+			for(size_t v = 0; v < planeverts[k][s].size(); ++v)
+				vertices.push_back(_AddVertexIntoSurf(newsurf, planeverts[k][s][v].pos));
+		for(k = 0; k < (int)d_nz; ++k)
+			for(size_t t = 0; t < planetris[k].size(); t += 3)
+				newsurf->addTriangle(vertices[planetris[k][t]]->pos, vertices[planetris[k][t+1]]->pos, vertices[planetris[k][t+2]]->pos);
+
+		cerr << "Offset " << isos[s] << ": " << newsurf->trianglesList().size() << " triangles, "
+		     << newsurf->vertexArray().size() << " vertices" << endl;
+		sorted[s] = newsurf;
 	}
-	cerr << "Number of triangles: "<< newsurf->trianglesList().size() << endl;
-	cerr << "Number of vertices: "<< newsurf->vertexArray().size() << endl;
-	
-	RelaxSurfVertices();
-	return newsurf;
+
+	// A repeated iso-value gets a copy, so that every returned surface can be deleted on its own
+	std::vector<bool> given(nisos, false);
+	for(size_t s = 0; s < isovalues.size(); ++s)
+	{
+		size_t i = std::lower_bound(isos.begin(), isos.end(), isovalues[s]) - isos.begin();
+		surfaces.push_back(given[i] ? _CopySurface(sorted[i]) : sorted[i]);
+		given[i] = true;
+	}
+
+	double ctimeEnd = omp_get_wtime();
+	cerr << "Offset surfaces time: "<< ctimeEnd - ctimeBegin << endl;
+	return surfaces;
 }
 
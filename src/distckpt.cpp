@@ -0,0 +1,277 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <omp.h>
+
+#include "distckpt.h"
+#include "distfile.h"
+#include "distcache.h"
+
+#define CKPT_MAGIC "RMGCKP1"
+#define CKPT_VERSION 4
+
+using namespace std;
+
+// Checkpoint header, followed by the completion bitmap and, at d_datasec, by the
+// voxels (double), border flags (one byte each), gradients (octahedral codes, as in DistCalc)
+// and, if features is set, the closest triangle ids and packed (s,t) (unsigned int each) and, if labels
+// is set, the labels of the closest triangles (unsigned short)
+typedef struct ckpt_header {
+	char magic[8];
+	unsigned int version;
+	int nx;
+	unsigned int ny, nz;
+	unsigned int tiledepth;
+	unsigned int ntiles;
+	unsigned int features;
+	unsigned int labels;
+	char key[40]; // DistCache key of the mesh and grid
+} Ckpt_Header;
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* WriteTile
+* ------------------------------------------------------------------------
+* Writes the voxels, border flags, gradients, closest features and labels of a tile into the checkpoint file
+* @param[in] obj - distance field object being computed
+* @param[in] tile - tile index
+*/
+bool DistCheckpoint::WriteTile(DistCalc *obj, unsigned int tile)
+{
+	std::vector<double> &voxels = obj->GetVoxels();
+	std::vector<bool> &borders = obj->GetBorders();
+	DistGradients &gradients = obj->GetGradients();
+
+	size_t planesize = (size_t)(obj->d_nx+1)*(obj->d_ny+1);
+	unsigned int k0 = tile*d_tiledepth;
+	unsigned int nk = std::min(d_tiledepth, obj->d_nz+1 - k0);
+	size_t first = planesize*k0;
+	size_t n = planesize*nk;
+	size_t codesize = gradients.CodeSize();
+
+	if( DistSeek(d_fp, (long long)(d_datasec + first*sizeof(double))) != 0 ) return false;
+	if( fwrite(&voxels[first], sizeof(double), n, d_fp) != n ) return false;
+
+	std::vector<unsigned char> bchunk(n);
+	for( size_t i = 0; i < n; i++ ) bchunk[i] = borders[first+i] ? 1 : 0;
+	if( DistSeek(d_fp, (long long)(d_datasec + d_nvoxels*sizeof(double) + first)) != 0 ) return false;
+	if( fwrite(&bchunk[0], 1, n, d_fp) != n ) return false;
+
+	if( DistSeek(d_fp, (long long)(d_datasec + d_nvoxels*(sizeof(double)+1) + first*codesize)) != 0 )
+		return false;
+	if( fwrite((const char*)gradients.Codes() + first*codesize, codesize, n, d_fp) != n ) return false;
+
+	unsigned long long featsec = d_datasec + d_nvoxels*(sizeof(double)+1+codesize);
+	if( obj->ClosestFeatures() )
+	{
+		if( DistSeek(d_fp, (long long)(featsec + first*sizeof(unsigned int))) != 0 ) return false;
+		if( fwrite(&obj->GetClosestTriangles()[first], sizeof(unsigned int), n, d_fp) != n ) return false;
+		if( DistSeek(d_fp, (long long)(featsec + (d_nvoxels + first)*sizeof(unsigned int))) != 0 ) return false;
+		if( fwrite(&obj->GetClosestST()[first], sizeof(unsigned int), n, d_fp) != n ) return false;
+	}
+	if( !obj->HasTriangleLabels() ) return true;
+
+	unsigned long long labelsec = featsec + (obj->ClosestFeatures() ? 2*d_nvoxels*sizeof(unsigned int) : 0);
+	if( DistSeek(d_fp, (long long)(labelsec + first*sizeof(unsigned short))) != 0 ) return false;
+	return fwrite(&obj->GetLabels()[first], sizeof(unsigned short), n, d_fp) == n;
+}
+
+/**
+* ReadTile
+* ------------------------------------------------------------------------
+* Loads a completed tile from the checkpoint file into the object's arrays
+* @param[in] obj - distance field object being computed
+* @param[in] tile - tile index
+*/
+bool DistCheckpoint::ReadTile(DistCalc *obj, unsigned int tile)
+{
+	std::vector<double> &voxels = obj->GetVoxels();
+	std::vector<bool> &borders = obj->GetBorders();
+	DistGradients &gradients = obj->GetGradients();
+
+	size_t planesize = (size_t)(obj->d_nx+1)*(obj->d_ny+1);
+	unsigned int k0 = tile*d_tiledepth;
+	unsigned int nk = std::min(d_tiledepth, obj->d_nz+1 - k0);
+	size_t first = planesize*k0;
+	size_t n = planesize*nk;
+	size_t codesize = gradients.CodeSize();
+
+	if( DistSeek(d_fp, (long long)(d_datasec + first*sizeof(double))) != 0 ) return false;
+	if( fread(&voxels[first], sizeof(double), n, d_fp) != n ) return false;
+
+	std::vector<unsigned char> bchunk(n);
+	if( DistSeek(d_fp, (long long)(d_datasec + d_nvoxels*sizeof(double) + first)) != 0 ) return false;
+	if( fread(&bchunk[0], 1, n, d_fp) != n ) return false;
+	for( size_t i = 0; i < n; i++ ) borders[first+i] = bchunk[i] != 0;
+
+	if( DistSeek(d_fp, (long long)(d_datasec + d_nvoxels*(sizeof(double)+1) + first*codesize)) != 0 )
+		return false;
+	if( fread((char*)gradients.Codes() + first*codesize, codesize, n, d_fp) != n ) return false;
+
+	unsigned long long featsec = d_datasec + d_nvoxels*(sizeof(double)+1+codesize);
+	if( obj->ClosestFeatures() )
+	{
+		if( DistSeek(d_fp, (long long)(featsec + first*sizeof(unsigned int))) != 0 ) return false;
+		if( fread(&obj->GetClosestTriangles()[first], sizeof(unsigned int), n, d_fp) != n ) return false;
+		if( DistSeek(d_fp, (long long)(featsec + (d_nvoxels + first)*sizeof(unsigned int))) != 0 ) return false;
+		if( fread(&obj->GetClosestST()[first], sizeof(unsigned int), n, d_fp) != n ) return false;
+	}
+	if( !obj->HasTriangleLabels() ) return true;
+
+	unsigned long long labelsec = featsec + (obj->ClosestFeatures() ? 2*d_nvoxels*sizeof(unsigned int) : 0);
+	if( DistSeek(d_fp, (long long)(labelsec + first*sizeof(unsigned short))) != 0 ) return false;
+	return fread(&obj->GetLabels()[first], sizeof(unsigned short), n, d_fp) == n;
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Open
+* ------------------------------------------------------------------------
+* Resumes from an existing checkpoint of the same mesh and grid, loading its completed
+* tiles into the object's arrays, or starts a new one. The arrays must already be sized.
+* @param[in] obj - distance field object being computed
+* @return - false if the checkpoint file could not be used
+*/
+bool DistCheckpoint::Open(DistCalc *obj)
+{
+	Ckpt_Header header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, CKPT_MAGIC, sizeof(header.magic));
+	header.version = CKPT_VERSION;
+	header.nx = obj->d_nx;
+	header.ny = obj->d_ny;
+	header.nz = obj->d_nz;
+	header.tiledepth = d_tiledepth;
+	header.ntiles = (obj->d_nz+1 + d_tiledepth-1)/d_tiledepth;
+	header.features = obj->ClosestFeatures() ? 1 : 0;
+	header.labels = obj->HasTriangleLabels() ? 1 : 0;
+	strncpy(header.key, DistCache::Key(obj).c_str(), sizeof(header.key)-1);
+
+	d_ntiles = header.ntiles;
+	d_nvoxels = (unsigned long long)(obj->d_nx+1)*(obj->d_ny+1)*(obj->d_nz+1);
+	d_bitmap.assign((d_ntiles+7)/8, 0);
+	d_pending.clear();
+	d_datasec = (sizeof(Ckpt_Header) + d_bitmap.size() + 7) & ~7ULL;
+	d_lastflush = omp_get_wtime();
+
+	// Try to resume
+	d_fp = fopen(d_filename.c_str(), "r+b");
+	if( d_fp != NULL )
+	{
+		Ckpt_Header stored;
+		bool match = fread(&stored, sizeof(stored), 1, d_fp) == 1 && memcmp(&stored, &header, sizeof(header)) == 0 &&
+		             fread(&d_bitmap[0], 1, d_bitmap.size(), d_fp) == d_bitmap.size();
+
+		if( match )
+		{
+			unsigned int loaded = 0;
+			for( unsigned int tile = 0; tile < d_ntiles; tile++ )
+			{
+				if( !IsDone(tile) ) continue;
+				if( ReadTile(obj, tile) == false )
+				{
+					// Bitmap claims more than the file holds, drop the tile
+					d_bitmap[tile/8] &= ~(1 << (tile%8));
+					continue;
+				}
+				loaded++;
+			}
+			cerr << "Resuming from checkpoint " << d_filename << ": " << loaded << " of " << d_ntiles << " tiles done" << endl;
+			return true;
+		}
+
+		cerr << "Checkpoint " << d_filename << " belongs to another mesh or grid, starting over" << endl;
+		fclose(d_fp);
+		d_bitmap.assign(d_bitmap.size(), 0);
+	}
+
+	// Start a new checkpoint
+	d_fp = fopen(d_filename.c_str(), "w+b");
+	if( d_fp == NULL ) return false;
+	bool ok = fwrite(&header, sizeof(header), 1, d_fp) == 1 &&
+	          fwrite(&d_bitmap[0], 1, d_bitmap.size(), d_fp) == d_bitmap.size() && DistSync(d_fp);
+	return ok;
+}
+
+/**
+* NumDone
+* ------------------------------------------------------------------------
+* Returns how many tiles are recorded as completed in the checkpoint file
+*/
+unsigned int DistCheckpoint::NumDone() const
+{
+	unsigned int count = 0;
+	for( unsigned int tile = 0; tile < d_ntiles; tile++ )
+		if( IsDone(tile) ) count++;
+	return count;
+}
+
+/**
+* MarkDone
+* ------------------------------------------------------------------------
+* Records that a tile has been computed; completed tiles are flushed to the checkpoint
+* file once the flush interval has elapsed
+* @param[in] obj - distance field object being computed
+* @param[in] tile - tile index
+*/
+bool DistCheckpoint::MarkDone(DistCalc *obj, unsigned int tile)
+{
+	d_pending.push_back(tile);
+	if( omp_get_wtime() - d_lastflush < d_interval ) return true;
+	return Flush(obj);
+}
+
+/**
+* Flush
+* ------------------------------------------------------------------------
+* Writes every pending tile and then the updated completion bitmap. Data is synced before
+* the bitmap, so the bitmap never claims a tile that is not on disk.
+* @param[in] obj - distance field object being computed
+*/
+bool DistCheckpoint::Flush(DistCalc *obj)
+{
+	d_lastflush = omp_get_wtime();
+	if( d_fp == NULL || d_pending.empty() ) return true;
+
+	for( size_t p = 0; p < d_pending.size(); p++ )
+		if( WriteTile(obj, d_pending[p]) == false ) return false;
+	if( DistSync(d_fp) == false ) return false;
+
+	for( size_t p = 0; p < d_pending.size(); p++ )
+		d_bitmap[d_pending[p]/8] |= 1 << (d_pending[p]%8);
+	d_pending.clear();
+
+	if( DistSeek(d_fp, (long long)sizeof(Ckpt_Header)) != 0 ) return false;
+	if( fwrite(&d_bitmap[0], 1, d_bitmap.size(), d_fp) != d_bitmap.size() ) return false;
+	return DistSync(d_fp);
+}
+
+/**
+* Remove
+* ------------------------------------------------------------------------
+* Deletes the checkpoint file, once the run it protects has finished
+*/
+void DistCheckpoint::Remove()
+{
+	if( d_fp != NULL ) fclose(d_fp);
+	d_fp = NULL;
+	remove(d_filename.c_str());
+}
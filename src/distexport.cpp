@@ -0,0 +1,347 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#include "distexport.h"
+#include "distfile.h"
+
+using namespace std;
+
+// Channels, in the order they are stored
+#define CH_DISTANCE 0
+#define CH_GRADIENT 1
+#define CH_BORDER 2
+
+// Bytes per voxel of each channel
+static const size_t s_chsize[3] = { sizeof(double), 3*sizeof(double), 1 };
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _LittleEndian
+* ------------------------------------------------------------------------
+* Informs the byte order of the machine, which is the byte order of the exported data
+*/
+static bool _LittleEndian()
+{
+	unsigned int one = 1;
+	return *(unsigned char*)&one == 1;
+}
+
+/**
+* _BaseLeaf
+* ------------------------------------------------------------------------
+* Returns the file name without its directory, for references between exported files
+*/
+static std::string _BaseLeaf(const std::string &name)
+{
+	size_t i = name.find_last_of("/\\");
+	return i == std::string::npos ? name : name.substr(i+1);
+}
+
+/**
+* _WriteSlab
+* ------------------------------------------------------------------------
+* Writes the slab of a channel, either at the file's current position (sequential
+* channel files) or at a given offset
+*/
+static bool _WriteSlab(FILE *fp, const void *data, size_t len, long long offset = -1)
+{
+	if( offset >= 0 && DistSeek(fp, offset) != 0 ) return false;
+	return fwrite(data, 1, len, fp) == len;
+}
+
+/**
+* _NrrdHeader
+* ------------------------------------------------------------------------
+* Writes the attached header of a NRRD volume
+* @param[in] fp - output file
+* @param[in] obj - exported distance field
+* @param[in] type - NRRD element type
+* @param[in] components - number of components per voxel
+*/
+static bool _NrrdHeader(FILE *fp, DistCalc *obj, const char *type, int components)
+{
+	fprintf(fp, "NRRD0004\n");
+	fprintf(fp, "# Distance field exported by ReMGeo\n");
+	fprintf(fp, "type: %s\n", type);
+	if( components > 1 )
+	{
+		fprintf(fp, "dimension: 4\n");
+		fprintf(fp, "sizes: %d %d %u %u\n", components, obj->d_nx+1, obj->d_ny+1, obj->d_nz+1);
+		fprintf(fp, "space dimension: 3\n");
+		fprintf(fp, "space directions: none (%.17g,0,0) (0,%.17g,0) (0,0,%.17g)\n", obj->d_size, obj->d_size, obj->d_size);
+		fprintf(fp, "kinds: vector domain domain domain\n");
+	}
+	else
+	{
+		fprintf(fp, "dimension: 3\n");
+		fprintf(fp, "sizes: %d %u %u\n", obj->d_nx+1, obj->d_ny+1, obj->d_nz+1);
+		fprintf(fp, "space dimension: 3\n");
+		fprintf(fp, "space directions: (%.17g,0,0) (0,%.17g,0) (0,0,%.17g)\n", obj->d_size, obj->d_size, obj->d_size);
+		fprintf(fp, "kinds: domain domain domain\n");
+	}
+	fprintf(fp, "space origin: (%.17g,%.17g,%.17g)\n", obj->d_min.x, obj->d_min.y, obj->d_min.z);
+	fprintf(fp, "endian: %s\n", _LittleEndian() ? "little" : "big");
+	fprintf(fp, "encoding: raw\n\n");
+	return ferror(fp) == 0;
+}
+
+/**
+* Setup
+* ------------------------------------------------------------------------
+* Records the grid of the exported distance field
+*/
+void DistExporter::Setup(DistCalc *obj)
+{
+	d_planesize = (size_t)(obj->d_nx+1)*(obj->d_ny+1);
+	d_nvoxels = d_planesize*(obj->d_nz+1);
+}
+
+/**
+* GradientTriplets
+* ------------------------------------------------------------------------
+* Converts a gradient slab into contiguous x,y,z doubles. The buffer is reused between slabs.
+*/
+const double* DistExporter::GradientTriplets(const GeoPoint3D *gradients, size_t n)
+{
+	if( d_gradbuffer.size() < 3*n ) d_gradbuffer.resize(3*n);
+	for( size_t i = 0; i < n; i++ )
+	{
+		d_gradbuffer[3*i] = gradients[i].x;
+		d_gradbuffer[3*i+1] = gradients[i].y;
+		d_gradbuffer[3*i+2] = gradients[i].z;
+	}
+	return &d_gradbuffer[0];
+}
+
+/**
+* OpenOutput
+* ------------------------------------------------------------------------
+* Creates an output file, reporting failures
+*/
+FILE* DistExporter::OpenOutput(std::string filename)
+{
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if( fp == NULL ) cerr << "Could not create " << filename << endl;
+	return fp;
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* DistVtiWriter::Begin
+* ------------------------------------------------------------------------
+* Writes the XML part of the .vti file; array offsets are known in advance since the
+* size of every array is fixed by the grid
+*/
+bool DistVtiWriter::Begin(DistCalc *obj)
+{
+	Setup(obj);
+	d_fp = OpenOutput(d_basename + ".vti");
+	if( d_fp == NULL ) return false;
+
+	// Every appended array is preceded by its size in bytes (UInt64)
+	unsigned long long offset = 0;
+	for( int c = 0; c < 3; c++ )
+	{
+		d_offsets[c] = offset;
+		offset += sizeof(unsigned long long) + d_nvoxels*s_chsize[c];
+	}
+
+	fprintf(d_fp, "<?xml version=\"1.0\"?>\n");
+	fprintf(d_fp, "<VTKFile type=\"ImageData\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n",
+		_LittleEndian() ? "LittleEndian" : "BigEndian");
+	fprintf(d_fp, "  <ImageData WholeExtent=\"0 %d 0 %u 0 %u\" Origin=\"%.17g %.17g %.17g\" Spacing=\"%.17g %.17g %.17g\">\n",
+		obj->d_nx, obj->d_ny, obj->d_nz, obj->d_min.x, obj->d_min.y, obj->d_min.z, obj->d_size, obj->d_size, obj->d_size);
+	fprintf(d_fp, "    <Piece Extent=\"0 %d 0 %u 0 %u\">\n", obj->d_nx, obj->d_ny, obj->d_nz);
+	fprintf(d_fp, "      <PointData Scalars=\"distance\" Vectors=\"gradient\">\n");
+	fprintf(d_fp, "        <DataArray type=\"Float64\" Name=\"distance\" format=\"appended\" offset=\"%llu\"/>\n", d_offsets[CH_DISTANCE]);
+	fprintf(d_fp, "        <DataArray type=\"Float64\" Name=\"gradient\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%llu\"/>\n",
+		d_offsets[CH_GRADIENT]);
+	fprintf(d_fp, "        <DataArray type=\"UInt8\" Name=\"border\" format=\"appended\" offset=\"%llu\"/>\n", d_offsets[CH_BORDER]);
+	fprintf(d_fp, "      </PointData>\n");
+	fprintf(d_fp, "      <CellData>\n      </CellData>\n");
+	fprintf(d_fp, "    </Piece>\n");
+	fprintf(d_fp, "  </ImageData>\n");
+	fprintf(d_fp, "  <AppendedData encoding=\"raw\">\n   _");
+	long long datapos = DistTell(d_fp);
+	d_datapos = datapos < 0 ? 0 : (unsigned long long)datapos;
+
+	bool ok = datapos >= 0 && ferror(d_fp) == 0;
+	for( int c = 0; ok && c < 3; c++ )
+	{
+		unsigned long long nbytes = d_nvoxels*s_chsize[c];
+		ok = _WriteSlab(d_fp, &nbytes, sizeof(nbytes), d_datapos + d_offsets[c]);
+	}
+	return ok;
+}
+
+/**
+* DistVtiWriter::ConsumeSlab
+* ------------------------------------------------------------------------
+* Writes the slab into each of the appended arrays
+*/
+bool DistVtiWriter::ConsumeSlab(DistCalc *, unsigned int k0, unsigned int nk,
+	const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients)
+{
+	size_t first = d_planesize*k0;
+	size_t n = d_planesize*nk;
+	const void *data[3] = { voxels, GradientTriplets(gradients, n), borders };
+
+	for( int c = 0; c < 3; c++ )
+	{
+		long long pos = d_datapos + d_offsets[c] + sizeof(unsigned long long) + first*s_chsize[c];
+		if( _WriteSlab(d_fp, data[c], n*s_chsize[c], pos) == false ) return false;
+	}
+	return true;
+}
+
+/**
+* DistVtiWriter::End
+* ------------------------------------------------------------------------
+* Closes the XML after the appended data
+*/
+bool DistVtiWriter::End(DistCalc *)
+{
+	unsigned long long end = d_datapos + d_offsets[CH_BORDER] + sizeof(unsigned long long) + d_nvoxels*s_chsize[CH_BORDER];
+	bool ok = DistSeek(d_fp, (long long)end) == 0;
+	fprintf(d_fp, "\n  </AppendedData>\n</VTKFile>\n");
+	ok = ok && ferror(d_fp) == 0;
+	if( fclose(d_fp) != 0 ) ok = false;
+	d_fp = NULL;
+	return ok;
+}
+
+/**
+* DistNrrdWriter::Begin
+* ------------------------------------------------------------------------
+* Creates the three NRRD volumes and writes their headers
+*/
+bool DistNrrdWriter::Begin(DistCalc *obj)
+{
+	Setup(obj);
+	d_fp[CH_DISTANCE] = OpenOutput(d_basename + ".nrrd");
+	d_fp[CH_GRADIENT] = OpenOutput(d_basename + "_grad.nrrd");
+	d_fp[CH_BORDER] = OpenOutput(d_basename + "_border.nrrd");
+	if( d_fp[CH_DISTANCE] == NULL || d_fp[CH_GRADIENT] == NULL || d_fp[CH_BORDER] == NULL ) return false;
+
+	return _NrrdHeader(d_fp[CH_DISTANCE], obj, "double", 1) && _NrrdHeader(d_fp[CH_GRADIENT], obj, "double", 3) &&
+	       _NrrdHeader(d_fp[CH_BORDER], obj, "uchar", 1);
+}
+
+/**
+* DistNrrdWriter::ConsumeSlab
+* ------------------------------------------------------------------------
+* Appends the slab to each volume (slabs arrive in z order)
+*/
+bool DistNrrdWriter::ConsumeSlab(DistCalc *, unsigned int , unsigned int nk,
+	const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients)
+{
+	size_t n = d_planesize*nk;
+	return _WriteSlab(d_fp[CH_DISTANCE], voxels, n*s_chsize[CH_DISTANCE]) &&
+	       _WriteSlab(d_fp[CH_GRADIENT], GradientTriplets(gradients, n), n*s_chsize[CH_GRADIENT]) &&
+	       _WriteSlab(d_fp[CH_BORDER], borders, n*s_chsize[CH_BORDER]);
+}
+
+/**
+* DistNrrdWriter::End
+* ------------------------------------------------------------------------
+* Closes the volumes
+*/
+bool DistNrrdWriter::End(DistCalc *)
+{
+	bool ok = true;
+	for( int c = 0; c < 3; c++ )
+	{
+		if( fclose(d_fp[c]) != 0 ) ok = false;
+		d_fp[c] = NULL;
+	}
+	return ok;
+}
+
+/**
+* DistRawWriter::Begin
+* ------------------------------------------------------------------------
+* Writes the JSON header and creates the raw channel files
+*/
+bool DistRawWriter::Begin(DistCalc *obj)
+{
+	Setup(obj);
+	static const char *suffix[3] = { "_distance.raw", "_gradient.raw", "_border.raw" };
+	static const char *name[3] = { "distance", "gradient", "border" };
+	static const char *type[3] = { "float64", "float64", "uint8" };
+	static const int components[3] = { 1, 3, 1 };
+
+	FILE *json = OpenOutput(d_basename + ".json");
+	if( json == NULL ) return false;
+
+	std::string leaf = _BaseLeaf(d_basename);
+	fprintf(json, "{\n");
+	fprintf(json, "  \"format\": \"remgeo-raw\",\n");
+	fprintf(json, "  \"dimensions\": [%d, %u, %u],\n", obj->d_nx+1, obj->d_ny+1, obj->d_nz+1);
+	fprintf(json, "  \"origin\": [%.17g, %.17g, %.17g],\n", obj->d_min.x, obj->d_min.y, obj->d_min.z);
+	fprintf(json, "  \"spacing\": [%.17g, %.17g, %.17g],\n", obj->d_size, obj->d_size, obj->d_size);
+	fprintf(json, "  \"order\": \"x-fastest\",\n");
+	fprintf(json, "  \"byte_order\": \"%s\",\n", _LittleEndian() ? "little" : "big");
+	fprintf(json, "  \"channels\": [\n");
+	for( int c = 0; c < 3; c++ )
+		fprintf(json, "    { \"name\": \"%s\", \"file\": \"%s%s\", \"type\": \"%s\", \"components\": %d }%s\n",
+			name[c], leaf.c_str(), suffix[c], type[c], components[c], c < 2 ? "," : "");
+	fprintf(json, "  ]\n}\n");
+	bool ok = ferror(json) == 0;
+	if( fclose(json) != 0 ) ok = false;
+
+	for( int c = 0; c < 3; c++ )
+	{
+		d_fp[c] = OpenOutput(d_basename + suffix[c]);
+		if( d_fp[c] == NULL ) ok = false;
+	}
+	return ok;
+}
+
+/**
+* DistRawWriter::ConsumeSlab
+* ------------------------------------------------------------------------
+* Appends the slab to each channel file (slabs arrive in z order)
+*/
+bool DistRawWriter::ConsumeSlab(DistCalc *, unsigned int , unsigned int nk,
+	const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients)
+{
+	size_t n = d_planesize*nk;
+	return _WriteSlab(d_fp[CH_DISTANCE], voxels, n*s_chsize[CH_DISTANCE]) &&
+	       _WriteSlab(d_fp[CH_GRADIENT], GradientTriplets(gradients, n), n*s_chsize[CH_GRADIENT]) &&
+	       _WriteSlab(d_fp[CH_BORDER], borders, n*s_chsize[CH_BORDER]);
+}
+
+/**
+* DistRawWriter::End
+* ------------------------------------------------------------------------
+* Closes the channel files
+*/
+bool DistRawWriter::End(DistCalc *)
+{
+	bool ok = true;
+	for( int c = 0; c < 3; c++ )
+	{
+		if( fclose(d_fp[c]) != 0 ) ok = false;
+		d_fp[c] = NULL;
+	}
+	return ok;
+}
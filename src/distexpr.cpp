@@ -0,0 +1,386 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include "distexpr.h"
+#include "distomp.h"
+
+// Vectorization hint for the loops over a block (OpenMP 4.0)
+#if defined(_OPENMP) && _OPENMP >= 201307
+	#define EXPR_SIMD _Pragma("omp simd")
+#else
+	#define EXPR_SIMD
+#endif
+
+#define EXPR_CHUNK (1 << 20) // voxels written to a file at a time
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* EvaluateBlock
+* ------------------------------------------------------------------------
+* Runs the program over a block of voxels. Fields are pushed as pointers into the inputs and
+* every operation writes into the stack slot of its result, so the output may be one of the
+* inputs: a block is written only after all of it was read.
+* @param[in] first - first voxel of the block
+* @param[in] count - voxels in the block, at most EXPR_BLOCK
+* @param[out] out - output of the block
+*/
+void DistExpression::EvaluateBlock(size_t first, size_t count, double *out) const
+{
+	double slots[EXPR_MAXDEPTH][EXPR_BLOCK];
+	const double *stack[EXPR_MAXDEPTH];
+	int top = -1;
+	int n = (int)count;
+
+	for( size_t p = 0; p < d_program.size(); p++ )
+	{
+		const Expr_Op &op = d_program[p];
+		if( op.code == EXPR_FIELD )
+		{
+			stack[++top] = d_inputs[op.field] + first;
+			continue;
+		}
+
+		const double *x = stack[top];
+		double *r;
+		int i;
+		if( op.code == EXPR_MIN || op.code == EXPR_MAX || op.code == EXPR_ADD || op.code == EXPR_SUB || op.code == EXPR_SMIN )
+		{
+			const double *y = x;
+			x = stack[--top];
+			r = slots[top];
+			switch( op.code )
+			{
+			case EXPR_MIN:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] < y[i] ? x[i] : y[i];
+				break;
+			case EXPR_MAX:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] > y[i] ? x[i] : y[i];
+				break;
+			case EXPR_ADD:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] + y[i];
+				break;
+			case EXPR_SUB:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] - y[i];
+				break;
+			default:
+			{
+				// Polynomial smooth minimum: equal to min beyond a of the other field, and rounded
+				// by at most a/4 where both are close
+				double k = op.a, inv = 1/k;
+				EXPR_SIMD
+				for( i = 0; i < n; i++ )
+				{
+					double d = x[i] - y[i];
+					double m = d < 0 ? x[i] : y[i];
+					double h = k - (d < 0 ? -d : d);
+					h = h > 0 ? h*inv : 0;
+					r[i] = m - 0.25*k*h*h;
+				}
+			}
+			}
+		}
+		else
+		{
+			r = slots[top];
+			double a = op.a, b = op.b;
+			switch( op.code )
+			{
+			case EXPR_NEG:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = -x[i];
+				break;
+			case EXPR_CLAMP:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] < a ? a : (x[i] > b ? b : x[i]);
+				break;
+			default:
+				EXPR_SIMD
+				for( i = 0; i < n; i++ ) r[i] = x[i] - a;
+			}
+		}
+		stack[top] = r;
+	}
+
+	memmove(out, stack[0], count*sizeof(double));
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Input
+* ------------------------------------------------------------------------
+* Adds an input field. The first input sets the grid, every other one must be on the same grid.
+* @param[in] voxels - distance field, kept by pointer: it must outlive the evaluations
+* @param[in] nx, ny, nz - cells of the grid along each axis
+* @param[in] size - grid step
+* @param[in] min - corner of the grid
+* @return - handle of the field, -1 if it is not on the grid of the other inputs
+*/
+int DistExpression::Input(const double *voxels, int nx, unsigned int ny, unsigned int nz, double size, const GeoPoint3D &min)
+{
+	if( voxels == NULL || nx < 1 || ny < 1 || nz < 1 || (!d_inputs.empty() &&
+	    (nx != d_nx || ny != d_ny || nz != d_nz || size != d_size || min.x != d_min.x || min.y != d_min.y || min.z != d_min.z)) )
+	{
+		cerr << "Expression input does not match the grid of the other inputs" << endl;
+		return -1;
+	}
+
+	d_nx = nx;
+	d_ny = ny;
+	d_nz = nz;
+	d_size = size;
+	d_min = min;
+	d_nvoxels = (size_t)(nx+1)*(ny+1)*(nz+1);
+	d_inputs.push_back(voxels);
+	return (int)d_inputs.size() - 1;
+}
+
+/**
+* Input
+* ------------------------------------------------------------------------
+* Adds the field of a distance field object
+* @param[in] obj - object whose field is computed, on the grid of the other inputs
+* @return - handle of the field, -1 if it is not computed or not on the grid of the other inputs
+*/
+int DistExpression::Input(DistCalc *obj)
+{
+	if( obj->GetVoxels().size() != (size_t)(obj->d_nx+1)*(obj->d_ny+1)*(obj->d_nz+1) )
+	{
+		cerr << "Expression input is not computed" << endl;
+		return -1;
+	}
+	return Input(obj->GetVoxels().data(), obj->d_nx, obj->d_ny, obj->d_nz, obj->d_size, obj->d_min);
+}
+
+/**
+* Push
+* ------------------------------------------------------------------------
+* Appends the push of an input field to the program
+* @param[in] field - handle returned by Input
+*/
+void DistExpression::Push(unsigned int field)
+{
+	Expr_Op op = { EXPR_FIELD, field, 0, 0 };
+	d_program.push_back(op);
+}
+
+/**
+* Apply
+* ------------------------------------------------------------------------
+* Appends an operation to the program
+* @param[in] code - EXPR_MIN, EXPR_MAX, EXPR_NEG, EXPR_ADD, EXPR_SUB, EXPR_CLAMP, EXPR_SMIN or EXPR_OFFSET
+* @param[in] a, b - bounds of EXPR_CLAMP, radius of EXPR_SMIN, offset of EXPR_OFFSET
+*/
+void DistExpression::Apply(int code, double a, double b)
+{
+	Expr_Op op = { code, 0, a, b };
+	d_program.push_back(op);
+}
+
+/**
+* Parse
+* ------------------------------------------------------------------------
+* Appends a program written in postfix, as "f0 neg f1 max 50 offset": fN pushes input N, numbers
+* are the arguments of the next operation ("lo hi clamp", "radius smin", "distance offset") and
+* min, max, neg, add and sub take their operands from the stack
+* @param[in] program - postfix program
+* @return - true if every token was understood and the program is valid, else the program is left
+* as it was
+*/
+bool DistExpression::Parse(const std::string &program)
+{
+	std::istringstream tokens(program);
+	std::string token;
+	std::vector<double> args;
+	size_t oldsize = d_program.size();
+
+	while( tokens >> token )
+	{
+		char *end;
+		double value = strtod(token.c_str(), &end);
+		int code = -1;
+		size_t nargs = 0;
+
+		if( *end == '\0' )
+		{
+			args.push_back(value);
+			continue;
+		}
+		else if( token[0] == 'f' && token.size() > 1 && token.find_first_not_of("0123456789", 1) == std::string::npos )
+			code = EXPR_FIELD;
+		else if( token == "min" ) code = EXPR_MIN;
+		else if( token == "max" ) code = EXPR_MAX;
+		else if( token == "neg" ) code = EXPR_NEG;
+		else if( token == "add" ) code = EXPR_ADD;
+		else if( token == "sub" ) code = EXPR_SUB;
+		else if( token == "clamp" ) { code = EXPR_CLAMP; nargs = 2; }
+		else if( token == "smin" ) { code = EXPR_SMIN; nargs = 1; }
+		else if( token == "offset" ) { code = EXPR_OFFSET; nargs = 1; }
+
+		if( code < 0 || args.size() != nargs )
+		{
+			cerr << "Invalid expression token: " << token << endl;
+			d_program.resize(oldsize);
+			return false;
+		}
+		if( code == EXPR_FIELD ) Push((unsigned int)atoi(token.c_str() + 1));
+		else Apply(code, nargs > 0 ? args[0] : 0, nargs > 1 ? args[1] : 0);
+		args.clear();
+	}
+
+	if( !args.empty() || !Valid() )
+	{
+		cerr << "Invalid field expression: " << program << endl;
+		d_program.resize(oldsize);
+		return false;
+	}
+	return true;
+}
+
+/**
+* Valid
+* ------------------------------------------------------------------------
+* Checks that the program refers to existing inputs, never pops an empty stack nor grows it
+* beyond EXPR_MAXDEPTH, and leaves a single field
+*/
+bool DistExpression::Valid() const
+{
+	int depth = 0;
+	for( size_t p = 0; p < d_program.size(); p++ )
+	{
+		const Expr_Op &op = d_program[p];
+		switch( op.code )
+		{
+		case EXPR_FIELD:
+			if( op.field >= d_inputs.size() || ++depth > EXPR_MAXDEPTH ) return false;
+			break;
+		case EXPR_MIN: case EXPR_MAX: case EXPR_ADD: case EXPR_SUB:
+			if( --depth < 1 ) return false;
+			break;
+		case EXPR_SMIN:
+			if( --depth < 1 || !(op.a > 0) ) return false;
+			break;
+		case EXPR_CLAMP:
+			if( depth < 1 || !(op.a <= op.b) ) return false;
+			break;
+		case EXPR_NEG: case EXPR_OFFSET:
+			if( depth < 1 ) return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return depth == 1;
+}
+
+/**
+* Evaluate
+* ------------------------------------------------------------------------
+* Evaluates the program over the whole grid, block by block in parallel
+* @param[out] out - NumVoxels values, may be one of the inputs
+* @return - true if the program is valid
+*/
+bool DistExpression::Evaluate(double *out) const
+{
+	if( !Valid() )
+	{
+		cerr << "Invalid field expression" << endl;
+		return false;
+	}
+
+	long long nblocks = (long long)((d_nvoxels + EXPR_BLOCK - 1)/EXPR_BLOCK);
+	long long b;
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (b)
+#endif
+	for( b = 0; b < nblocks; b++ )
+	{
+		size_t first = (size_t)b*EXPR_BLOCK;
+		size_t count = d_nvoxels - first < EXPR_BLOCK ? d_nvoxels - first : EXPR_BLOCK;
+		EvaluateBlock(first, count, out + first);
+	}
+	return true;
+}
+
+/**
+* Evaluate
+* ------------------------------------------------------------------------
+* Evaluates the program into <basename>.raw, doubles in grid order in the byte order of the host,
+* described by a <basename>.json header in the format of DistRawWriter. The field is written a
+* chunk at a time, so that nothing of the size of the grid is kept in memory when the inputs are
+* mapped files.
+* @param[in] basename - output file name, without extension
+* @return - true if the program is valid and the whole field was written
+*/
+bool DistExpression::Evaluate(std::string basename) const
+{
+	if( !Valid() )
+	{
+		cerr << "Invalid field expression" << endl;
+		return false;
+	}
+
+	FILE *json = fopen((basename + ".json").c_str(), "w");
+	if( json == NULL ) return false;
+	unsigned int one = 1;
+	size_t slash = basename.find_last_of("/\\");
+	std::string leaf = slash == std::string::npos ? basename : basename.substr(slash+1);
+	fprintf(json, "{\n");
+	fprintf(json, "  \"format\": \"remgeo-raw\",\n");
+	fprintf(json, "  \"dimensions\": [%d, %u, %u],\n", d_nx+1, d_ny+1, d_nz+1);
+	fprintf(json, "  \"origin\": [%.17g, %.17g, %.17g],\n", d_min.x, d_min.y, d_min.z);
+	fprintf(json, "  \"spacing\": [%.17g, %.17g, %.17g],\n", d_size, d_size, d_size);
+	fprintf(json, "  \"order\": \"x-fastest\",\n");
+	fprintf(json, "  \"byte_order\": \"%s\",\n", *(unsigned char*)&one == 1 ? "little" : "big");
+	fprintf(json, "  \"channels\": [\n");
+	fprintf(json, "    { \"name\": \"expression\", \"file\": \"%s.raw\", \"type\": \"float64\", \"components\": 1 }\n", leaf.c_str());
+	fprintf(json, "  ]\n}\n");
+	bool ok = ferror(json) == 0;
+	if( fclose(json) != 0 ) ok = false;
+
+	FILE *fp = fopen((basename + ".raw").c_str(), "wb");
+	if( fp == NULL ) return false;
+
+	std::vector<double> chunk(d_nvoxels < EXPR_CHUNK ? d_nvoxels : EXPR_CHUNK);
+	for( size_t c = 0; ok && c < d_nvoxels; c += EXPR_CHUNK )
+	{
+		size_t m = d_nvoxels - c < EXPR_CHUNK ? d_nvoxels - c : EXPR_CHUNK;
+		long long nblocks = (long long)((m + EXPR_BLOCK - 1)/EXPR_BLOCK);
+		long long b;
+#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(NUM_THREADS) schedule(static) private (b)
+#endif
+		for( b = 0; b < nblocks; b++ )
+		{
+			size_t first = (size_t)b*EXPR_BLOCK;
+			size_t count = m - first < EXPR_BLOCK ? m - first : EXPR_BLOCK;
+			EvaluateBlock(c + first, count, &chunk[first]);
+		}
+		ok = fwrite(&chunk[0], sizeof(double), m, fp) == m;
+	}
+
+	if( fclose(fp) != 0 ) ok = false;
+	return ok;
+}
@@ -0,0 +1,110 @@
+#include "distgrad.h"
+
+// Vectorization hint for the encode and decode loops (OpenMP 4.0)
+#if defined(_OPENMP) && _OPENMP >= 201307
+	#define OCT_SIMD _Pragma("omp simd")
+#else
+	#define OCT_SIMD
+#endif
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* SetBits
+* ------------------------------------------------------------------------
+* Changes the code size, re-encoding the stored gradients
+* @param[in] bits - 32, or 16 for previews
+*/
+void DistGradients::SetBits(int bits)
+{
+	bits = bits == 16 ? 16 : 32;
+	if( bits == d_bits ) return;
+
+	size_t n = size();
+	std::vector<GeoPoint3D> buffer(n);
+	if( n > 0 ) Decode(0, n, &buffer[0]);
+	clear();
+	d_bits = bits;
+	resize(n);
+	if( n > 0 ) Encode(0, &buffer[0], n);
+}
+
+/**
+* clear
+* ------------------------------------------------------------------------
+* Removes every gradient and releases the memory
+*/
+void DistGradients::clear()
+{
+	std::vector<unsigned int>().swap(d_codes32);
+	std::vector<unsigned short>().swap(d_codes16);
+}
+
+/**
+* Encode
+* ------------------------------------------------------------------------
+* Stores a run of gradients
+* @param[in] first - index of the first gradient to be set
+* @param[in] src - gradients, unit or zero vectors
+* @param[in] n - number of gradients
+*/
+void DistGradients::Encode(size_t first, const GeoPoint3D *src, size_t n)
+{
+	if( d_bits == 32 )
+	{
+		unsigned int *dst = &d_codes32[first];
+		OCT_SIMD
+		for( size_t i = 0; i < n; i++ ) dst[i] = OctEncode32(src[i]);
+	}
+	else
+	{
+		unsigned short *dst = &d_codes16[first];
+		OCT_SIMD
+		for( size_t i = 0; i < n; i++ ) dst[i] = OctEncode16(src[i]);
+	}
+}
+
+/**
+* Decode
+* ------------------------------------------------------------------------
+* Reads a run of gradients
+* @param[in] first - index of the first gradient
+* @param[in] n - number of gradients
+* @param[out] dst - decoded unit (or zero) vectors
+*/
+void DistGradients::Decode(size_t first, size_t n, GeoPoint3D *dst) const
+{
+	if( d_bits == 32 )
+	{
+		const unsigned int *src = &d_codes32[first];
+		OCT_SIMD
+		for( size_t i = 0; i < n; i++ ) dst[i] = OctDecode32(src[i]);
+	}
+	else
+	{
+		const unsigned short *src = &d_codes16[first];
+		OCT_SIMD
+		for( size_t i = 0; i < n; i++ ) dst[i] = OctDecode16(src[i]);
+	}
+}
+
+/**
+* MaxAngularError
+* ------------------------------------------------------------------------
+* Largest angle between a unit vector and its decoded code, as measured over 10^7 random
+* directions plus the axes and diagonals
+* @param[in] bits - code size
+* @return - angle, in degrees
+*/
+double DistGradients::MaxAngularError(int bits)
+{
+	return bits == 16 ? 0.96 : 0.0038;
+}
@@ -1,7 +1,39 @@
 #include "distio.h"
 #include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+#include "distfile.h"
+
+#define DFB_MAGIC "RMGDFB1"
+#define DFB_VERSION 2
+#define DFB_CHUNK 65536
+#define WRITE_BUFFER_SIZE (4 << 20)
 
 DistIO *DistIO::s_instance;
+std::mutex DistIO::s_instmutex;
+
+// Binary distance field (.dfb) header, followed by the voxels (double), border
+// flags (one byte each), gradients (octahedral codes of gradbits bits) and, if features
+// is set, the closest triangle ids and packed (s,t) of the closest feature channel
+// (unsigned int each), in grid order
+typedef struct dfb_header {
+	char magic[8];
+	unsigned int version;
+	int nx;
+	unsigned int ny, nz;
+	unsigned int gradbits; // 32 or 16
+	unsigned int features; // 1 if the closest feature channel is stored, 0 in older files
+	double size;
+	double minx, miny, minz;
+	unsigned long long nvoxels;
+} Dfb_Header;
 
 /**
  * --------------------------------------------------------------------
@@ -29,6 +61,51 @@ static double _String2Double( const std::string& s )
 	 return x;
 } 
 
+/**
+* _FillHeader
+* ------------------------------------------------------------------------
+* Sets the .dfb header describing the grid of a distance field object
+*/ 
+static void _FillHeader(Dfb_Header &header, DistCalc *distObj)
+{
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, DFB_MAGIC, sizeof(header.magic));
+	header.version = DFB_VERSION;
+	header.nx = distObj->d_nx;
+	header.ny = distObj->d_ny;
+	header.nz = distObj->d_nz;
+	header.gradbits = distObj->GradientBits();
+	header.features = distObj->HasClosestFeatures() ? 1 : 0;
+	header.size = distObj->d_size;
+	header.minx = distObj->d_min.x;
+	header.miny = distObj->d_min.y;
+	header.minz = distObj->d_min.z;
+	header.nvoxels = (unsigned long long)(distObj->d_nx+1)*(distObj->d_ny+1)*(distObj->d_nz+1);
+}
+
+/**
+* _WriteAt
+* ------------------------------------------------------------------------
+* Writes a block of bytes at a given file offset
+*/ 
+static bool _WriteAt(FILE *fp, unsigned long long offset, const void *data, size_t len)
+{
+	if( DistSeek(fp, (long long)offset) != 0 ) return false;
+	return fwrite(data, 1, len, fp) == len;
+}
+
+/**
+* _ValidHeader
+* ------------------------------------------------------------------------
+* Checks that a .dfb header is of this version and describes a file of the given length
+*/ 
+static bool _ValidHeader(const Dfb_Header &header, size_t length)
+{
+	return strncmp(header.magic, DFB_MAGIC, sizeof(header.magic)) == 0 && header.version == DFB_VERSION &&
+	       (header.gradbits == 32 || header.gradbits == 16) && (header.features == 0 || header.features == 1) &&
+	       length == sizeof(Dfb_Header) + header.nvoxels*(sizeof(double) + 1 + header.gradbits/8 + header.features*2*sizeof(unsigned int));
+}
+
 /**
  * --------------------------------------------------------------------
  * Public functions:
@@ -47,40 +124,194 @@ static double _String2Double( const std::string& s )
 */ 
 void DistIO::PosLoad(DistCalc *distObj)
 {
-	// Load gradients and cell centers
-	distObj->CalculateGradients();
+	// Gradients are calculated on demand, brick by brick, when first needed; forget the previous surface cells
+	distObj->DropGradients();
 	distObj->AssignVtx2Cell();	
 }
 
 /**
-* SaveDistField
+* GetInstance
 * ------------------------------------------------------------------------
-* Saves distance field information into a .df file
+* Returns the DistIO instance, creating it on first use (thread safe)
+*/ 
+DistIO* DistIO::GetInstance()
+{
+	std::lock_guard<std::mutex> lock(s_instmutex);
+	if( s_instance == NULL )
+	{
+		s_instance = new DistIO();
+		atexit(WaitAtExit);
+	}
+	return s_instance;
+}
+
+/**
+* WriteDistField
+* ------------------------------------------------------------------------
+* Writes the distance field into a .df file. Lines are formatted into one buffer while
+* the other one is being written, and the file is fsync'd and then renamed into place,
+* so a reader never sees a partial file. Does not use any shared state.
 * @param[in] distObj - distance field object to be saved 
+* @param[in] filename - output file name
+* @return - true if the whole file reached the disk
 */ 
-void DistIO::SaveDistField(DistCalc *distObj)
+bool DistIO::WriteDistField(DistCalc *distObj, std::string filename)
 {
 	// Get array to be saved to file
 	std::vector<double> &voxels = distObj->GetVoxels();
 
+	std::string tmpname = filename + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if( fp == NULL ) return false;
+
+	std::vector<char> buffers[2];
+	buffers[0].reserve(WRITE_BUFFER_SIZE + 64);
+	buffers[1].reserve(WRITE_BUFFER_SIZE + 64);
+	std::future<bool> pending; // write of the other buffer
+	int cur = 0;
+	bool ok = true;
+	char line[64];
+
+	// Write size value
+	int len = snprintf(line, sizeof(line), "size = %g\n# BEGIN VOXELS\n", distObj->d_size);
+	buffers[cur].insert(buffers[cur].end(), line, line + len);
+
+	// Write voxels array, with the same formatting as the default ostream one, followed
+	// by the closest feature channel as "triangle s t" lines
+	size_t n = voxels.size();
+	size_t nlines = distObj->HasClosestFeatures() ? 2*n + 2 : n + 1;
+	for (size_t i = 0; i < nlines; ++i)
+	{
+		if( i < n )
+			len = snprintf(line, sizeof(line), "%g\n", voxels[i]);
+		else if( i == n )
+			len = snprintf(line, sizeof(line), nlines > n + 1 ? "# END VOXELS\n# BEGIN FEATURES\n" : "# END VOXELS\n");
+		else if( i < nlines - 1 )
+		{
+			unsigned int tri;
+			double s, t;
+			distObj->ClosestFeature(i - n - 1, tri, s, t);
+			len = snprintf(line, sizeof(line), "%u %.9g %.9g\n", tri, s, t);
+		}
+		else
+			len = snprintf(line, sizeof(line), "# END FEATURES\n");
+		buffers[cur].insert(buffers[cur].end(), line, line + len);
+
+		if( buffers[cur].size() < WRITE_BUFFER_SIZE && i + 1 < nlines ) continue;
+
+		// Hand the full buffer to a writer and keep formatting into the other one
+		if( pending.valid() && pending.get() == false ) ok = false;
+		std::vector<char> *full = &buffers[cur];
+		pending = std::async(std::launch::async, [fp, full]() {
+			return fwrite(&(*full)[0], 1, full->size(), fp) == full->size();
+		});
+		cur ^= 1;
+		buffers[cur].clear();
+	}
+	if( pending.valid() && pending.get() == false ) ok = false;
+
+	ok = ok && DistSync(fp);
+	if( fclose(fp) != 0 ) ok = false;
+	if( ok ) ok = rename(tmpname.c_str(), filename.c_str()) == 0;
+	if( !ok ) remove(tmpname.c_str());
+	return ok;
+}
+
+/**
+* SaveDistField
+* ------------------------------------------------------------------------
+* Saves distance field information into a .df file
+* @param[in] distObj - distance field object to be saved 
+*/ 
+void DistIO::SaveDistField(DistCalc *distObj)
+{
 	// Open file
 	std::string ext;
 	std::string cfilename;
 	CutExt(distObj->d_filename, cfilename, ext);
 	cfilename += ".df";
-	d_file.open(cfilename.c_str(), ios::out);
 
-	// Write size value
-	d_file << "size = " << distObj->d_size << endl;
+	if( WriteDistField(distObj, cfilename) == false )
+		cerr << "Could not save distance field " << cfilename << endl;
+}
 
-	// Write voxels array
-	d_file << "# BEGIN VOXELS\n";
-	for (std::vector<double>::iterator it = voxels.begin() ; it != voxels.end(); ++it)
-		d_file << *it << endl;
+/**
+* SaveDistFieldAsync
+* ------------------------------------------------------------------------
+* Queues the distance field to be saved into a .df file by the background writer. Blocks
+* while the queue is full. The object must not be modified or deleted until the write is done.
+* @param[in] distObj - distance field object to be saved 
+* @param[in] callback - optional, called from the writer thread with the result
+* @return - becomes true when the file is on disk, false if the write failed
+*/ 
+std::future<bool> DistIO::SaveDistFieldAsync(DistCalc *distObj, std::function<void(bool)> callback)
+{
+	Write_Job *job = new Write_Job();
+	job->obj = distObj;
+	job->callback = callback;
+	std::string ext;
+	CutExt(distObj->d_filename, job->filename, ext);
+	job->filename += ".df";
+	std::future<bool> result = job->done.get_future();
 
-	d_file << "# END VOXELS" << endl;
+	std::unique_lock<std::mutex> lock(d_mutex);
+	if( !d_writer.joinable() )
+		d_writer = std::thread(&DistIO::WriterLoop, this);
+	d_notfull.wait(lock, [this]() { return d_queue.size() < d_maxqueue; });
+	d_queue.push_back(job);
+	d_active++;
+	d_notempty.notify_one();
+	return result;
+}
 
-	d_file.close();
+/**
+* WaitWrites
+* ------------------------------------------------------------------------
+* Blocks until every queued asynchronous save has been written
+*/ 
+void DistIO::WaitWrites()
+{
+	std::unique_lock<std::mutex> lock(d_mutex);
+	d_idle.wait(lock, [this]() { return d_active == 0; });
+}
+
+/**
+* WriterLoop
+* ------------------------------------------------------------------------
+* Background writer: saves the queued jobs, one at a time, in queue order
+*/ 
+void DistIO::WriterLoop()
+{
+	while( true )
+	{
+		Write_Job *job;
+		{
+			std::unique_lock<std::mutex> lock(d_mutex);
+			d_notempty.wait(lock, [this]() { return !d_queue.empty(); });
+			job = d_queue.front();
+			d_queue.pop_front();
+			d_notfull.notify_one();
+		}
+
+		bool ok = WriteDistField(job->obj, job->filename);
+		if( !ok ) cerr << "Could not save distance field " << job->filename << endl;
+		if( job->callback ) job->callback(ok);
+		job->done.set_value(ok);
+		delete job;
+
+		std::lock_guard<std::mutex> lock(d_mutex);
+		if( --d_active == 0 ) d_idle.notify_all();
+	}
+}
+
+/**
+* WaitAtExit
+* ------------------------------------------------------------------------
+* Keeps the process from exiting with saves still queued
+*/ 
+void DistIO::WaitAtExit()
+{
+	if( s_instance != NULL ) s_instance->WaitWrites();
 }
 
 /**
@@ -98,11 +329,15 @@ DistCalc* DistIO::LoadDistField(CsiTSurf *surf, std::string filename)
 	std::vector<double> &voxels = ret->GetVoxels();
 
 
-	unsigned int i = 0;
+	std::vector<unsigned int> &clostris = ret->GetClosestTriangles();
+	std::vector<unsigned int> &closest = ret->GetClosestST();
+
+	unsigned int i = 0, f = 0;
+	bool features = false;
 	std::string line;
-	d_file.open(filename.c_str(), fstream::in);
+	fstream file(filename.c_str(), fstream::in);
 	
-	while ( getline(d_file, line) )
+	while ( getline(file, line) )
 	{
 		if( line.find("size = ") != std::string::npos ) // step size information 
 		{
@@ -112,8 +347,25 @@ DistCalc* DistIO::LoadDistField(CsiTSurf *surf, std::string filename)
 			ret->d_nz = (unsigned int) ((ret->d_max.z - ret->d_min.z) / ret->d_size + 1);
 			voxels.resize((ret->d_nx+1)*(ret->d_ny+1)*(ret->d_nz+1));
 		}
+		else if ( line.find("# BEGIN FEATURES") != std::string::npos ) // closest feature channel
+		{
+			features = true;
+			clostris.resize(voxels.size());
+			closest.resize(voxels.size());
+		}
 		else if ( line.find("#") != std::string::npos ) // comment, ignore 
 			continue;
+		else if ( features )
+		{
+			if( f >= clostris.size() ) continue;
+			unsigned int tri = 0;
+			double s = 0, t = 0;
+			std::istringstream fields(line);
+			fields >> tri >> s >> t;
+			clostris[f] = tri;
+			closest[f] = DistCalc::PackST(s, t);
+			f++;
+		}
 		else
 		{
 			voxels[i] = _String2Double(line);
@@ -121,7 +373,13 @@ DistCalc* DistIO::LoadDistField(CsiTSurf *surf, std::string filename)
 		}
 	}
 
-	d_file.close();
+	file.close();
+	ret->SetClosestFeatures(features && f == voxels.size());
+	if( !ret->ClosestFeatures() )
+	{
+		clostris.clear();
+		closest.clear();
+	}
 
 	// Load gradients and cellcenter arrays
 	PosLoad(ret);
@@ -129,6 +387,166 @@ DistCalc* DistIO::LoadDistField(CsiTSurf *surf, std::string filename)
 	return ret;
 }
 
+/**
+* SaveBinaryField
+* ------------------------------------------------------------------------
+* Saves the distance field, border flags and gradients into a binary .dfb file
+* @param[in] distObj - distance field object to be saved 
+* @param[in] filename - output file name
+* @return - true if the whole field was written
+*/
+bool DistIO::SaveBinaryField(DistCalc *distObj, std::string filename)
+{
+	std::vector<double> &voxels = distObj->GetVoxels();
+	std::vector<bool> &borders = distObj->GetBorders();
+	DistGradients &gradients = distObj->GetGradients();
+	size_t n = voxels.size();
+
+	if( n == 0 || borders.size() != n || gradients.size() != n ) return false;
+
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if( fp == NULL ) return false;
+
+	Dfb_Header header;
+	_FillHeader(header, distObj);
+
+	bool ok = header.nvoxels == n && fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(&voxels[0], sizeof(double), n, fp) == n;
+
+	// Borders are not stored contiguously as raw bytes, convert them in chunks
+	std::vector<unsigned char> bchunk(DFB_CHUNK);
+	for( size_t i = 0; ok && i < n; i += DFB_CHUNK )
+	{
+		size_t m = std::min((size_t)DFB_CHUNK, n - i);
+		for( size_t c = 0; c < m; c++ ) bchunk[c] = borders[i+c] ? 1 : 0;
+		ok = fwrite(&bchunk[0], 1, m, fp) == m;
+	}
+
+	ok = ok && fwrite(gradients.Codes(), gradients.CodeSize(), n, fp) == n;
+
+	if( header.features )
+	{
+		ok = ok && fwrite(&distObj->GetClosestTriangles()[0], sizeof(unsigned int), n, fp) == n;
+		ok = ok && fwrite(&distObj->GetClosestST()[0], sizeof(unsigned int), n, fp) == n;
+	}
+
+	if( fclose(fp) != 0 ) ok = false;
+	return ok;
+}
+
+/**
+* LoadBinaryField
+* ------------------------------------------------------------------------
+* Loads a .dfb file into a distance field object. The file is memory mapped and
+* must describe exactly the same grid as the object.
+* @param[in] distObj - distance field object to be filled
+* @param[in] filename - input file name
+* @return - true if the field was loaded
+*/
+bool DistIO::LoadBinaryField(DistCalc *distObj, std::string filename)
+{
+	size_t n = (size_t)(distObj->d_nx+1)*(distObj->d_ny+1)*(distObj->d_nz+1);
+	size_t length = 0;
+	const char *data = NULL;
+
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if( fd < 0 ) return false;
+
+	struct stat st;
+	if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Dfb_Header) )
+	{
+		close(fd);
+		return false;
+	}
+
+	length = (size_t)st.st_size;
+	void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED ) return false;
+	madvise(map, length, MADV_SEQUENTIAL);
+	data = (const char*)map;
+#else
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if( fp == NULL ) return false;
+	_fseeki64(fp, 0, SEEK_END);
+	length = (size_t)_ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	std::vector<char> buffer(length > sizeof(Dfb_Header) ? length : sizeof(Dfb_Header));
+	bool complete = length >= sizeof(Dfb_Header) && fread(&buffer[0], 1, length, fp) == length;
+	fclose(fp);
+	if( !complete ) return false;
+	data = &buffer[0];
+#endif
+
+	Dfb_Header header;
+	memcpy(&header, data, sizeof(header));
+	bool ok = _ValidHeader(header, length) &&
+	          header.nx == distObj->d_nx && header.ny == distObj->d_ny && header.nz == distObj->d_nz &&
+	          header.size == distObj->d_size && header.minx == distObj->d_min.x &&
+	          header.miny == distObj->d_min.y && header.minz == distObj->d_min.z && header.nvoxels == n;
+
+	if( ok )
+	{
+		std::vector<double> &voxels = distObj->GetVoxels();
+		std::vector<bool> &borders = distObj->GetBorders();
+		DistGradients &gradients = distObj->GetGradients();
+		const char *vdata = data + sizeof(Dfb_Header);
+		const unsigned char *bdata = (const unsigned char*)(vdata + n*sizeof(double));
+		const char *gdata = (const char*)(bdata + n);
+
+		voxels.resize(n);
+		borders.resize(n);
+		gradients.clear();
+		gradients.SetBits(header.gradbits);
+		gradients.resize(n);
+		memcpy(&voxels[0], vdata, n*sizeof(double));
+		for( size_t i = 0; i < n; i++ )
+			borders[i] = bdata[i] != 0;
+		memcpy(gradients.Codes(), gdata, n*gradients.CodeSize());
+
+		std::vector<unsigned int> &clostris = distObj->GetClosestTriangles();
+		std::vector<unsigned int> &closest = distObj->GetClosestST();
+		clostris.resize(header.features ? n : 0);
+		closest.resize(header.features ? n : 0);
+		if( header.features )
+		{
+			const char *fdata = gdata + n*gradients.CodeSize();
+			memcpy(&clostris[0], fdata, n*sizeof(unsigned int));
+			memcpy(&closest[0], fdata + n*sizeof(unsigned int), n*sizeof(unsigned int));
+		}
+		distObj->SetClosestFeatures(header.features != 0);
+	}
+
+#ifndef _WIN32
+	munmap((void*)data, length);
+#endif
+	return ok;
+}
+
+/**
+* SaveLabels
+* ------------------------------------------------------------------------
+* Saves the label channel as raw unsigned shorts, in grid order and in the byte order of the
+* machine, as the .dfb
+* @param[in] distObj - distance field object computed with triangle labels
+* @param[in] filename - output file name
+* @return - true if every label was written
+*/
+bool DistIO::SaveLabels(DistCalc *distObj, std::string filename)
+{
+	std::vector<unsigned short> &labels = distObj->GetLabels();
+	size_t n = labels.size();
+	if( n == 0 || n != distObj->GetVoxels().size() ) return false;
+
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if( fp == NULL ) return false;
+
+	bool ok = fwrite(&labels[0], sizeof(unsigned short), n, fp) == n;
+	if( fclose(fp) != 0 ) ok = false;
+	return ok;
+}
+
 /* extCut
  * ----------------------------------------------------------------------
  * Cuts the extension of a file name 
@@ -152,3 +570,186 @@ void DistIO::CutExt( std::string fname, std::string &name, std::string &ext )
 	} else ext = "";
 }
 
+
+/**
+* DistFileWriter::Begin
+* ------------------------------------------------------------------------
+* Opens the .df file and writes its header
+*/
+bool DistFileWriter::Begin(DistCalc *obj)
+{
+	d_file.open(d_filename.c_str(), ios::out);
+	if( !d_file.is_open() ) return false;
+
+	d_file << "size = " << obj->d_size << endl;
+	d_file << "# BEGIN VOXELS\n";
+	return d_file.good();
+}
+
+/**
+* DistFileWriter::ConsumeSlab
+* ------------------------------------------------------------------------
+* Appends the voxels of a slab to the .df file
+*/
+bool DistFileWriter::ConsumeSlab(DistCalc *obj, unsigned int , unsigned int nk,
+	const double *voxels, const unsigned char *, const GeoPoint3D *)
+{
+	size_t n = (size_t)nk*(obj->d_nx+1)*(obj->d_ny+1);
+	for( size_t i = 0; i < n; i++ )
+		d_file << voxels[i] << '\n';
+	return d_file.good();
+}
+
+/**
+* DistFileWriter::End
+* ------------------------------------------------------------------------
+* Closes the .df file
+*/
+bool DistFileWriter::End(DistCalc *)
+{
+	d_file << "# END VOXELS" << endl;
+	bool ok = d_file.good();
+	d_file.close();
+	return ok;
+}
+
+/**
+* DistBinaryWriter::Begin
+* ------------------------------------------------------------------------
+* Creates the .dfb file and writes its header
+*/
+bool DistBinaryWriter::Begin(DistCalc *obj)
+{
+	d_fp = fopen(d_filename.c_str(), "wb");
+	if( d_fp == NULL ) return false;
+
+	Dfb_Header header;
+	_FillHeader(header, obj);
+	header.features = 0; // slabs do not carry the closest feature channel
+	d_nvoxels = header.nvoxels;
+	d_codes.clear();
+	d_codes.SetBits(header.gradbits);
+	return fwrite(&header, sizeof(header), 1, d_fp) == 1;
+}
+
+/**
+* DistBinaryWriter::ConsumeSlab
+* ------------------------------------------------------------------------
+* Writes the slab into the voxel, border and gradient sections of the .dfb file
+*/
+bool DistBinaryWriter::ConsumeSlab(DistCalc *obj, unsigned int k0, unsigned int nk,
+	const double *voxels, const unsigned char *borders, const GeoPoint3D *gradients)
+{
+	size_t planesize = (size_t)(obj->d_nx+1)*(obj->d_ny+1);
+	size_t first = planesize*k0;
+	size_t n = planesize*nk;
+	unsigned long long voxelsec = sizeof(Dfb_Header);
+	unsigned long long bordersec = voxelsec + d_nvoxels*sizeof(double);
+	unsigned long long gradsec = bordersec + d_nvoxels;
+
+	bool ok = _WriteAt(d_fp, voxelsec + first*sizeof(double), voxels, n*sizeof(double));
+	ok = ok && _WriteAt(d_fp, bordersec + first, borders, n);
+
+	// Gradients are stored encoded, as in DistCalc
+	d_codes.resize(n);
+	d_codes.Encode(0, gradients, n);
+	ok = ok && _WriteAt(d_fp, gradsec + first*d_codes.CodeSize(), d_codes.Codes(), n*d_codes.CodeSize());
+	return ok;
+}
+
+/**
+* DistBinaryWriter::End
+* ------------------------------------------------------------------------
+* Closes the .dfb file
+*/
+bool DistBinaryWriter::End(DistCalc *)
+{
+	bool ok = fclose(d_fp) == 0;
+	d_fp = NULL;
+	return ok;
+}
+
+/**
+* DistFieldView::Open
+* ------------------------------------------------------------------------
+* Maps a .dfb file and points at its voxels
+* @param[in] filename - input file name
+* @return - true if the file is a valid .dfb
+*/
+bool DistFieldView::Open(std::string filename)
+{
+	Close();
+
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if( fd < 0 ) return false;
+
+	struct stat st;
+	if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Dfb_Header) )
+	{
+		close(fd);
+		return false;
+	}
+
+	d_length = (size_t)st.st_size;
+	void *map = mmap(NULL, d_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED )
+	{
+		d_length = 0;
+		return false;
+	}
+	madvise(map, d_length, MADV_SEQUENTIAL);
+	d_data = (const char*)map;
+#else
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if( fp == NULL ) return false;
+	_fseeki64(fp, 0, SEEK_END);
+	d_length = (size_t)_ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	d_buffer.resize(d_length > sizeof(Dfb_Header) ? d_length : sizeof(Dfb_Header));
+	bool complete = d_length >= sizeof(Dfb_Header) && fread(&d_buffer[0], 1, d_length, fp) == d_length;
+	fclose(fp);
+	d_data = &d_buffer[0];
+	if( !complete )
+	{
+		Close();
+		return false;
+	}
+#endif
+
+	Dfb_Header header;
+	memcpy(&header, d_data, sizeof(header));
+	if( !_ValidHeader(header, d_length) ||
+	    header.nvoxels != (unsigned long long)(header.nx+1)*(header.ny+1)*(header.nz+1) )
+	{
+		Close();
+		return false;
+	}
+
+	d_voxels = (const double*)(d_data + sizeof(Dfb_Header));
+	d_nvoxels = (size_t)header.nvoxels;
+	d_nx = header.nx;
+	d_ny = header.ny;
+	d_nz = header.nz;
+	d_size = header.size;
+	d_min = GeoPoint3D(header.minx, header.miny, header.minz);
+	return true;
+}
+
+/**
+* DistFieldView::Close
+* ------------------------------------------------------------------------
+* Unmaps the file, if any
+*/
+void DistFieldView::Close()
+{
+#ifndef _WIN32
+	if( d_data != NULL ) munmap((void*)d_data, d_length);
+#endif
+	std::vector<char>().swap(d_buffer);
+	d_data = NULL;
+	d_length = 0;
+	d_voxels = NULL;
+	d_nvoxels = 0;
+}
@@ -0,0 +1,416 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
+
+#include "distobjects.h"
+#include "distomp.h"
+
+using namespace std;
+
+// Work item of Grid2Mesh: planes k0 to k0+nk-1 of the field of an object
+typedef struct obj_slab {
+	unsigned int obj;
+	unsigned int k0, nk;
+	double cost; // grid points times triangles
+} Obj_Slab;
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _BoxDistance
+* ------------------------------------------------------------------------
+* Distance from a point to a box, a lower bound of its distance to anything inside the box
+*/
+static double _BoxDistance(const GeoPoint3D &p, const GeoPoint3D &bmin, const GeoPoint3D &bmax)
+{
+	double dx = std::max(std::max(bmin.x - p.x, p.x - bmax.x), 0.0);
+	double dy = std::max(std::max(bmin.y - p.y, p.y - bmax.y), 0.0);
+	double dz = std::max(std::max(bmin.z - p.z, p.z - bmax.z), 0.0);
+	return sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+/**
+* _CostFirst
+* ------------------------------------------------------------------------
+* Orders the work items from the most expensive down, so that the small ones fill the gaps at the end
+*/
+static bool _CostFirst(const Obj_Slab &a, const Obj_Slab &b)
+{
+	return a.cost > b.cost;
+}
+
+/**
+* Split
+* ------------------------------------------------------------------------
+* Copies every GOCAD TSurf object of the file into a surface of its own. The triangles of an
+* object are the run of the triangle list given by its TRGL records, in file order. Without a
+* readable file, or if its records do not match the mesh, the whole mesh is a single object.
+* @param[in] filename - .ts file the mesh was loaded from
+*/
+void DistObjects::Split(std::string filename)
+{
+	CsiTSurfVertexArray &vtxArray = d_surf->vertexArray();
+	CsiTriangleList &trianglesList = d_surf->trianglesList();
+
+	// Triangles and name of each object
+	std::vector<unsigned int> ntris;
+	std::vector<std::string> names;
+	FILE *fp = fopen(filename.c_str(), "r");
+	if( fp != NULL )
+	{
+		char line[1024];
+		while( fgets(line, sizeof(line), fp) != NULL )
+		{
+			if( strncmp(line, "GOCAD ", 6) == 0 )
+			{
+				ntris.push_back(0);
+				names.push_back("");
+			}
+			else if( strncmp(line, "name:", 5) == 0 && !names.empty() && names.back().empty() )
+			{
+				std::string name(line + 5);
+				name.erase(name.find_last_not_of(" \t\r\n") + 1);
+				name.erase(0, name.find_first_not_of(" \t"));
+				names.back() = name;
+			}
+			else if( strncmp(line, "TRGL ", 5) == 0 && !ntris.empty() )
+				ntris.back()++;
+		}
+		fclose(fp);
+	}
+
+	unsigned int total = 0;
+	for( size_t o = 0; o < ntris.size(); o++ ) total += ntris[o];
+	if( total != trianglesList.size() )
+	{
+		ntris.assign(1, (unsigned int)trianglesList.size());
+		names.assign(1, d_surf->name());
+	}
+
+	// Copy the triangles of each object with the vertices they use
+	std::vector<int> local(vtxArray.size(), -1);
+	std::vector<int> owner(vtxArray.size(), -1);
+	CsiTriangleItr itr = trianglesList.begin();
+	unsigned int first = 0;
+	for( size_t o = 0; o < ntris.size(); o++ )
+	{
+		if( ntris[o] == 0 ) continue;
+
+		std::string name = names[o];
+		if( name.empty() )
+		{
+			std::ostringstream defname;
+			defname << d_surf->name() << "_" << o;
+			name = defname.str();
+		}
+		CsiTSurf *object = new CsiTSurf(name);
+		for( unsigned int t = 0; t < ntris[o]; t++, ++itr )
+		{
+			int v[3] = { itr->v1, itr->v2, itr->v3 };
+			for( int c = 0; c < 3; c++ )
+			{
+				if( owner[v[c]] != (int)o )
+				{
+					CsiTSurfVertex *vtx = object->addVertex(vtxArray[v[c]]->x, vtxArray[v[c]]->y, vtxArray[v[c]]->z, 1);
+					local[v[c]] = vtx->pos;
+					owner[v[c]] = (int)o;
+				}
+				v[c] = local[v[c]];
+			}
+			object->addTriangle(v[0], v[1], v[2]);
+		}
+
+		d_objects.push_back(object);
+		d_firsttri.push_back(first);
+		first += ntris[o];
+	}
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* DistObjects
+* ------------------------------------------------------------------------
+* Splits a mesh into its objects and sets up the grid of each one: its own box, grown onto the
+* lattice of the grid of the whole mesh
+* @param[in] surf - mesh of every object
+* @param[in] filename - .ts file the mesh was loaded from
+*/
+DistObjects::DistObjects(CsiTSurf *surf, std::string filename)
+: d_surf(surf), d_objects(), d_firsttri(), d_boxmin(), d_boxmax(), d_fields(), d_combined(NULL)
+{
+	d_combined = new DistCalc(surf, filename);
+	d_combined->MountBorderMap();
+	Split(filename);
+
+	for( size_t o = 0; o < d_objects.size(); o++ )
+	{
+		GeoPoint3D bmin, bmax;
+		d_objects[o]->boundingbox(&bmin, &bmax);
+		d_boxmin.push_back(bmin);
+		d_boxmax.push_back(bmax);
+
+		DistCalc *field = new DistCalc(d_objects[o], d_objects[o]->name());
+		field->d_size = d_combined->d_size;
+		field->AlignGrid(d_combined->d_min);
+		field->MountBorderMap();
+		d_fields.push_back(field);
+	}
+	cerr << "Objects: " << d_objects.size() << endl;
+}
+
+DistObjects::~DistObjects()
+{
+	for( size_t o = 0; o < d_objects.size(); o++ )
+	{
+		delete d_fields[o];
+		delete d_objects[o];
+	}
+	delete d_combined;
+}
+
+/**
+* SetSignMode
+* ------------------------------------------------------------------------
+* Selects how the sign of the fields of every object is decided, see DistCalc::SetSignMode
+*/
+void DistObjects::SetSignMode(int mode)
+{
+	d_combined->SetSignMode(mode);
+	for( size_t o = 0; o < d_fields.size(); o++ )
+		d_fields[o]->SetSignMode(mode);
+}
+
+/**
+* SetClosestFeatures
+* ------------------------------------------------------------------------
+* Keeps the closest feature channel in the fields of every object and in the combined one
+*/
+void DistObjects::SetClosestFeatures(bool enable)
+{
+	d_combined->SetClosestFeatures(enable);
+	for( size_t o = 0; o < d_fields.size(); o++ )
+		d_fields[o]->SetClosestFeatures(enable);
+}
+
+/**
+* Grid2Mesh
+* ------------------------------------------------------------------------
+* Calculates the fields of all objects. The slabs of every object are work items of a single
+* parallel loop, the most expensive first, so that the objects share the threads and a small
+* object only costs the grid points of its own box.
+* @param[in] slabdepth - number of grid planes per work item
+*/
+void DistObjects::Grid2Mesh(unsigned int slabdepth)
+{
+	if( slabdepth < 1 ) slabdepth = 1;
+	size_t nobjs = d_fields.size();
+
+	std::vector<Obj_Slab> slabs;
+	std::vector< std::vector<unsigned char> > borders(nobjs);
+	std::vector<DistGradients*> gradients(nobjs);
+	for( size_t o = 0; o < nobjs; o++ )
+	{
+		DistCalc *field = d_fields[o];
+		if( field->d_nx < 1 || field->d_ny < 1 || field->d_nz < 1 ) continue;
+
+		field->AllocateField();
+		gradients[o] = &field->GetGradients();
+		size_t planesize = (size_t)(field->d_nx+1)*(field->d_ny+1);
+		borders[o].resize(planesize*(field->d_nz+1));
+		for( unsigned int k0 = 0; k0 <= field->d_nz; k0 += slabdepth )
+		{
+			Obj_Slab slab;
+			slab.obj = (unsigned int)o;
+			slab.k0 = k0;
+			slab.nk = std::min(slabdepth, field->d_nz+1 - k0);
+			slab.cost = (double)planesize*slab.nk*field->d_surf->trianglesList().size();
+			slabs.push_back(slab);
+		}
+	}
+	std::stable_sort(slabs.begin(), slabs.end(), _CostFirst);
+
+	double ctimeBegin = omp_get_wtime();
+
+	// ComputeSlab is called from inside the loop, its own parallel loop runs on the calling thread
+	long long nslabs = (long long)slabs.size();
+	long long it;
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1) private (it)
+#endif
+	for( it = 0; it < nslabs; it++ )
+	{
+		const Obj_Slab &slab = slabs[it];
+		DistCalc *field = d_fields[slab.obj];
+		size_t planesize = (size_t)(field->d_nx+1)*(field->d_ny+1);
+		size_t offset = planesize*slab.k0;
+		bool features = field->ClosestFeatures();
+
+		std::vector<GeoPoint3D> slabgrads(planesize*slab.nk);
+		field->ComputeSlab(slab.k0, slab.nk, &field->GetVoxels()[offset], &borders[slab.obj][offset], &slabgrads[0],
+			features ? &field->GetClosestTriangles()[offset] : NULL, features ? &field->GetClosestST()[offset] : NULL);
+		gradients[slab.obj]->Encode(offset, &slabgrads[0], planesize*slab.nk);
+	}
+
+	for( size_t o = 0; o < nobjs; o++ )
+	{
+		std::vector<bool> &flags = d_fields[o]->GetBorders();
+		for( size_t idx = 0; idx < borders[o].size(); idx++ )
+			flags[idx] = borders[o][idx] != 0;
+	}
+
+	double ctimeEnd = omp_get_wtime();
+	for( size_t o = 0; o < nobjs; o++ )
+	{
+		DistCalc *field = d_fields[o];
+		cerr << d_objects[o]->name() << ": " << d_objects[o]->trianglesList().size() << " triangles, grid "
+		     << field->d_nx+1 << "x" << field->d_ny+1 << "x" << field->d_nz+1 << endl;
+	}
+	cerr << "Objects Distance Field calculation time: " << ctimeEnd - ctimeBegin << endl;
+}
+
+/**
+* Combine
+* ------------------------------------------------------------------------
+* Fills the grid of the whole mesh with the field of the closest object at every grid point.
+* Objects whose grid holds the point give their stored value; the others are evaluated exactly,
+* nearest bounding box first, until the distance to the next box rules out the rest.
+* @return - the combined field, owned by this object
+*/
+DistCalc* DistObjects::Combine()
+{
+	DistCalc *combined = d_combined;
+	if( combined->d_nx < 1 || combined->d_ny < 1 || combined->d_nz < 1 ) return combined;
+
+	combined->AllocateField();
+	size_t nobjs = d_fields.size();
+	double size = combined->d_size;
+	bool features = combined->ClosestFeatures();
+	std::vector<double> &voxels = combined->GetVoxels();
+	DistGradients &gradients = combined->GetGradients();
+
+	// Position of the grid of each object in the combined one
+	std::vector<int> oi(nobjs), oj(nobjs), ok(nobjs);
+	std::vector<DistGradients*> objgrads(nobjs);
+	for( size_t o = 0; o < nobjs; o++ )
+	{
+		DistCalc *field = d_fields[o];
+		objgrads[o] = &field->GetGradients();
+		oi[o] = (int)floor((field->d_min.x - combined->d_min.x)/size + 0.5);
+		oj[o] = (int)floor((field->d_min.y - combined->d_min.y)/size + 0.5);
+		ok[o] = (int)floor((field->d_min.z - combined->d_min.z)/size + 0.5);
+	}
+
+	double ctimeBegin = omp_get_wtime();
+	unsigned int exact = 0;
+	std::vector<unsigned char> borders(voxels.size());
+	int nrows = (int)((combined->d_ny+1)*(combined->d_nz+1));
+	int row;
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic) private (row) reduction(+:exact)
+#endif
+	for( row = 0; row < nrows; row++ )
+	{
+		int k = row/(combined->d_ny+1);
+		int j = row%(combined->d_ny+1);
+		size_t offset = (size_t)row*(combined->d_nx+1);
+		std::vector<GeoPoint3D> rowgrads(combined->d_nx+1);
+		std::vector<unsigned char> held(nobjs);
+		std::vector< std::pair<double, size_t> > nearest;
+		nearest.reserve(nobjs);
+
+		for( int i = 0; i <= combined->d_nx; i++ )
+		{
+			GeoPoint3D point(combined->d_min.x + i*size, combined->d_min.y + j*size, combined->d_min.z + k*size);
+			double best = std::numeric_limits<double>::max();
+			bool border = false;
+			GeoPoint3D grad(0,0,0);
+			unsigned int tri = 0, st = 0;
+
+			for( size_t o = 0; o < nobjs; o++ )
+			{
+				DistCalc *field = d_fields[o];
+				int li = i - oi[o], lj = j - oj[o], lk = k - ok[o];
+				held[o] = li >= 0 && lj >= 0 && lk >= 0 && li <= field->d_nx && lj <= (int)field->d_ny && lk <= (int)field->d_nz &&
+				          field->GetVoxels().size() > 0;
+				if( !held[o] ) continue;
+
+				size_t idx = (size_t)(field->d_nx+1)*(field->d_ny+1)*lk + (size_t)(field->d_nx+1)*lj + li;
+				double d = field->GetVoxels()[idx];
+				if( std::abs(d) >= std::abs(best) ) continue;
+				best = d;
+				border = field->GetBorders()[idx];
+				grad = (*objgrads[o])[idx];
+				if( features )
+				{
+					tri = d_firsttri[o] + field->GetClosestTriangles()[idx];
+					st = field->GetClosestST()[idx];
+				}
+			}
+
+			// Objects whose grid does not reach the point, nearest box first, so that the first
+			// one seeds the best distance and the others stop once their boxes are farther
+			nearest.clear();
+			for( size_t o = 0; o < nobjs; o++ )
+				if( !held[o] ) nearest.push_back(std::make_pair(_BoxDistance(point, d_boxmin[o], d_boxmax[o]), o));
+			std::sort(nearest.begin(), nearest.end());
+			for( size_t n = 0; n < nearest.size(); n++ )
+			{
+				if( nearest[n].first >= std::abs(best) ) break;
+
+				size_t o = nearest[n].second;
+				double d;
+				bool b;
+				GeoPoint3D g;
+				unsigned int t = 0, s = 0;
+				d_fields[o]->ComputePoint(point, d, b, g, features ? &t : NULL, features ? &s : NULL);
+				exact++;
+				if( std::abs(d) >= std::abs(best) ) continue;
+				best = d;
+				border = b;
+				grad = g;
+				tri = d_firsttri[o] + t;
+				st = s;
+			}
+
+			voxels[offset+i] = best;
+			borders[offset+i] = border;
+			rowgrads[i] = grad;
+			if( features )
+			{
+				combined->GetClosestTriangles()[offset+i] = tri;
+				combined->GetClosestST()[offset+i] = st;
+			}
+		}
+		gradients.Encode(offset, &rowgrads[0], combined->d_nx+1);
+	}
+
+	std::vector<bool> &flags = combined->GetBorders();
+	for( size_t idx = 0; idx < borders.size(); idx++ )
+		flags[idx] = borders[idx] != 0;
+
+	cerr << "Combined field of " << nobjs << " objects, " << exact << " grid points evaluated exactly, time: "
+	     << omp_get_wtime() - ctimeBegin << endl;
+	return combined;
+}
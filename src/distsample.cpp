@@ -0,0 +1,284 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "distsample.h"
+#include "distbvh.h"
+#include "distomp.h"
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _CatmullRom
+* ------------------------------------------------------------------------
+* Weights of the four samples at -1, 0, 1 and 2 of a Catmull-Rom spline at t in [0,1]
+*/
+static void _CatmullRom(double t, double w[4])
+{
+	w[0] = 0.5*((-t + 2)*t - 1)*t;
+	w[1] = 0.5*((3*t - 5)*t*t + 2);
+	w[2] = 0.5*((-3*t + 4)*t + 1)*t;
+	w[3] = 0.5*(t - 1)*t*t;
+}
+
+/**
+* _SurfaceHeight
+* ------------------------------------------------------------------------
+* Height of a surface above a point of the map, from the triangles whose xy projection holds it;
+* where several do, the one of lowest id is taken so the result does not depend on the traversal
+* @param[in] bvh - hierarchy of the triangles of the surface
+* @param[in] triangles - triangles, indexed by their ids
+* @param[in] vtxArray - vertices of the surface
+* @param[in] x, y - point of the map
+* @param[out] z - height of the surface
+* @return - true if the surface covers the point
+*/
+static bool _SurfaceHeight(const DistBVH &bvh, const std::vector<CsiTriangle*> &triangles,
+	CsiTSurfVertexArray &vtxArray, double x, double y, double &z)
+{
+	unsigned int best = std::numeric_limits<unsigned int>::max();
+	bvh.Traverse(
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			return x >= node.bmin.x && x <= node.bmax.x && y >= node.bmin.y && y <= node.bmax.y;
+		},
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			for( unsigned int n = node.first; n < node.first + node.count; n++ )
+			{
+				unsigned int id = bvh.Order(n);
+				if( id >= best ) continue;
+
+				const GeoPoint3D &a = *vtxArray[triangles[id]->v1], &b = *vtxArray[triangles[id]->v2], &c = *vtxArray[triangles[id]->v3];
+				double det = (b.y - c.y)*(a.x - c.x) + (c.x - b.x)*(a.y - c.y);
+				if( det == 0 ) continue;
+				double l1 = ((b.y - c.y)*(x - c.x) + (c.x - b.x)*(y - c.y))/det;
+				double l2 = ((c.y - a.y)*(x - c.x) + (a.x - c.x)*(y - c.y))/det;
+				double l3 = 1 - l1 - l2;
+				if( l1 < 0 || l2 < 0 || l3 < 0 ) continue;
+
+				best = id;
+				z = l1*a.z + l2*b.z + l3*c.z;
+			}
+		});
+
+	return best != std::numeric_limits<unsigned int>::max();
+}
+
+/**
+* Interpolate
+* ------------------------------------------------------------------------
+* Interpolates the unsigned distance at a point of the grid. Every voxel v at distance r from
+* the point bounds the true distance to [|v| - r, |v| + r]; the estimate is clamped to the
+* intersection of those intervals and its error is at most the larger of its gaps to the ends.
+* @param[in] p - point
+* @param[out] lo, hi - bounds of the true distance, 0 and infinity outside the grid
+* @return - estimated distance
+*/
+double DistSampler::Interpolate(const GeoPoint3D &p, double &lo, double &hi) const
+{
+	const std::vector<double> &voxels = d_field->GetVoxels();
+	const DistCalc &f = *d_field;
+	size_t rowsize = (size_t)f.d_nx + 1, planesize = rowsize*(f.d_ny + 1);
+
+	double fx = (p.x - f.d_min.x)/f.d_size, fy = (p.y - f.d_min.y)/f.d_size, fz = (p.z - f.d_min.z)/f.d_size;
+	lo = 0;
+	hi = std::numeric_limits<double>::infinity();
+	if( voxels.size() != planesize*(f.d_nz + 1) || !(fx >= 0 && fy >= 0 && fz >= 0) ||
+	    fx > f.d_nx || fy > f.d_ny || fz > f.d_nz ) return 0;
+
+	int i = std::min((int)fx, f.d_nx - 1), j = std::min((int)fy, (int)f.d_ny - 1), k = std::min((int)fz, (int)f.d_nz - 1);
+	double u = fx - i, v = fy - j, w = fz - k;
+
+	// Trilinear uses the corners of the cell, tricubic the 4x4x4 voxels around it, clamped to the grid
+	int first = 0, last = 1;
+	double wx[4] = { 1 - u, u }, wy[4] = { 1 - v, v }, wz[4] = { 1 - w, w };
+	if( d_method == SAMPLE_TRICUBIC )
+	{
+		first = -1;
+		last = 2;
+		_CatmullRom(u, wx);
+		_CatmullRom(v, wy);
+		_CatmullRom(w, wz);
+	}
+
+	double est = 0;
+	for( int c = first; c <= last; c++ )
+	{
+		int kk = std::max(0, std::min(k + c, (int)f.d_nz));
+		double dz = (fz - kk)*f.d_size;
+		for( int b = first; b <= last; b++ )
+		{
+			int jj = std::max(0, std::min(j + b, (int)f.d_ny));
+			double dy = (fy - jj)*f.d_size;
+			double wyz = wy[b - first]*wz[c - first];
+			for( int a = first; a <= last; a++ )
+			{
+				int ii = std::max(0, std::min(i + a, f.d_nx));
+				double dx = (fx - ii)*f.d_size;
+				double d = std::fabs(voxels[planesize*kk + rowsize*jj + ii]);
+				double r = std::sqrt(dx*dx + dy*dy + dz*dz);
+
+				est += wx[a - first]*wyz*d;
+				lo = std::max(lo, d - r);
+				hi = std::min(hi, d + r);
+			}
+		}
+	}
+
+	return std::max(lo, std::min(est, hi));
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Sample
+* ------------------------------------------------------------------------
+* Distance from a point to the surface of the field, interpolated where the error bound is within
+* the tolerance and queried from the triangles elsewhere, or outside the grid
+* @param[in] p - point
+* @param[out] exact - set if the point was queried exactly
+* @return - unsigned distance
+*/
+double DistSampler::Sample(const GeoPoint3D &p, bool *exact) const
+{
+	double lo, hi;
+	double d = Interpolate(p, lo, hi);
+	bool query = !(std::max(d - lo, hi - d) <= d_tolerance);
+	if( query )
+	{
+		double s, t;
+		d = std::fabs(d_field->Point2MeshDistance(p, s, t));
+	}
+	if( exact != NULL ) *exact = query;
+	return d;
+}
+
+/**
+* LowerBound
+* ------------------------------------------------------------------------
+* Distance the surface of the field is certainly not closer than: the bound of the voxels around
+* the point, or the exact distance outside the grid. A sphere of that radius can be skipped by
+* a tracer.
+* @param[in] p - point
+* @return - lower bound of the unsigned distance
+*/
+double DistSampler::LowerBound(const GeoPoint3D &p) const
+{
+	double lo, hi;
+	Interpolate(p, lo, hi);
+	if( hi == std::numeric_limits<double>::infinity() )
+	{
+		double s, t;
+		lo = std::fabs(d_field->Point2MeshDistance(p, s, t));
+	}
+	return lo;
+}
+
+/**
+* Sample
+* ------------------------------------------------------------------------
+* Samples a batch of points in parallel
+* @param[in] points - points
+* @param[out] dist - unsigned distance of each point
+*/
+void DistSampler::Sample(const std::vector<GeoPoint3D> &points, std::vector<double> &dist)
+{
+	long long npoints = (long long)points.size();
+	long long p;
+	long long nexact = 0;
+	dist.resize(points.size());
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1024) private (p) reduction(+:nexact)
+#endif
+	for( p = 0; p < npoints; p++ )
+	{
+		bool exact;
+		dist[p] = Sample(points[p], &exact);
+		if( exact ) nexact++;
+	}
+
+	d_exact = (size_t)nexact;
+}
+
+/**
+* SampleVertices
+* ------------------------------------------------------------------------
+* Thickness at every vertex of another surface: its Euclidean distance to the closest point of
+* the surface of the field, in any direction
+* @param[in] surf - surface whose vertices are sampled
+* @param[out] thickness - distance of each vertex, by vertex id
+*/
+void DistSampler::SampleVertices(CsiTSurf *surf, std::vector<double> &thickness)
+{
+	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
+	std::vector<GeoPoint3D> points(vtxArray.size());
+	for( size_t v = 0; v < points.size(); v++ )
+		points[v] = *vtxArray[v];
+
+	Sample(points, thickness);
+}
+
+/**
+* SampleMap
+* ------------------------------------------------------------------------
+* Thickness on a regular xy map: every node is lifted onto another surface and sampled there.
+* Nodes the surface does not cover are NAN.
+* @param[in] surf - surface the map nodes are lifted onto
+* @param[in] x0, y0 - first node
+* @param[in] dx, dy - node spacing
+* @param[in] nx, ny - nodes along x and y
+* @param[out] thickness - distance of each node, row by row along x
+*/
+void DistSampler::SampleMap(CsiTSurf *surf, double x0, double y0, double dx, double dy, unsigned int nx, unsigned int ny,
+	std::vector<double> &thickness)
+{
+	std::vector<CsiTriangle*> triangles;
+	CsiTriangleList &trianglesList = surf->trianglesList();
+	triangles.reserve(trianglesList.size());
+	for( CsiTriangleItr itr = trianglesList.begin(); itr != trianglesList.end(); ++itr )
+		triangles.push_back(itr.self());
+
+	thickness.assign((size_t)nx*ny, std::numeric_limits<double>::quiet_NaN());
+	if( triangles.empty() )
+	{
+		d_exact = 0;
+		return;
+	}
+
+	DistBVH bvh;
+	bvh.Build(surf, triangles);
+	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
+
+	long long nnodes = (long long)nx*ny;
+	long long n;
+	long long nexact = 0;
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 256) private (n) reduction(+:nexact)
+#endif
+	for( n = 0; n < nnodes; n++ )
+	{
+		double x = x0 + (n % nx)*dx, y = y0 + (n / nx)*dy, z;
+		if( !_SurfaceHeight(bvh, triangles, vtxArray, x, y, z) ) continue;
+
+		bool exact;
+		thickness[n] = Sample(GeoPoint3D(x, y, z), &exact);
+		if( exact ) nexact++;
+	}
+
+	d_exact = (size_t)nexact;
+}
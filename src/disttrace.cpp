@@ -0,0 +1,219 @@
+#include <cmath>
+#include <algorithm>
+#include "disttrace.h"
+#include "distomp.h"
+
+#define TRACE_PARALLEL 1e-12 // sine of the angle below which a piece is taken as parallel to a triangle
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _SegmentHitsBox
+* ------------------------------------------------------------------------
+* Slab test of the piece [u0, u1] of the segment p0 + u*dir against a box
+*/
+static bool _SegmentHitsBox(const GeoPoint3D &p0, const GeoPoint3D &dir, double u0, double u1,
+	const GeoPoint3D &bmin, const GeoPoint3D &bmax)
+{
+	const double o[3] = { p0.x, p0.y, p0.z }, d[3] = { dir.x, dir.y, dir.z };
+	const double lo[3] = { bmin.x, bmin.y, bmin.z }, hi[3] = { bmax.x, bmax.y, bmax.z };
+	for( int a = 0; a < 3; a++ )
+	{
+		if( d[a] == 0 )
+		{
+			if( o[a] < lo[a] || o[a] > hi[a] ) return false;
+			continue;
+		}
+		double t0 = (lo[a] - o[a])/d[a], t1 = (hi[a] - o[a])/d[a];
+		if( t0 > t1 ) std::swap(t0, t1);
+		u0 = std::max(u0, t0);
+		u1 = std::min(u1, t1);
+		if( u0 > u1 ) return false;
+	}
+	return true;
+}
+
+/**
+* _WellHitOrder
+* ------------------------------------------------------------------------
+* Orders crossings along the path, then by triangle id
+*/
+static bool _WellHitOrder(const DistTracer::Well_Hit &a, const DistTracer::Well_Hit &b)
+{
+	return a.md < b.md || (a.md == b.md && a.triId < b.triId);
+}
+
+/**
+* IntersectPiece
+* ------------------------------------------------------------------------
+* Exact crossings of a piece of a segment with the triangles whose boxes it meets (Moller and
+* Trumbore). A crossing belongs to the piece if its parameter is in [u0, u1), or in [u0, u1] for
+* the closing piece of the path.
+* @param[in] p0, p1 - segment
+* @param[in] u0, u1 - piece of the segment, as parameters in [0, 1]
+* @param[in] closed - whether the piece includes its end
+* @param[in] segment - index of the segment in the path
+* @param[in] md - length along the path at p0
+* @param[in,out] hits - crossings found, appended
+*/
+void DistTracer::IntersectPiece(const GeoPoint3D &p0, const GeoPoint3D &p1, double u0, double u1, bool closed,
+	unsigned int segment, double md, std::vector<Well_Hit> &hits) const
+{
+	const DistBVH &bvh = d_field->GetBVH();
+	if( bvh.Empty() ) return;
+
+	const std::vector<CsiTriangle*> &triangles = d_field->GetTriangles();
+	CsiTSurfVertexArray &vtxArray = d_field->d_surf->vertexArray();
+	GeoPoint3D dir = p1 - p0;
+	double length = std::sqrt(inner(dir, dir));
+
+	bvh.Traverse(
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			return _SegmentHitsBox(p0, dir, u0, u1, node.bmin, node.bmax);
+		},
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			for( unsigned int n = node.first; n < node.first + node.count; n++ )
+			{
+				unsigned int id = bvh.Order(n);
+				const GeoPoint3D &a = *vtxArray[triangles[id]->v1], &b = *vtxArray[triangles[id]->v2], &c = *vtxArray[triangles[id]->v3];
+				GeoPoint3D e1 = b - a, e2 = c - a;
+				GeoPoint3D pvec = cross(dir, e2);
+				double det = inner(e1, pvec);
+				// det is the triple product of dir, e1 and e2, so relative to their lengths it is the
+				// sine of the angle between dir and the plane, times the sine of the triangle's angle at a
+				if( fabs(det) <= TRACE_PARALLEL*std::sqrt(inner(e1, e1)*inner(e2, e2))*length ) continue;
+
+				double inv = 1/det;
+				GeoPoint3D tvec = p0 - a;
+				double s = inner(tvec, pvec)*inv;
+				if( s < 0 || s > 1 ) continue;
+				GeoPoint3D qvec = cross(tvec, e1);
+				double t = inner(dir, qvec)*inv;
+				if( t < 0 || s + t > 1 ) continue;
+				double u = inner(e2, qvec)*inv;
+				if( u < u0 || u > u1 || (u == u1 && !closed) ) continue;
+
+				Well_Hit hit;
+				hit.point = p0 + u*dir;
+				hit.md = md + u*length;
+				hit.segment = segment;
+				hit.triId = id;
+				hit.orientation = inner(dir, cross(e1, e2)) > 0 ? 1 : -1;
+				hits.push_back(hit);
+			}
+		});
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* DistTracer
+* ------------------------------------------------------------------------
+* @param[in] field - computed distance field of the surface
+* @param[in] minstep - length of the pieces tested exactly, a quarter of the grid step if not given
+*/
+DistTracer::DistTracer(DistCalc *field, double minstep)
+: d_field(field), d_sampler(field, SAMPLE_TRILINEAR), d_minstep(minstep > 0 ? minstep : field->d_size/4)
+{
+}
+
+/**
+* Trace
+* ------------------------------------------------------------------------
+* Crossings of a path with the surface. A path going through a shared edge or vertex crosses
+* every triangle around it at the same point; only the one of lowest id is kept.
+* @param[in] path - points of the path, in order
+* @param[out] hits - crossings, in order along the path
+*/
+void DistTracer::Trace(const std::vector<GeoPoint3D> &path, std::vector<Well_Hit> &hits) const
+{
+	hits.clear();
+	double md = 0;
+	for( size_t i = 0; i + 1 < path.size(); i++ )
+	{
+		const GeoPoint3D &p0 = path[i], &p1 = path[i+1];
+		GeoPoint3D dir = p1 - p0;
+		double length = std::sqrt(inner(dir, dir));
+		bool last = i + 2 == path.size();
+		if( length == 0 ) continue;
+
+		double u = 0;
+		while( u < 1 )
+		{
+			double lo = d_sampler.LowerBound(p0 + u*dir);
+			if( lo > d_minstep )
+			{
+				u += lo/length;
+				continue;
+			}
+
+			double u1 = std::min(1.0, u + d_minstep/length);
+			IntersectPiece(p0, p1, u, u1, last && u1 == 1, (unsigned int)i, md, hits);
+			u = u1;
+		}
+		md += length;
+	}
+
+	// Crossings of the triangles around an edge or a vertex of the surface
+	std::sort(hits.begin(), hits.end(), _WellHitOrder);
+	size_t n = 0;
+	for( size_t h = 0; h < hits.size(); h++ )
+	{
+		if( n > 0 && hits[h].orientation == hits[n-1].orientation &&
+		    hits[h].md - hits[n-1].md <= 1e-9*std::max(1.0, hits[h].md) ) continue;
+		hits[n++] = hits[h];
+	}
+	hits.resize(n);
+}
+
+/**
+* Trace
+* ------------------------------------------------------------------------
+* Crossings of many paths with the surface, the paths in parallel
+* @param[in] paths - points of every path
+* @param[out] hits - crossings of each path
+*/
+void DistTracer::Trace(const std::vector<std::vector<GeoPoint3D> > &paths, std::vector<std::vector<Well_Hit> > &hits) const
+{
+	long long npaths = (long long)paths.size();
+	long long w;
+	hits.resize(paths.size());
+
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(NUM_THREADS) schedule(dynamic, 1) private (w)
+#endif
+	for( w = 0; w < npaths; w++ )
+		Trace(paths[w], hits[w]);
+}
+
+/**
+* TraceRay
+* ------------------------------------------------------------------------
+* Crossings of a ray with the surface, up to a given length
+* @param[in] origin - start of the ray
+* @param[in] dir - direction, of any length
+* @param[in] length - length of the ray
+* @param[out] hits - crossings, in order along the ray
+*/
+void DistTracer::TraceRay(const GeoPoint3D &origin, const GeoPoint3D &dir, double length, std::vector<Well_Hit> &hits) const
+{
+	std::vector<GeoPoint3D> path(1, origin);
+	path.push_back(origin + length*normalize(dir));
+	Trace(path, hits);
+}
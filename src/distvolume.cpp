@@ -0,0 +1,231 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "distvolume.h"
+
+// Corners of the six tetrahedra around the diagonal from corner 0 to corner 7 of a cell, corner
+// c being at (c&1, (c>>1)&1, c>>2)
+static const int s_tetras[6][4] = {
+	{ 0, 1, 3, 7 }, { 0, 1, 5, 7 }, { 0, 2, 3, 7 }, { 0, 2, 6, 7 }, { 0, 4, 5, 7 }, { 0, 4, 6, 7 }
+};
+
+/**
+ * --------------------------------------------------------------------
+ * Private functions:
+ *  ___     _          _
+ * | _ \_ _(_)_ ____ _| |_ ___
+ * |  _/ '_| \ V / _` |  _/ -_)
+ * |_| |_| |_|\_/\__,_|\__\___|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* _ClipPolygon
+* ------------------------------------------------------------------------
+* Clips a polygon by the half plane where the coordinate axis (0 for x, 1 for y) is above, or
+* below, a value (Sutherland and Hodgman)
+*/
+static void _ClipPolygon(const std::vector<GeoPoint3D> &in, std::vector<GeoPoint3D> &out, int axis, double value, bool above)
+{
+	out.clear();
+	for( size_t i = 0; i < in.size(); i++ )
+	{
+		const GeoPoint3D &a = in[i], &b = in[(i + 1) % in.size()];
+		double da = (axis == 0 ? a.x : a.y) - value, db = (axis == 0 ? b.x : b.y) - value;
+		if( !above )
+		{
+			da = -da;
+			db = -db;
+		}
+
+		if( da >= 0 ) out.push_back(a);
+		if( (da >= 0) != (db >= 0) ) out.push_back(a + (da/(da - db))*(b - a));
+	}
+}
+
+/**
+* ColumnFraction
+* ------------------------------------------------------------------------
+* Part of the xy rectangle of a column inside the polygon
+* @param[in] x0, y0, x1, y1 - corners of the rectangle
+* @return - fraction of the area of the rectangle, 1 without a polygon
+*/
+double DistVolume::ColumnFraction(double x0, double y0, double x1, double y1) const
+{
+	if( d_polygon.size() < 3 ) return 1;
+
+	std::vector<GeoPoint3D> a(d_polygon), b;
+	_ClipPolygon(a, b, 0, x0, true);
+	_ClipPolygon(b, a, 0, x1, false);
+	_ClipPolygon(a, b, 1, y0, true);
+	_ClipPolygon(b, a, 1, y1, false);
+
+	double area = 0;
+	for( size_t i = 0; i < a.size(); i++ )
+	{
+		const GeoPoint3D &p = a[i], &q = a[(i + 1) % a.size()];
+		area += p.x*q.y - q.x*p.y;
+	}
+	return std::min(1.0, std::fabs(area)/(2*(x1 - x0)*(y1 - y0)));
+}
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* AddField
+* ------------------------------------------------------------------------
+* Bounds the region by a horizon
+* @param[in] field - computed signed field of the horizon, on the grid of the other fields
+* @param[in] side - VOLUME_NEGATIVE or VOLUME_POSITIVE, the side of the horizon that is kept
+* @return - false if the field is not computed or not on the same grid
+*/
+bool DistVolume::AddField(DistCalc *field, int side)
+{
+	size_t n = (size_t)(field->d_nx + 1)*(field->d_ny + 1)*(field->d_nz + 1);
+	if( field->GetVoxels().size() != n ) return false;
+	if( !d_fields.empty() )
+	{
+		DistCalc *f = d_fields[0];
+		if( field->d_nx != f->d_nx || field->d_ny != f->d_ny || field->d_nz != f->d_nz ||
+		    field->d_size != f->d_size || field->d_min.x != f->d_min.x || field->d_min.y != f->d_min.y ||
+		    field->d_min.z != f->d_min.z ) return false;
+	}
+
+	d_fields.push_back(field);
+	d_sides.push_back(side < 0 ? VOLUME_NEGATIVE : VOLUME_POSITIVE);
+	return true;
+}
+
+/**
+* TetraFraction
+* ------------------------------------------------------------------------
+* Part of a tetrahedron where the linear function of its corner values is negative. It is the
+* distribution of the function over the tetrahedron at zero, sum of f_i^3/prod(f_i - f_j) over
+* the negative corners, written with one negative or one positive corner as the product of the
+* crossings along its three edges, and with two as a divided difference that tends to a
+* derivative when both values meet.
+* @param[in] f - values at the corners
+* @return - fraction of the volume, in [0, 1]
+*/
+double DistVolume::TetraFraction(const double f[4])
+{
+	int neg[4], pos[4];
+	int nneg = 0, npos = 0;
+	for( int c = 0; c < 4; c++ )
+	{
+		if( f[c] < 0 ) neg[nneg++] = c;
+		else pos[npos++] = c;
+	}
+
+	if( nneg == 0 ) return 0;
+	if( npos == 0 ) return 1;
+
+	if( nneg == 1 || npos == 1 )
+	{
+		int lone = nneg == 1 ? neg[0] : pos[0];
+		const int *others = nneg == 1 ? pos : neg;
+		double a = f[lone], frac = 1;
+		for( int o = 0; o < 3; o++ )
+			frac *= a/(a - f[others[o]]);
+		return nneg == 1 ? frac : 1 - frac;
+	}
+
+	double a = f[neg[0]], b = f[neg[1]], c = f[pos[0]], d = f[pos[1]];
+	double frac;
+	if( std::fabs(a - b) > 1e-6*std::max(std::fabs(a), std::fabs(b)) )
+	{
+		double ga = a*a*a/((a - c)*(a - d)), gb = b*b*b/((b - c)*(b - d));
+		frac = (ga - gb)/(a - b);
+	}
+	else
+	{
+		double x = 0.5*(a + b), u = (x - c)*(x - d);
+		frac = (3*x*x*u - x*x*x*((x - c) + (x - d)))/(u*u);
+	}
+	return std::max(0.0, std::min(1.0, frac));
+}
+
+/**
+* Integrate
+* ------------------------------------------------------------------------
+* Integrates the volume of the region, column by column in parallel
+* @return - total volume, also kept with the volume of every column
+*/
+double DistVolume::Integrate()
+{
+	d_columns.clear();
+	d_total = 0;
+	if( d_fields.empty() ) return 0;
+
+	const DistCalc &g = *d_fields[0];
+	int nx = g.d_nx;
+	unsigned int ny = g.d_ny, nz = g.d_nz;
+	size_t rowsize = (size_t)nx + 1, planesize = rowsize*(ny + 1);
+	double cellvolume = g.d_size*g.d_size*g.d_size;
+	const size_t offsets[8] = { 0, 1, rowsize, rowsize + 1, planesize, planesize + 1, planesize + rowsize, planesize + rowsize + 1 };
+
+	std::vector<const double*> voxels(d_fields.size());
+	for( size_t f = 0; f < d_fields.size(); f++ )
+		voxels[f] = d_fields[f]->GetVoxels().data();
+
+	d_columns.assign((size_t)nx*ny, 0);
+	long long ncolumns = (long long)nx*ny;
+	long long col;
+#ifdef USE_OPENMP
+	#pragma omp parallel for num_threads(d_threads) schedule(dynamic, 16) private (col)
+#endif
+	for( col = 0; col < ncolumns; col++ )
+	{
+		int i = (int)(col % nx);
+		unsigned int j = (unsigned int)(col / nx);
+		double x0 = g.d_min.x + i*g.d_size, y0 = g.d_min.y + j*g.d_size;
+		double area = ColumnFraction(x0, y0, x0 + g.d_size, y0 + g.d_size);
+		if( area == 0 ) continue;
+
+		double volume = 0;
+		for( unsigned int k = 0; k < nz; k++ )
+		{
+			double z0 = g.d_min.z + k*g.d_size;
+			if( d_hascontact && z0 >= d_contact ) break;
+
+			// Value of the region at the corners: the largest of the kept sides and of the contact
+			size_t base = planesize*k + rowsize*j + i;
+			double corner[8];
+			int nneg = 0;
+			for( int c = 0; c < 8; c++ )
+			{
+				double v = d_hascontact ? z0 + (c >> 2)*g.d_size - d_contact : -std::numeric_limits<double>::max();
+				for( size_t f = 0; f < voxels.size(); f++ )
+					v = std::max(v, d_sides[f] == VOLUME_NEGATIVE ? voxels[f][base + offsets[c]] : -voxels[f][base + offsets[c]]);
+				corner[c] = v;
+				if( v < 0 ) nneg++;
+			}
+
+			if( nneg == 8 ) volume += 1;
+			else if( nneg > 0 )
+			{
+				double frac = 0;
+				for( int t = 0; t < 6; t++ )
+				{
+					double f[4] = { corner[s_tetras[t][0]], corner[s_tetras[t][1]], corner[s_tetras[t][2]], corner[s_tetras[t][3]] };
+					frac += TetraFraction(f);
+				}
+				volume += frac/6;
+			}
+		}
+		d_columns[col] = volume*area*cellvolume;
+	}
+
+	// Fixed order sum
+	for( size_t c = 0; c < d_columns.size(); c++ )
+		d_total += d_columns[c];
+	return d_total;
+}
@@ -0,0 +1,134 @@
+#include <cmath>
+#include <algorithm>
+#include "distwind.h"
+
+static const double s_fourpi = 16*atan(1.0);
+
+/**
+ * --------------------------------------------------------------------
+ * Public functions:
+ *  ___      _    _ _
+ * | _ \_  _| |__| (_)__
+ * |  _/ || | '_ \ | / _|
+ * |_|  \_,_|_.__/_|_\__|
+ * --------------------------------------------------------------------
+ */
+
+/**
+* Build
+* ------------------------------------------------------------------------
+* Sets the dipole expansion of every node of the hierarchy of a surface, from the leaves up
+* @param[in] bvh - hierarchy of the triangles, kept by reference and built from the same triangles
+* @param[in] surf - triangle mesh
+* @param[in] triangles - triangles of the mesh, indexed by their ids
+*/
+void DistWinding::Build(const DistBVH &bvh, CsiTSurf *surf, const std::vector<CsiTriangle*> &triangles)
+{
+	CsiTSurfVertexArray &vtxArray = surf->vertexArray();
+	unsigned int ntris = (unsigned int)triangles.size();
+	size_t nnodes = bvh.NumNodes();
+
+	d_bvh = &bvh;
+	d_centers.assign(nnodes, GeoPoint3D(0,0,0));
+	d_dipoles.assign(nnodes, GeoPoint3D(0,0,0));
+	d_radii.assign(nnodes, 0);
+	d_corners.clear();
+	if( nnodes == 0 ) return;
+
+	// Leaves read their triangles contiguously
+	d_corners.resize(3*(size_t)ntris);
+	for(unsigned int i = 0; i < ntris; ++i)
+	{
+		const CsiTriangle *tri = triangles[bvh.Order(i)];
+		int v[3] = { tri->v1, tri->v2, tri->v3 };
+		for(int c = 0; c < 3; ++c)
+			d_corners[3*i+c] = GeoPoint3D(vtxArray[v[c]]->x, vtxArray[v[c]]->y, vtxArray[v[c]]->z);
+	}
+
+	// Children come after their parent, so the nodes are summed from the last one back
+	std::vector<double> areas(nnodes, 0);
+	for(size_t n = nnodes; n-- > 0; )
+	{
+		const DistBVH::BVH_Node &node = bvh.Node((unsigned int)n);
+		GeoPoint3D center(0,0,0), dipole(0,0,0);
+		double area = 0;
+		if( node.count > 0 )
+		{
+			for(unsigned int i = node.first; i < node.first + node.count; ++i)
+			{
+				const GeoPoint3D *v = &d_corners[3*(size_t)i];
+				GeoPoint3D g = (1.0/3)*(v[0] + v[1] + v[2]);
+				GeoPoint3D normal = 0.5*cross(v[1] - v[0], v[2] - v[0]);
+				double a = sqrt(inner(normal, normal));
+				dipole += normal;
+				center += a*g;
+				area += a;
+			}
+		}
+		else
+		{
+			unsigned int child[2] = { node.left, node.right };
+			for(int c = 0; c < 2; ++c)
+			{
+				dipole += d_dipoles[child[c]];
+				center += areas[child[c]]*d_centers[child[c]];
+				area += areas[child[c]];
+			}
+		}
+		areas[n] = area;
+		d_dipoles[n] = dipole;
+		d_centers[n] = area > 0 ? (1/area)*center : 0.5*(node.bmin + node.bmax);
+
+		double radius = 0;
+		for(int c = 0; c < 8; ++c)
+		{
+			GeoPoint3D corner((c & 1) ? node.bmax.x : node.bmin.x, (c & 2) ? node.bmax.y : node.bmin.y, (c & 4) ? node.bmax.z : node.bmin.z);
+			GeoPoint3D r = corner - d_centers[n];
+			radius = std::max(radius, sqrt(inner(r, r)));
+		}
+		d_radii[n] = radius;
+	}
+}
+
+/**
+* Evaluate
+* ------------------------------------------------------------------------
+* Generalized winding number of the mesh at a point: far nodes contribute the solid angle of
+* their dipole, near leaves the exact solid angles of their triangles. Safe to call in parallel.
+* @param[in] p - point
+* @return - about 1 inside a closed shell with outward normals, -1 with inward ones, 0 outside
+*/
+double DistWinding::Evaluate(const GeoPoint3D &p) const
+{
+	if( d_centers.empty() ) return 0;
+
+	double w = 0;
+	d_bvh->Traverse(
+		[&](unsigned int id, const DistBVH::BVH_Node &) {
+			GeoPoint3D r = d_centers[id] - p;
+			double dist2 = inner(r, r);
+			if( dist2 <= d_beta*d_beta*d_radii[id]*d_radii[id] ) return true;
+			w += inner(r, d_dipoles[id]) / (dist2*sqrt(dist2));
+			return false;
+		},
+		[&](unsigned int, const DistBVH::BVH_Node &node) {
+			for(unsigned int i = node.first; i < node.first + node.count; ++i)
+				w += SolidAngle(d_corners[3*i] - p, d_corners[3*i+1] - p, d_corners[3*i+2] - p);
+		});
+	return w / s_fourpi;
+}
+
+/**
+* SolidAngle
+* ------------------------------------------------------------------------
+* Signed solid angle of a triangle seen from the origin (Van Oosterom and Strackee), positive
+* when the origin is behind the triangle normal
+* @param[in] a, b, c - triangle vertices, relative to the point
+*/
+double DistWinding::SolidAngle(const GeoPoint3D &a, const GeoPoint3D &b, const GeoPoint3D &c)
+{
+	double la = sqrt(inner(a, a)), lb = sqrt(inner(b, b)), lc = sqrt(inner(c, c));
+	double det = inner(a, cross(b, c));
+	double div = la*lb*lc + inner(a, b)*lc + inner(b, c)*la + inner(c, a)*lb;
+	return 2*atan2(det, div);
+}